@@ -8,9 +8,15 @@
 #define sys_icache_invalidate(addr, size) \
     __builtin___clear_cache((char *)(addr), (char *)(addr) + (size));
 
+// pc都是2字节对齐的，而且热的代码都挤在几段连续的地址里，直接取模会让它们排成一长串，
+// 线性探测的时候很快就超过MAX_SEARCH_COUNT，所以先乘一个奇数常量把高位混到低位再取高位
 static u64 hash(u64 pc) {
-    // use hash(pc) as the key of jit cache.
-    return pc % CACHE_ENTRY_SIZE;
+    return ((pc >> 1) * 0x9e3779b97f4a7c15ULL) >> (64 - __builtin_ctzll(CACHE_ENTRY_SIZE));
+}
+
+// 线性探测的下一个slot
+static u64 next(u64 index) {
+    return (index + 1) % CACHE_ENTRY_SIZE;
 }
 
 cache_t *new_cache() {
@@ -18,30 +24,46 @@ cache_t *new_cache() {
     // 使用mmap映射给cache->jitcode一大段内存，用来存放jit的code
     cache->jitcode = (u8 *)mmap(NULL, CACHE_SIZE, PROT_READ | PROT_WRITE |PROT_EXEC, 
                             MAP_ANONYMOUS | MAP_PRIVATE, -1 ,0);
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->cfg = cfg_new();
     return cache;
 }
 
 #define MAX_SEARCH_COUNT 32
 #define CACHE_HOT_COUNT 100000 // the threshold of whether hot
-#define CACHE_IS_HOT (cache->table[index].hot >= CACHE_HOT_COUNT)
+#define RECOMPILE_MAX 4        // 一个区域最多重新编译几次，之后出口再变热也不管了
+
+//
+// 探测MAX_SEARCH_COUNT次都没有空位的时候不登记这个pc，它就一直留在解释器里执行，
+// 所以所有的查找也都最多探测MAX_SEARCH_COUNT次
+//
+// 多线程：cache_lookup和cache_hot不加锁，其他的函数都要在持有cache->lock的时候调用
+// hot达到CACHE_HOT_COUNT表示这一项已经有编译好的代码了，
+// 所以只有cache_publish会把hot设置成CACHE_HOT_COUNT，而且是在offset写好之后，
+// cache_lookup先读hot再读offset，就不会看到还没有写好的代码
+// 空的项用CAS登记pc，cache_hot用CAS计数，计数不会越过CACHE_HOT_COUNT - 1
+//
 
 // 使用pc地址当做key检索jit的cache
 u8 *cache_lookup(cache_t *cache, u64 pc) {
     assert(pc != 0);
 
     u64 index = hash(pc);
-    while (cache->table[index].pc != 0) {
-        if(cache->table[index].pc == pc) {
+    u64 key;
+    for (u64 search_count = 0;
+         search_count < MAX_SEARCH_COUNT &&
+         (key = __atomic_load_n(&cache->table[index].pc, __ATOMIC_ACQUIRE)) != 0;
+         search_count++) {
+        if(key == pc) {
             // 如果是hot的话
-            if (CACHE_IS_HOT) {
+            if (__atomic_load_n(&cache->table[index].hot, __ATOMIC_ACQUIRE) >= CACHE_HOT_COUNT) {
                 // 返回cache->jitcode加上相应的pc地址对应的offset偏移
                 return cache->jitcode + cache->table[index].offset;
             }
             break;
         }
         // 线性探测定址法
-        index++;
-        index = hash(index);
+        index = next(index);
     }
     // 如果pc地址对应的这段代码没有在jitcache中缓存，或者不是hot的，那就直接返回NULL，表示没找到jit的代码
     return NULL;
@@ -54,61 +76,162 @@ static inline u64 align_to(u64 val, u64 align) {
     return (val + align - 1) & ~(align - 1);
 }
 
-// 添加一条<pc, offset>到jit cache
-u8 *cache_add(cache_t *cache, u64 pc, u8 *code, size_t sz, u64 align) {
+// 找到pc在哈希表中的那一项，没有的话登记一个空的项，探测MAX_SEARCH_COUNT次都没有位置返回NULL
+// 不拿锁的cache_hot也会登记，所以空的项用CAS抢
+static cache_item_t *cache_claim(cache_t *cache, u64 pc) {
+    u64 index = hash(pc);
+    for (u64 search_count = 0; search_count < MAX_SEARCH_COUNT; search_count++) {
+        cache_item_t *item = &cache->table[index];
+        u64 key = __atomic_load_n(&item->pc, __ATOMIC_ACQUIRE);
+        // 抢失败了key就是抢到的那个线程登记的pc
+        if (key == 0 && __atomic_compare_exchange_n(&item->pc, &key, pc, false,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return item;
+        if (key == pc) return item;
+        // 线性探测定址法
+        index = next(index);
+    }
+    return NULL;
+}
+
+// 在jitcode中分配一段空间，把code拷贝进去，不登记到哈希表里
+// 需要重定位的代码先用这个函数拷贝，重定位完成之后再cache_publish
+// jitcode用完了返回NULL，设置cache->full，以后都不再编译
+u8 *cache_alloc(cache_t *cache, u8 *code, size_t sz, u64 align) {
     cache->offset = align_to(cache->offset, align);
     // 确保在cache的jitcode中的offset位置写入sz长度的内容
     // CACHE_SIZE是在new_cache函数中alloc的jitcode的大小
-    assert(cache->offset + sz <= CACHE_SIZE);
-
-    u64 index = hash(pc);
-    u64 search_count = 0;
-    while(cache->table[index].pc != 0) {
-        if(cache->table[index].pc == pc) {
-            // 在cache中找到了相同的pc，说明在哈希表中已经缓存了pc的jit代码
-            break;
-        }
-        // 线性再探测的哈希冲突解决方法
-        index ++;
-        index = hash(index);
-        // 设置一个最大的线性探测次数阈值
-        assert(++search_count <= MAX_SEARCH_COUNT);
+    if (cache->offset + sz > CACHE_SIZE) {
+        __atomic_store_n(&cache->full, true, __ATOMIC_RELAXED);
+        return NULL;
     }
 
-    // 此时的index索引就是code要放入的那个哈希的slot
-    
-    // 把pc对应的code拷贝到cache->jitcode的相应偏移量上
-    memcpy(cache->jitcode + cache->offset, code, sz);
-    // 更新这个hash slot的值
-    cache->table[index].pc = pc;
-    cache->table[index].offset = cache->offset;
+    u8 *addr = cache->jitcode + cache->offset;
+    memcpy(addr, code, sz);
     cache->offset += sz;
     // FIXME 这个宏是干啥的
-    sys_icache_invalidate(cache->jitcode + cache->table[index].offset, sz);
-    return cache->jitcode + cache->table[index].offset;
+    sys_icache_invalidate(addr, sz);
+    return addr;
+}
+
+// 把区域里的每个入口都登记到哈希表中，指向同一段代码，从这之后cache_lookup就能找到它们了
+// 入口原来有别的区域的代码的话，换成这一段，两段都是对的
+// 区域范围里有代码的页都记下这些入口，guest改写那一页的时候cache_invalidate只看它们
+void cache_publish(cache_t *cache, mmu_t *mmu, region_t *region, u8 *code) {
+    int page_size = getpagesize();
+    for (u64 i = 0; i < region->num_entries; i++) {
+        // 在cache中找到了相同的pc的话，可能是还在计数的，也可能是别的区域编译过的
+        cache_item_t *item = cache_claim(cache, region->entries[i]);
+        // 没有位置了，这个入口不登记，从它进来的时候还是解释执行
+        if (item == NULL) continue;
+        u64 index = item - cache->table;
+
+        // 先写offset和范围，再发布hot
+        item->offset = code - cache->jitcode;
+        item->lo = region->lo;
+        item->hi = region->hi;
+        __atomic_store_n(&item->hot, CACHE_HOT_COUNT, __ATOMIC_RELEASE);
+
+        for (u64 page = ROUNDDOWN(region->lo, page_size); page < region->hi; page += page_size) {
+            if (mmu->code_pages[page / page_size] != page_code) continue;
+            pagemap_add(&cache->pages, page / page_size, index);
+        }
+    }
 }
 
 // 检查pc指针指向的这段jit cache是不是hot的；如果不是热点代码，会把哈希表中pc对应的这一项的hot值自增
+// 计数最多只到CACHE_HOT_COUNT - 1，达到这个值就返回true，由调用者拿锁、再查一次cache，然后编译、cache_publish
+// 不拿锁，每个线程每次进解释器都要调用，不能在这里抢cache->lock
 bool cache_hot(cache_t *cache, u64 pc) {
-    u64 index = hash(pc);
-    u64 search_count = 0;
+    // jitcode已经满了，编译出来也放不下，不用再计数
+    if (__atomic_load_n(&cache->full, __ATOMIC_RELAXED)) return false;
+
+    // 如果在jit cache中没有找到pc这个key，那就把pc这条记录插入到jit cache中
+    // 探测次数达到上限就不登记了，这个pc一直解释执行
+    cache_item_t *item = cache_claim(cache, pc);
+    if (item == NULL) return false;
+
+    // 更新pc对应的hot计数，已经到了CACHE_HOT_COUNT - 1的不再加，等着编译
+    u64 hot = __atomic_load_n(&item->hot, __ATOMIC_RELAXED);
+    do {
+        if (hot >= CACHE_HOT_COUNT - 1) return true;
+    } while (!__atomic_compare_exchange_n(&item->hot, &hot, hot + 1, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return hot + 1 == CACHE_HOT_COUNT - 1;
+}
+
+// 找到host地址addr所在的那段jit代码对应的guest pc，找不到返回0
+// 信号处理函数里调用，不加锁；每段代码的.text都在它自己的rodata之后，
+// 所以offset不超过addr的最后一段代码就是addr所在的那一段
+u64 cache_lookup_host(cache_t *cache, u8 *addr) {
+    u64 offset = addr - cache->jitcode;
+    u64 pc = 0, found = 0;
+    for (u64 i = 0; i < CACHE_ENTRY_SIZE; i++) {
+        cache_item_t *item = &cache->table[i];
+        if (__atomic_load_n(&item->hot, __ATOMIC_ACQUIRE) < CACHE_HOT_COUNT) continue;
+        if (item->offset > offset || (pc != 0 && item->offset < found)) continue;
+        pc = item->pc;
+        found = item->offset;
+    }
+    return pc;
+}
+
+// guest改写了[lo, hi)里的指令，和它有重叠的代码块全部作废，调用者持有cache->lock
+// 代码块之间没有直接链接，每次出一段代码都要在machine_step里重新cache_lookup，
+// 所以把hot清零就等于拆掉了所有指向它的链；旧的代码留在jitcode里，用完了的时候才回收(cache_flush)，
+// 正在执行它的线程会把这一段跑完，和真机上没有执行fence.i之前一样
+// hot从0开始重新计数，反复改写的代码会一直留在解释器里；译码过的基本块也一起作废
+// lo和hi是页对齐的，只看cache_publish在这几页上记下的入口
+static void cache_invalidate_item(cache_item_t *item, u64 lo, u64 hi) {
+    if (__atomic_load_n(&item->hot, __ATOMIC_ACQUIRE) < CACHE_HOT_COUNT) return;
+    if (item->hi <= lo || item->lo >= hi) return;
+    __atomic_store_n(&item->hot, 0, __ATOMIC_RELEASE);
+}
 
-    while(cache->table[index].pc != 0) {
-        if(cache->table[index].pc == pc) {
-            // 先更新pc对应的hot计数
-            cache->table[index].hot = MIN(++cache->table[index].hot, CACHE_HOT_COUNT);
-            return CACHE_IS_HOT;
+void cache_invalidate(cache_t *cache, u64 lo, u64 hi) {
+    int page_size = getpagesize();
+    assert(lo % page_size == 0 && hi % page_size == 0);
+    if (cache->pages.overflow) {
+        // 有的页没记下来，只能扫描整个表
+        for (u64 i = 0; i < CACHE_ENTRY_SIZE; i++) cache_invalidate_item(&cache->table[i], lo, hi);
+    } else {
+        for (u64 page = lo; page < hi; page += page_size) {
+            u32 len;
+            u32 *items = pagemap_take(&cache->pages, page / page_size, &len);
+            for (u32 i = 0; i < len; i++) cache_invalidate_item(&cache->table[items[i]], lo, hi);
         }
-        
-        // 同样的线性地址再探测
-        index++;
-        index = hash(index);
-        // assert限制线性地址再探测的次数
-        assert(search_count <= MAX_SEARCH_COUNT);
     }
-    // 如果在jit cache中没有找到pc这个key，那就把pc这条记录插入到jit cache中
-    // 然后初始化它的hot数值
-    cache->table[index].pc = pc;
-    cache->table[index].hot = 1;
-    return false;
-}
\ No newline at end of file
+    cfg_invalidate(cache->cfg, lo, hi);
+}
+
+// 让pc所在的区域重新编译：区域的每个入口都退回到马上就要编译的状态，
+// 下一次从任何一个入口进来的时候cache_hot返回true，旧的代码在这之前还能继续用
+// 入口的recompiles在cache_publish的时候保留下来，任何一个入口到了RECOMPILE_MAX就不再重新编译，
+// 返回是不是真的要重新编译，调用者持有cache->lock
+bool cache_recompile(cache_t *cache, u64 pc) {
+    u8 *code = cache_lookup(cache, pc);
+    if (code == NULL || __atomic_load_n(&cache->full, __ATOMIC_RELAXED)) return false;
+    u64 offset = code - cache->jitcode;
+    for (u64 i = 0; i < CACHE_ENTRY_SIZE; i++) {
+        cache_item_t *item = &cache->table[i];
+        if (item->hot < CACHE_HOT_COUNT || item->offset != offset) continue;
+        if (item->recompiles >= RECOMPILE_MAX) return false;
+    }
+    for (u64 i = 0; i < CACHE_ENTRY_SIZE; i++) {
+        cache_item_t *item = &cache->table[i];
+        if (item->hot < CACHE_HOT_COUNT || item->offset != offset) continue;
+        item->recompiles++;
+        __atomic_store_n(&item->hot, CACHE_HOT_COUNT - 1, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+// jitcode用完了的时候把所有编译过的代码都丢掉，从头开始用jitcode，调用者持有cache->lock
+// 调用者要保证没有别的guest线程，自己也不在jit的代码里：代码块之间没有直接链接，
+// 清空哈希表之后就不会再有人跳进旧的代码
+// 译码过的基本块和cfg_t里记下的决定都还是对的，留着
+void cache_flush(cache_t *cache) {
+    memset(cache->table, 0, sizeof(cache->table));
+    pagemap_reset(&cache->pages);
+    cache->offset = 0;
+    __atomic_store_n(&cache->full, false, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,597 @@
+#include "rvemu.h"
+
+//
+// 区域的控制流图
+// 基本块在第一次用到的时候译码，缓存在cfg_t里，以后编译别的区域的时候直接用，
+// 所以形成一个区域的开销和它包含的指令数成正比，不会因为多个区域共用一段代码而重复译码
+// guest改写代码的时候，和jit的代码一起作废(cache_invalidate)
+//
+// 区域的大小受两个预算限制，超过预算之后还没有翻译的后继都变成区域的出口：
+//   RVEMU_REGION_INSNS：指令条数，默认1024
+//   RVEMU_REGION_SOURCE：生成的C代码的字节数，默认512K，近似clang编译一个区域的开销
+//
+// 区域里的循环要保持只有一个入口(header)，clang才会把它当成循环来优化：外提不变量、展开、向量化
+// 所以登记区域入口的时候，跳进循环中间的目标不登记(见cfg_find_loops)
+//
+// 解释器在预热的时候统计每个条件跳转两个方向各走了多少次，很少走的那一边不翻译，
+// 变成退回解释器的出口(side_exit)；从某个出口退出的次数多了，记到cfg->hot_exits里，
+// 包含它的区域重新编译，以后它就一直是热的，profile里的计数被冲突清掉了也不会再变回冷的
+// jalr几乎总是跳到同一个地方的时候，推测它还会跳到那里，和直接跳转一样翻译，
+// 前面加一个比较，猜错了就退回解释器(deopt)；同一个地方猜错得多了，记到cfg->no_speculate里，
+// 重新编译，以后都不再推测
+//
+
+#define PROFILE_MIN_SAMPLES  64     // 跳转执行了这么多次之后才判断冷热
+#define PROFILE_COLD_PERCENT 1      // 少于这个比例的方向是冷的
+#define SIDE_EXIT_HOT        1000   // 从一个出口退出这么多次之后，它就不冷了
+#define DEOPT_LIMIT          100    // 一个jalr推测失败这么多次之后不再推测
+
+#define DEFAULT_MAX_INSNS  1024
+#define DEFAULT_MAX_SOURCE (512 * 1024)
+
+static u64 env_u64(const char *name, u64 def, u64 max) {
+    char *s = getenv(name);
+    if (s == NULL) return def;
+    u64 v = strtoull(s, NULL, 0);
+    return v == 0 ? def : MIN(v, max);
+}
+
+cfg_t *cfg_new() {
+    cfg_t *cfg = (cfg_t *)calloc(1, sizeof(cfg_t));
+    // 区域里的每条指令和每个出口都要放进set_t里去重，set_t最多只能用一半
+    // 检查预算是在每个块开始的时候，最后一个块还可能多出CFG_BLOCK_MAX条
+    cfg->max_insns = env_u64("RVEMU_REGION_INSNS", DEFAULT_MAX_INSNS,
+                             SET_SIZE / 2 - STACK_CAP - CFG_BLOCK_MAX);
+    cfg->max_source = env_u64("RVEMU_REGION_SOURCE", DEFAULT_MAX_SOURCE, -1);
+    return cfg;
+}
+
+static u64 hash(u64 pc) {
+    return (pc >> 1) % CFG_SIZE;
+}
+
+// 条件跳转后面有两个后继，基本块在这里结束
+static bool is_branch(insn_t *insn) {
+    return insn->type >= insn_beq && insn->type <= insn_bgeu;
+}
+
+// 从pc开始译码一个基本块
+// 翻译过的指令所在的页要去掉写权限，guest改写的时候才能知道(见mmu_protect_code)
+static void cfg_decode(cfg_block_t *block, mmu_t *mmu, u64 pc) {
+    if (block->insns == NULL) block->insns = (insn_t *)calloc(CFG_BLOCK_MAX, sizeof(insn_t));
+    block->pc = pc;
+    block->num_insns = 0;
+    block->stale = false;
+
+    while (block->num_insns < CFG_BLOCK_MAX) {
+        insn_t *insn = &block->insns[block->num_insns++];
+        // 先读一次，地址不对的话在这里触发guest的段错误，不会把保护区改成可读的
+        // 去掉写权限之后再读一次，这中间别的线程改写的指令也能读到
+        u32 data = *(volatile u32 *)TO_HOST(mmu->guest_base, pc);
+        mmu_protect_code(mmu, pc);
+        mmu_protect_code(mmu, pc + 3);
+        data = *(volatile u32 *)TO_HOST(mmu->guest_base, pc);
+        insn_decode(insn, data);
+
+        pc += insn->rvc ? 2 : 4;
+        if (insn->cont || is_branch(insn)) break;
+    }
+    block->end = pc;
+}
+
+// 表里的基本块译码之后，按页记下来，guest改写代码的时候只看那一页上的块
+// 只读的页不会被改写，不用记
+static void cfg_index(cfg_t *cfg, mmu_t *mmu, cfg_block_t *block) {
+    int page_size = getpagesize();
+    for (u64 page = ROUNDDOWN(block->pc, page_size); page < block->end; page += page_size) {
+        if (mmu->code_pages[page / page_size] != page_code) continue;
+        pagemap_add(&cfg->pages, page / page_size, block - cfg->table);
+    }
+}
+
+// 找到从pc开始的基本块，没有的话现在译码，调用者持有cache->lock
+// 跳到一个已有的基本块中间的时候，从那里开始另外译码一个，两个块有重叠也没关系，
+// 生成代码的时候每条指令只翻译一次
+cfg_block_t *cfg_block(cfg_t *cfg, mmu_t *mmu, u64 pc) {
+    u64 index = hash(pc);
+    for (u64 i = 0; i < CFG_SIZE / 64; i++) {
+        cfg_block_t *block = &cfg->table[index];
+        if (block->pc == pc) {
+            if (block->stale) {
+                cfg_decode(block, mmu, pc);
+                cfg_index(cfg, mmu, block);
+            }
+            return block;
+        }
+        if (block->pc == 0) {
+            cfg_decode(block, mmu, pc);
+            cfg_index(cfg, mmu, block);
+            return block;
+        }
+        index = (index + 1) % CFG_SIZE;
+    }
+    // 冲突太多，不缓存了
+    cfg_decode(&cfg->scratch, mmu, pc);
+    return &cfg->scratch;
+}
+
+// guest改写了[lo, hi)里的指令，和它有重叠的基本块下次用的时候重新译码，调用者持有cache->lock
+// lo和hi是页对齐的，只看这几页上记下的块；有的页没记下来的时候扫描整个表
+void cfg_invalidate(cfg_t *cfg, u64 lo, u64 hi) {
+    int page_size = getpagesize();
+    assert(lo % page_size == 0 && hi % page_size == 0);
+    if (cfg->pages.overflow) {
+        for (u64 i = 0; i < CFG_SIZE; i++) {
+            cfg_block_t *block = &cfg->table[i];
+            if (block->pc == 0 || block->end <= lo || block->pc >= hi) continue;
+            block->stale = true;
+        }
+        return;
+    }
+    for (u64 page = lo; page < hi; page += page_size) {
+        u32 len;
+        u32 *blocks = pagemap_take(&cfg->pages, page / page_size, &len);
+        for (u32 i = 0; i < len; i++) cfg->table[blocks[i]].stale = true;
+    }
+}
+
+// pc处的条件跳转跳走的百分比，没有统计过或者次数太少的时候当作一半一半
+u32 cfg_taken_percent(profile_t *profile, u64 pc) {
+    profile_t *p = &profile[(pc >> 1) % PROFILE_SIZE];
+    u64 total = (u64)p->taken + p->not_taken;
+    if (p->pc != pc || total < PROFILE_MIN_SAMPLES) return 50;
+    return p->taken * 100 / total;
+}
+
+// pc处的条件跳转往taken方向走到succ的这条边是不是冷的，没有统计过的都不算冷
+// 调用者持有cache->lock
+bool cfg_edge_cold(cfg_t *cfg, profile_t *profile, u64 pc, bool taken, u64 succ) {
+    profile_t *p = &profile[(pc >> 1) % PROFILE_SIZE];
+    if (p->pc != pc) return false;
+    u64 total = (u64)p->taken + p->not_taken;
+    if (total < PROFILE_MIN_SAMPLES) return false;
+    u64 count = taken ? p->taken : p->not_taken;
+    if (count * 100 >= total * PROFILE_COLD_PERCENT) return false;
+
+    // 解释器的统计是预热的时候的，之后从这个出口退出的多了，就不再是冷的
+    return !set_has(&cfg->hot_exits, succ);
+}
+
+// jit的代码从冷的出口退出到pc，这个线程退出的次数刚刚到SIDE_EXIT_HOT的时候返回true，
+// 调用者拿着cache->lock调用cfg_hot_exit，再让区域重新编译
+bool cfg_side_exit(profile_t *profile, u64 pc) {
+    profile_t *p = profile_of(profile, pc);
+    return ++p->side_exits == SIDE_EXIT_HOT;
+}
+
+// 退出到pc的出口变热了，以后编译的区域都要翻译它，调用者持有cache->lock
+// set满了就不记了，重新编译的次数有上限(见cache_recompile)，不会一直重新编译下去
+void cfg_hot_exit(cfg_t *cfg, u64 pc) {
+    if (cfg->hot_exits.len < SET_SIZE / 2) set_add(&cfg->hot_exits, pc);
+}
+
+static int node_cmp(const void *a, const void *b) {
+    u64 x = ((cfg_node_t *)a)->pc, y = ((cfg_node_t *)b)->pc;
+    return x < y ? -1 : x > y;
+}
+
+// pc处的jalr几乎总是跳到同一个地方，而且没有因为推测失败太多被拉黑，返回那个地址，否则返回0
+// 调用者持有cache->lock
+u64 cfg_jalr_target(cfg_t *cfg, profile_t *profile, u64 pc) {
+    if (set_has(&cfg->no_speculate, pc)) return 0;
+    profile_t *p = &profile[(pc >> 1) % PROFILE_SIZE];
+    if (p->pc != pc || p->target_hits < PROFILE_MIN_SAMPLES) return 0;
+    if ((u64)p->target_misses * 100 >= (u64)p->target_hits * PROFILE_COLD_PERCENT) return 0;
+    return p->target;
+}
+
+// pc处的jalr推测失败了，这个线程的次数刚到上限的时候返回true，
+// 调用者拿着cache->lock调用cfg_no_speculate，再让区域重新编译
+bool cfg_deopt(profile_t *profile, u64 pc) {
+    profile_t *p = profile_of(profile, pc);
+    return ++p->deopts == DEOPT_LIMIT;
+}
+
+// pc处的jalr以后都不再推测，调用者持有cache->lock
+// set满了就不记了，重新编译的次数有上限，最多就是一直带着这个推测
+void cfg_no_speculate(cfg_t *cfg, u64 pc) {
+    if (cfg->no_speculate.len < SET_SIZE / 2) set_add(&cfg->no_speculate, pc);
+}
+
+// 跳转表：编译器把switch翻译成先检查下标的范围，再从只读段里的表中取出目标跳过去
+//       li   a5, N                 c.li也一样
+//       bgtu a0, a5, default       也就是bltu a5, a0，下标在[0, N]；或者bgeu a0, a5，下标在[0, N)
+//   block:
+//       slli a0, a0, 2
+//       lui  a5, %hi(table)        或者auipc
+//       addi a5, a5, %lo(table)
+//       add  a0, a0, a5            或者sh2add
+//       lw   a0, 0(a0)
+//       add  a0, a0, a5            表里放的是相对表的偏移的时候才有
+//       jr   a0
+// 在块里做一个很小的符号执行，看jr的地址是不是从表里取出来的，下标是不是块开始的时候的某个寄存器，
+// 再看块前面的条件跳转给出的下标范围。表和目标都必须在elf的只读段里，guest改不了
+enum { sym_any, sym_const, sym_index, sym_load };
+
+typedef struct {
+    u8 kind;
+    u8 reg;                 // sym_index、sym_load：块开始的时候这个寄存器里是下标
+    u8 shift;               // 下标左移的位数
+    u8 width;               // sym_load：表项的字节数
+    bool sign;              // sym_load：表项是不是有符号扩展
+    u64 base;               // sym_const的值；sym_index是base + (下标 << shift)；sym_load是表的地址
+    u64 add;                // sym_load：取出来之后再加上的值
+} sym_t;
+
+static bool readonly(mmu_t *mmu, u64 addr, u64 len) {
+    u64 page_size = getpagesize();
+    for (u64 page = addr / page_size; page <= (addr + len - 1) / page_size; page++) {
+        if (page >= GUEST_SLOT_SIZE / page_size || mmu->code_pages[page] != page_readonly) return false;
+    }
+    return true;
+}
+
+static sym_t sym_add(sym_t a, sym_t b) {
+    if (a.kind != sym_const) {
+        sym_t t = a;
+        a = b;
+        b = t;
+    }
+    if (a.kind != sym_const) return (sym_t){ sym_any };
+    if (b.kind == sym_const || b.kind == sym_index) b.base += a.base;
+    else if (b.kind == sym_load) b.add += a.base;
+    return b;
+}
+
+static sym_t sym_shift(sym_t a, u64 shift) {
+    if (a.kind == sym_const) return (sym_t){ sym_const, .base = a.base << shift };
+    if (a.kind != sym_index || a.base != 0 || a.shift + shift > 3) return (sym_t){ sym_any };
+    a.shift += shift;
+    return a;
+}
+
+// 块前面的条件跳转和它前面的li给出下标的个数，认不出来的时候返回0
+static u64 jump_table_size(mmu_t *mmu, u64 pc, u8 index) {
+    if (!readonly(mmu, pc - 8, 8)) return 0;
+    u32 data = *(u32 *)TO_HOST(mmu->guest_base, pc - 4);
+    if ((data & 0x7f) != 0x63) return 0;
+    u32 funct3 = (data >> 12) & 0x7, rs1 = (data >> 15) & 0x1f, rs2 = (data >> 20) & 0x1f;
+    u32 bound;
+    bool inclusive;
+    if (funct3 == 0x6 && rs2 == index) bound = rs1, inclusive = true;            // bltu
+    else if (funct3 == 0x7 && rs1 == index) bound = rs2, inclusive = false;      // bgeu
+    else return 0;
+    if (bound == 0) return 0;
+
+    i64 n;
+    u32 li = *(u32 *)TO_HOST(mmu->guest_base, pc - 8);
+    u16 cli = *(u16 *)TO_HOST(mmu->guest_base, pc - 6);
+    if ((li & 0xff07f) == 0x13 && ((li >> 7) & 0x1f) == bound) {                 // addi bound, zero, N
+        n = (i32)li >> 20;
+    } else if ((cli & 0xe003) == 0x4001 && ((cli >> 7) & 0x1f) == bound) {      // c.li bound, N
+        n = ((i64)(((cli >> 12) & 1) << 5 | ((cli >> 2) & 0x1f)) << 58) >> 58;
+    } else {
+        return 0;
+    }
+    if (n < 0) return 0;
+    return inclusive ? n + 1 : n;
+}
+
+// block以一个从跳转表取目标的jr结束的话，把表里所有不同的目标放到targets里，返回个数，否则返回0
+u32 cfg_jump_table(mmu_t *mmu, cfg_block_t *block, u64 *targets) {
+    insn_t *jr = &block->insns[block->num_insns - 1];
+    if (jr->type != insn_jalr || jr->rd != zero) return 0;
+
+    sym_t regs[32];
+    for (u8 r = 0; r < 32; r++) regs[r] = (sym_t){ sym_index, .reg = r };
+    regs[zero] = (sym_t){ sym_const };
+
+    u64 pc = block->pc;
+    for (u32 i = 0; i + 1 < block->num_insns; i++) {
+        insn_t *insn = &block->insns[i];
+        sym_t a = regs[insn->rs1], b = regs[insn->rs2];
+        sym_t imm = { sym_const, .base = (u64)(i64)insn->imm };
+        sym_t v = { sym_any };
+        switch (insn->type) {
+        case insn_lui:    v = imm; break;
+        case insn_auipc:  v = (sym_t){ sym_const, .base = pc + (i64)insn->imm }; break;
+        case insn_addi:   v = sym_add(a, imm); break;
+        case insn_add:    v = sym_add(a, b); break;
+        case insn_slli:   v = sym_shift(a, insn->imm); break;
+        case insn_sh1add: v = sym_add(sym_shift(a, 1), b); break;
+        case insn_sh2add: v = sym_add(sym_shift(a, 2), b); break;
+        case insn_sh3add: v = sym_add(sym_shift(a, 3), b); break;
+        case insn_lw:
+        case insn_lwu:
+        case insn_ld: {
+            u8 width = insn->type == insn_ld ? 8 : 4;
+            if (a.kind != sym_index || (1 << a.shift) != width) break;
+            v = (sym_t){ sym_load, a.reg, a.shift, width, insn->type == insn_lw, a.base + (i64)insn->imm, 0 };
+            break;
+        }
+        default: break;
+        }
+        // 不认识的指令都当作写了rd，宁可认不出来
+        if (insn->rd != zero) regs[insn->rd] = v;
+        pc += insn->rvc ? 2 : 4;
+    }
+
+    sym_t t = sym_add(regs[jr->rs1], (sym_t){ sym_const, .base = (u64)(i64)jr->imm });
+    if (t.kind != sym_load) return 0;
+    u64 n = jump_table_size(mmu, block->pc, t.reg);
+    if (n == 0 || n > JUMP_TABLE_MAX || !readonly(mmu, t.base, n * t.width)) return 0;
+
+    u32 num = 0;
+    for (u64 i = 0; i < n; i++) {
+        u8 *entry = (u8 *)TO_HOST(mmu->guest_base, t.base + i * t.width);
+        u64 val = t.width == 8 ? *(u64 *)entry : t.sign ? (u64)(i64)*(i32 *)entry : *(u32 *)entry;
+        u64 target = (val + t.add) & ~(u64)1;
+        if (!readonly(mmu, target, 2)) return 0;
+        bool dup = false;
+        for (u32 j = 0; j < num; j++) dup |= targets[j] == target;
+        if (!dup) targets[num++] = target;
+    }
+    return num;
+}
+
+// 只有一个基本块、最后跳回自己开头的循环，循环体只能是下面这几种指令：
+//     lb/lbu t, a(src)     最多一个
+//     sb v, b(dst)         最多一个
+//     addi p, p, 1         指针，src、dst各一个
+//     addi c, c, -1        计数器，最多一个
+// 再按照条件跳转和有没有读写分成拷贝、填充、扫描。循环里写的寄存器只能是这些，
+// 才能在换成host的函数之后把最后的寄存器算出来，和一次一次执行完全一样
+bool cfg_idiom(cfg_block_t *block, idiom_t *idiom) {
+    u32 n = block->num_insns;
+    if (n < 3 || n > 8) return false;
+    insn_t *br = &block->insns[n - 1];
+    u64 br_pc = block->end - (br->rvc ? 2 : 4);
+    if ((br->type != insn_bne && br->type != insn_bltu) || br_pc + (i64)br->imm != block->pc) {
+        return false;
+    }
+
+    memset(idiom, 0, sizeof(idiom_t));
+    idiom->num_insns = n;
+    u8 delta[32] = {0};             // 执行到这里的时候，每个寄存器已经加了多少
+    u8 writes[32] = {0};
+    u8 inc = 0, dec = 0;
+    bool load = false, store = false;
+    for (u32 i = 0; i + 1 < n; i++) {
+        insn_t *insn = &block->insns[i];
+        switch (insn->type) {
+        case insn_addi:
+            if (insn->rd == zero || insn->rd != insn->rs1) return false;
+            if (insn->imm == 1) {
+                delta[insn->rd] = 1;
+                inc++;
+            } else if (insn->imm == -1) {
+                idiom->counter = insn->rd;
+                dec++;
+            } else {
+                return false;
+            }
+            writes[insn->rd]++;
+            break;
+        case insn_lb:
+        case insn_lbu:
+            if (load || store || insn->rd == zero || insn->rd == insn->rs1) return false;
+            load = true;
+            idiom->src = insn->rs1;
+            idiom->src_off = delta[insn->rs1] + (i64)insn->imm;
+            idiom->val = insn->rd;
+            idiom->sign = insn->type == insn_lb;
+            writes[insn->rd]++;
+            break;
+        case insn_sb:
+            if (store) return false;
+            store = true;
+            idiom->dst = insn->rs1;
+            idiom->dst_off = delta[insn->rs1] + (i64)insn->imm;
+            // 拷贝的时候写的是刚读出来的字节，填充的时候是一个不变的值
+            if (load && insn->rs2 != idiom->val) return false;
+            if (!load) idiom->val = insn->rs2;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    if (dec > 1) return false;
+    for (u8 r = 1; r < 32; r++) {
+        if (writes[r] > 1) return false;
+    }
+    // 读写的指针都必须每次加1，也没有别的每次加1的寄存器
+    if (load && (idiom->src == zero || !delta[idiom->src])) return false;
+    if (store && (idiom->dst == zero || !delta[idiom->dst])) return false;
+    if (inc != (load ? 1 : 0) + (store ? 1 : 0) || (load && store && idiom->src == idiom->dst)) return false;
+    if (load && store) idiom->kind = idiom_copy;
+    else if (store) idiom->kind = idiom_fill;
+    else if (load) idiom->kind = idiom_scan;
+    else return false;
+    if (idiom->kind == idiom_fill && writes[idiom->val]) return false;
+
+    u8 a = br->rs1, b = br->rs2;
+    if (a == zero) {
+        a = b;
+        b = zero;
+    }
+    if (br->type == insn_bne && b == zero && dec && a == idiom->counter) {
+        idiom->cond = cond_counter;
+    } else if (br->type == insn_bne && b == zero && load && a == idiom->val && !dec) {
+        idiom->cond = cond_zero;
+    } else if (br->type == insn_bne && idiom->kind == idiom_scan && !idiom->sign && !dec &&
+               (a == idiom->val || b == idiom->val)) {
+        idiom->end = a == idiom->val ? b : a;
+        idiom->cond = cond_chr;
+    } else if (!dec && b != zero && delta[a] && (a == idiom->src || a == idiom->dst)) {
+        idiom->ptr = a;
+        idiom->end = b;
+        idiom->cond = br->type == insn_bne ? cond_ne : cond_lt;
+    } else if (!dec && br->type == insn_bne && b != zero && delta[b] && (b == idiom->src || b == idiom->dst)) {
+        idiom->ptr = b;
+        idiom->end = a;
+        idiom->cond = cond_ne;
+    } else {
+        return false;
+    }
+    if (idiom->kind == idiom_scan && idiom->cond != cond_zero && idiom->cond != cond_chr) return false;
+    if ((idiom->cond == cond_ne || idiom->cond == cond_lt || idiom->cond == cond_chr) && writes[idiom->end]) {
+        return false;
+    }
+    return true;
+}
+
+// 区域里pc处的指令，调用过cfg_find_loops之后才能用
+cfg_node_t *cfg_node(cfg_graph_t *graph, u64 pc) {
+    cfg_node_t key = { .pc = pc };
+    return (cfg_node_t *)bsearch(&key, graph->nodes, graph->num_nodes, sizeof(cfg_node_t), node_cmp);
+}
+
+// 下面这些都是节点的下标，-1表示没有
+static i32 succs[REGION_MAX_SUCCS];
+static u32 order[REGION_MAX_INSNS];         // 从start能走到的节点，逆后序
+static i32 rpo[REGION_MAX_INSNS];           // 节点在order里的位置
+static i32 idom[REGION_MAX_INSNS];          // 直接必经节点
+static u32 pred_start[REGION_MAX_INSNS + 1];
+static u32 preds[REGION_MAX_SUCCS];
+static u32 work[REGION_MAX_INSNS];
+static u32 next_succ[REGION_MAX_INSNS];
+static u32 mark[REGION_MAX_INSNS];
+static u32 stamp = 0;
+
+static i32 intersect(i32 a, i32 b) {
+    while (a != b) {
+        while (rpo[a] > rpo[b]) a = idom[a];
+        while (rpo[b] > rpo[a]) b = idom[b];
+    }
+    return a;
+}
+
+static bool dominates(i32 h, i32 u, i32 root) {
+    while (u != h && u != root) u = idom[u];
+    return u == h;
+}
+
+// 找出区域里的自然循环：回边u->h，h是u的必经节点，循环体是不经过h能走到u的所有节点
+// 循环体里除了header以外的节点标成inner，从外面直接跳到这些节点，循环就有了第二个入口
+// 每个节点记下包含它的最里层的循环，每个header记下外面一层的循环，machine_genblock按这个嵌套生成for循环
+// 会把graph->nodes按pc排序，返回循环的个数，调用者持有cache->lock
+u64 cfg_find_loops(cfg_graph_t *graph, u64 start) {
+    u32 n = graph->num_nodes;
+    qsort(graph->nodes, n, sizeof(cfg_node_t), node_cmp);
+    for (u32 i = 0; i < n; i++) {
+        graph->nodes[i].inner = false;
+        graph->nodes[i].loop = graph->nodes[i].parent = 0;
+    }
+    cfg_node_t *root_node = cfg_node(graph, start);
+    if (root_node == NULL) return 0;
+    i32 root = root_node - graph->nodes;
+
+    for (u32 i = 0; i < n; i++) {
+        cfg_node_t *node = &graph->nodes[i];
+        for (u32 k = node->first_succ; k < node->first_succ + node->num_succ; k++) {
+            cfg_node_t *s = cfg_node(graph, graph->succs[k]);
+            succs[k] = s == NULL ? -1 : s - graph->nodes;
+        }
+        rpo[i] = -1;
+        next_succ[i] = 0;
+        idom[i] = -1;
+    }
+
+    // 深度优先，出栈的顺序是后序
+    u32 num = 0, top = 0;
+    work[top++] = root;
+    rpo[root] = -2;
+    while (top > 0) {
+        u32 v = work[top - 1];
+        cfg_node_t *node = &graph->nodes[v];
+        if (next_succ[v] < node->num_succ) {
+            i32 s = succs[node->first_succ + next_succ[v]++];
+            if (s >= 0 && rpo[s] == -1) {
+                rpo[s] = -2;
+                work[top++] = s;
+            }
+            continue;
+        }
+        top--;
+        order[num++] = v;
+    }
+    for (u32 i = 0; i < num / 2; i++) {
+        u32 t = order[i];
+        order[i] = order[num - 1 - i];
+        order[num - 1 - i] = t;
+    }
+    for (u32 i = 0; i < num; i++) rpo[order[i]] = i;
+
+    // 前驱，只算走得到的节点
+    memset(pred_start, 0, (n + 1) * sizeof(u32));
+    for (u32 i = 0; i < num; i++) {
+        cfg_node_t *node = &graph->nodes[order[i]];
+        for (u32 k = node->first_succ; k < node->first_succ + node->num_succ; k++) {
+            if (succs[k] >= 0) pred_start[succs[k] + 1]++;
+        }
+    }
+    for (u32 i = 0; i < n; i++) pred_start[i + 1] += pred_start[i];
+    memcpy(work, pred_start, n * sizeof(u32));
+    for (u32 i = 0; i < num; i++) {
+        cfg_node_t *node = &graph->nodes[order[i]];
+        for (u32 k = node->first_succ; k < node->first_succ + node->num_succ; k++) {
+            if (succs[k] >= 0) preds[work[succs[k]]++] = order[i];
+        }
+    }
+
+    // 必经节点，Cooper、Harvey、Kennedy的迭代算法，按逆后序算几遍就收敛了
+    idom[root] = root;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (u32 i = 1; i < num; i++) {
+            u32 b = order[i];
+            i32 d = -1;
+            for (u32 j = pred_start[b]; j < pred_start[b + 1]; j++) {
+                i32 p = preds[j];
+                if (idom[p] == -1) continue;
+                d = d == -1 ? p : intersect(d, p);
+            }
+            if (d != idom[b]) {
+                idom[b] = d;
+                changed = true;
+            }
+        }
+    }
+
+    // 每个header把它所有回边的循环体都标出来
+    // 外层循环的header是内层的必经节点，逆后序里在前面，所以最后一次标上的就是最里层的循环
+    u64 loops = 0;
+    for (u32 i = 0; i < num; i++) {
+        i32 h = order[i];
+        bool header = false;
+        stamp++;
+        mark[h] = stamp;
+        for (u32 j = pred_start[h]; j < pred_start[h + 1]; j++) {
+            i32 u = preds[j];
+            if (!dominates(h, u, root)) continue;
+            header = true;
+            if (mark[u] == stamp) continue;
+            mark[u] = stamp;
+            top = 0;
+            work[top++] = u;
+            while (top > 0) {
+                u32 v = work[--top];
+                graph->nodes[v].inner = true;
+                graph->nodes[v].loop = graph->nodes[h].pc;
+                for (u32 k = pred_start[v]; k < pred_start[v + 1]; k++) {
+                    if (mark[preds[k]] == stamp) continue;
+                    mark[preds[k]] = stamp;
+                    work[top++] = preds[k];
+                }
+            }
+        }
+        if (header) {
+            // 到这里它的loop还是外面一层的循环
+            graph->nodes[h].parent = graph->nodes[h].loop;
+            graph->nodes[h].loop = graph->nodes[h].pc;
+        }
+        loops += header;
+    }
+    return loops;
+}
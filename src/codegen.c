@@ -58,7 +58,7 @@ static str_t tracer_append_epilogue(tracer_t *t, str_t s) {
     return s;
 }
 
-static char funcbuf[128] = {0};
+static char funcbuf[256] = {0};
 static char funcbuf2[128] = {0};
 
 #define REG_SET_VAL(reg, val)                                 \
@@ -101,6 +101,23 @@ static str_t func_empty(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
     return s;
 }
 
+// 结束这段代码，从这条指令开始交给解释器执行
+// 进入这条指令的时候已经计了instret，它要在解释器里重新执行，由解释器计数
+static str_t exit_to_interp(str_t s, insn_t *insn, u64 pc) {
+    s = str_append(s, "    instret--;\n");
+    s = str_append(s, "    state->exit_reason = interp;\n");
+    sprintf(funcbuf, "    state->reenter_pc = %luULL;\n", pc);
+    s = str_append(s, funcbuf);
+    s = str_append(s, "    goto end;\n");
+    s = str_append(s, "}\n");
+    insn->cont = true;
+    return s;
+}
+
+// 生成的代码总是运行在frm对应的host舍入模式下，带了静态舍入模式的指令交给解释器
+#define FP_STATIC_RM()                                            \
+    if (insn->rm != FRM_DYN) return exit_to_interp(s, insn, pc); \
+
 #define FUNC(typ)                                              \
     REG_GET(insn->rs1, rs1);                                   \
     sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm); \
@@ -381,11 +398,21 @@ static str_t func_lui(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u
     return s;
 }
 
+// 解释器统计的这条跳转跳走的百分比，machine_genblock在翻译条件跳转之前设置
+// 偏向很明显的时候告诉clang，让比较可能走的一边紧跟在跳转后面
+static u32 taken_percent = 50;
+#define LIKELY_PERCENT 90
+
 #define FUNC(typ, op)                                                  \
     REG_GET(insn->rs1, rs1);                                           \
     REG_GET(insn->rs2, rs2);                                           \
     u64 target_addr = pc + (i64)insn->imm;                             \
-    sprintf(funcbuf, "    if ((%s)rs1 %s (%s)rs2) {\n", typ, op, typ); \
+    if (taken_percent >= LIKELY_PERCENT)                               \
+        sprintf(funcbuf, "    if (__builtin_expect((%s)rs1 %s (%s)rs2, 1)) {\n", typ, op, typ); \
+    else if (taken_percent <= 100 - LIKELY_PERCENT)                    \
+        sprintf(funcbuf, "    if (__builtin_expect((%s)rs1 %s (%s)rs2, 0)) {\n", typ, op, typ); \
+    else                                                               \
+        sprintf(funcbuf, "    if ((%s)rs1 %s (%s)rs2) {\n", typ, op, typ); \
     s = str_append(s, funcbuf);                                        \
     sprintf(funcbuf, "        goto insn_%lx;\n", target_addr);         \
     s = str_append(s, funcbuf);                                        \
@@ -420,11 +447,69 @@ static str_t func_bgeu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
 
 #undef FUNC
 
+// 解释器看到这条jalr几乎总是跳到同一个地方的时候，machine_genblock把那个地址放在这里，否则是0
+static u64 speculated_target = 0;
+// 这条jalr是从跳转表里取的目标的时候，表里所有的目标
+static u64 jump_targets[JUMP_TABLE_MAX];
+static u32 num_jump_targets = 0;
+// 这条jalr是函数返回(ret)，跳到区域末尾的ret_dispatch，按ra分到区域里的各个调用点
+static bool return_dispatch = false;
+
 static str_t func_jalr(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
     u64 return_addr = pc + (insn->rvc ? 2 : 4);
     REG_GET(insn->rs1, rs1);
     REG_SET_VAL(insn->rd, return_addr);
 
+    // 猜对了就当作直接跳转，在区域里接着执行；猜错了和普通的间接跳转一样写回状态退出，
+    // 只是exit_reason不一样，machine_step从真正的目标开始解释执行，并且记下这次失败
+    if (speculated_target != 0) {
+        sprintf(funcbuf, "    uint64_t target = (rs1 + (int64_t)%ldLL) & ~(uint64_t)1;\n",
+                (i64)insn->imm);
+        s = str_append(s, funcbuf);
+        sprintf(funcbuf, "    if (__builtin_expect(target == %luULL, 1)) goto insn_%lx;\n",
+                speculated_target, speculated_target);
+        s = str_append(s, funcbuf);
+        s = str_append(s, "    state->exit_reason = deopt;\n");
+        s = str_append(s, "    state->reenter_pc = target;\n");
+        sprintf(funcbuf, "    state->deopt_pc = %luULL;\n", pc);
+        s = str_append(s, funcbuf);
+        s = str_append(s, "    goto end;\n");
+        s = str_append(s, "}\n");
+        stack_push(stack, speculated_target);
+        tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rd, -1);
+        return s;
+    }
+
+    if (return_dispatch) {
+        sprintf(funcbuf, "    ret_target = (rs1 + (int64_t)%ldLL) & ~(uint64_t)1;\n", (i64)insn->imm);
+        s = str_append(s, funcbuf);
+        s = str_append(s, "    goto ret_dispatch;\n");
+        s = str_append(s, "}\n");
+        tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rd, -1);
+        return s;
+    }
+
+    // 跳转表的目标都在区域里，clang可以把这个switch再编译成host的跳转表；
+    // 不在表里的目标(不会发生，除非guest跳过了范围检查)和普通的间接跳转一样退出
+    if (num_jump_targets != 0) {
+        sprintf(funcbuf, "    uint64_t target = (rs1 + (int64_t)%ldLL) & ~(uint64_t)1;\n",
+                (i64)insn->imm);
+        s = str_append(s, funcbuf);
+        s = str_append(s, "    switch (target) {\n");
+        for (u32 i = 0; i < num_jump_targets; i++) {
+            sprintf(funcbuf, "    case %luULL: goto insn_%lx;\n", jump_targets[i], jump_targets[i]);
+            s = str_append(s, funcbuf);
+            stack_push(stack, jump_targets[i]);
+        }
+        s = str_append(s, "    }\n");
+        s = str_append(s, "    state->exit_reason = indirect_branch;\n");
+        s = str_append(s, "    state->reenter_pc = target;\n");
+        s = str_append(s, "    goto end;\n");
+        s = str_append(s, "}\n");
+        tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rd, -1);
+        return s;
+    }
+
     s = str_append(s, "    state->exit_reason = indirect_branch;\n");
     sprintf(funcbuf, "    state->reenter_pc = (rs1 + (int64_t)%ldLL) & ~(uint64_t)1;\n",
             (i64)insn->imm);
@@ -449,6 +534,17 @@ static str_t func_jal(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u
     return s;
 }
 
+// 后面的指令可能刚被改写过，先退出这段代码，回到machine_step重新查cache
+// 改写的时候已经通过写保护把旧的代码块作废了，这里不用再做别的
+static str_t func_fence_i(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    s = str_append(s, "    state->exit_reason = direct_branch;\n");
+    sprintf(funcbuf, "    state->reenter_pc = %luULL;\n", pc + 4);
+    s = str_append(s, funcbuf);
+    s = str_append(s, "    goto end;\n");
+    s = str_append(s, "}\n");
+    return s;
+}
+
 static str_t func_ecall(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
     s = str_append(s, "    state->exit_reason = ecall;\n");
     sprintf(funcbuf, "    state->reenter_pc = %luULL;\n", pc + 4);
@@ -458,20 +554,9 @@ static str_t func_ecall(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
     return s;
 }
 
-#define FUNC()                                         \
-    switch (insn->csr) {                               \
-    case fflags:                                       \
-    case frm:                                          \
-    case fcsr:                                         \
-        break;                                         \
-    default: fatal("unsupported csr");                 \
-    }                                                  \
-    if (insn->rd) {                                    \
-        sprintf(funcbuf, "    x%d = 0;\n", insn->rd);  \
-        tracer_add_gp_reg_usage(tracer, insn->rd, -1); \
-        s = str_append(s, funcbuf);                    \
-    }                                                  \
-    return s;                                          \
+// fflags要从host的MXCSR里收集，写frm要切换host的舍入模式，都交给解释器
+#define FUNC() \
+    return exit_to_interp(s, insn, pc); \
 
 static str_t func_csrrw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
     FUNC();
@@ -537,54 +622,57 @@ static str_t func_fsd(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u
 
 #undef FUNC
 
-#define FUNC(expr)                                                                  \
-    FREG_GET(insn->rs1, rs1, float, f);                                             \
-    FREG_GET(insn->rs2, rs2, float, f);                                             \
-    FREG_GET(insn->rs3, rs3, float, f);                                             \
-    FREG_SET_EXPR(insn->rd, expr, f);                                               \
+// host有FMA的时候生成的代码用-mfma编译，__builtin_fma就是一条vfmadd
+// 没有FMA的时候clang会生成对fma()的调用，生成的代码没有办法链接libm，所以交给解释器
+// x86的NaN会保留输入的payload，RISC-V要求结果是canonical NaN
+#define FUNC(typ, field, fma, nan, expr)                                            \
+    if (!cpu_has(CPU_FMA)) return exit_to_interp(s, insn, pc);                     \
+    FREG_GET(insn->rs1, rs1, typ, field);                                           \
+    FREG_GET(insn->rs2, rs2, typ, field);                                           \
+    FREG_GET(insn->rs3, rs3, typ, field);                                           \
+    s = str_append(s, "    " #typ " rd = " fma "(" expr ");\n");                    \
+    FREG_SET_EXPR(insn->rd, "rd != rd ? " nan " : rd", field);                     \
     tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rs3, insn->rd, -1); \
     return s;                                                                       \
 
 static str_t func_fmadd_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC("rs1 * rs2 + rs3");
+    FP_STATIC_RM();
+    FUNC(float, f, "__builtin_fmaf", "__builtin_nanf(\"\")", "rs1, rs2, rs3");
 }
 
 static str_t func_fmsub_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC("rs1 * rs2 - rs3");
+    FP_STATIC_RM();
+    FUNC(float, f, "__builtin_fmaf", "__builtin_nanf(\"\")", "rs1, rs2, -rs3");
 }
 
 static str_t func_fnmsub_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC("-(rs1 * rs2) + rs3");
+    FP_STATIC_RM();
+    FUNC(float, f, "__builtin_fmaf", "__builtin_nanf(\"\")", "-rs1, rs2, rs3");
 }
 
 static str_t func_fnmadd_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC("-(rs1 * rs2) - rs3");
+    FP_STATIC_RM();
+    FUNC(float, f, "__builtin_fmaf", "__builtin_nanf(\"\")", "-rs1, rs2, -rs3");
 }
 
-#undef FUNC
-
-#define FUNC(expr)                                                                   \
-    FREG_GET(insn->rs1, rs1, double, d);                                             \
-    FREG_GET(insn->rs2, rs2, double, d);                                             \
-    FREG_GET(insn->rs3, rs3, double, d);                                             \
-    FREG_SET_EXPR(insn->rd, expr, d);                                                \
-    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rs3, insn->rd, -1);  \
-    return s;                                                                        \
-
 static str_t func_fmadd_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC("rs1 * rs2 + rs3");
+    FP_STATIC_RM();
+    FUNC(double, d, "__builtin_fma", "__builtin_nan(\"\")", "rs1, rs2, rs3");
 }
 
 static str_t func_fmsub_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC("rs1 * rs2 - rs3");
+    FP_STATIC_RM();
+    FUNC(double, d, "__builtin_fma", "__builtin_nan(\"\")", "rs1, rs2, -rs3");
 }
 
 static str_t func_fnmsub_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC("-(rs1 * rs2) + rs3");
+    FP_STATIC_RM();
+    FUNC(double, d, "__builtin_fma", "__builtin_nan(\"\")", "-rs1, rs2, rs3");
 }
 
 static str_t func_fnmadd_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC("-(rs1 * rs2) - rs3");
+    FP_STATIC_RM();
+    FUNC(double, d, "__builtin_fma", "__builtin_nan(\"\")", "-rs1, rs2, -rs3");
 }
 
 #undef FUNC
@@ -597,32 +685,37 @@ static str_t func_fnmadd_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *sta
     return s;                                                            \
 
 static str_t func_fadd_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     FUNC("rs1 + rs2");
 }
 
 static str_t func_fsub_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     FUNC("rs1 - rs2");
 }
 
 static str_t func_fmul_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     FUNC("rs1 * rs2");
 }
 
 static str_t func_fdiv_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     FUNC("rs1 / rs2");
 }
 
 static str_t func_fmin_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC("rs1 < rs2 ? rs1 : rs2");
+    FUNC("FMIN(rs1, rs2, __builtin_nanf(\"\"))");
 }
 
 static str_t func_fmax_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC("rs1 > rs2 ? rs1 : rs2");
+    FUNC("FMAX(rs1, rs2, __builtin_nanf(\"\"))");
 }
 
 #undef FUNC
 
 static str_t func_fcvt_s_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(float)(int32_t)rs1", f);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -631,6 +724,7 @@ static str_t func_fcvt_s_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *sta
 }
 
 static str_t func_fcvt_s_wu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(float)(uint32_t)rs1", f);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -732,6 +826,7 @@ static str_t func_fle_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack,
 #undef FUNC
 
 static str_t func_fcvt_s_l(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(float)(int64_t)rs1", f);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -740,6 +835,7 @@ static str_t func_fcvt_s_l(str_t s, insn_t *insn, tracer_t *tracer, stack_t *sta
 }
 
 static str_t func_fcvt_s_lu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(float)(uint64_t)rs1", f);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -755,32 +851,37 @@ static str_t func_fcvt_s_lu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *st
     return s;                                                            \
 
 static str_t func_fadd_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     FUNC("rs1 + rs2");
 }
 
 static str_t func_fsub_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     FUNC("rs1 - rs2");
 }
 
 static str_t func_fmul_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     FUNC("rs1 * rs2");
 }
 
 static str_t func_fdiv_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     FUNC("rs1 / rs2");
 }
 
 static str_t func_fmin_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC("rs1 < rs2 ? rs1 : rs2");
+    FUNC("FMIN(rs1, rs2, __builtin_nan(\"\"))");
 }
 
 static str_t func_fmax_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
-    FUNC("rs1 > rs2 ? rs1 : rs2");
+    FUNC("FMAX(rs1, rs2, __builtin_nan(\"\"))");
 }
 
 #undef FUNC
 
 static str_t func_fcvt_s_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     FREG_GET(insn->rs1, rs1, double, d);
     FREG_SET_EXPR(insn->rd, "(float)rs1", f);
     tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rd, -1);
@@ -795,6 +896,7 @@ static str_t func_fcvt_d_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *sta
 }
 
 static str_t func_fcvt_d_l(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(double)(int64_t)rs1", d);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -803,6 +905,7 @@ static str_t func_fcvt_d_l(str_t s, insn_t *insn, tracer_t *tracer, stack_t *sta
 }
 
 static str_t func_fcvt_d_lu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
     REG_GET(insn->rs1, rs1);
     FREG_SET_EXPR(insn->rd, "(double)(uint64_t)rs1", d);
     tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
@@ -811,13 +914,7 @@ static str_t func_fcvt_d_lu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *st
 }
 
 #define FUNC() \
-    s = str_append(s, "    state->exit_reason = interp;\n");   \
-    sprintf(funcbuf, "    state->reenter_pc = %luULL;\n", pc); \
-    s = str_append(s, funcbuf);                                \
-    s = str_append(s, "    goto end;\n");                      \
-    s = str_append(s, "}\n");                                  \
-    insn->cont = true;                                         \
-    return s;                                                  \
+    return exit_to_interp(s, insn, pc); \
 
 static str_t func_mulh(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
     FUNC();
@@ -905,6 +1002,817 @@ static str_t func_fsqrt_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stac
 
 #undef FUNC
 
+// RV64A: aq/rl对应到C11的memory order
+// x86上带lock前缀的指令本身就是全屏障，这里只是告诉clang哪些访存不能越过它重排
+static const char *atomic_order(insn_t *insn, bool load) {
+    if (insn->aq && insn->rl) return "__ATOMIC_SEQ_CST";
+    if (insn->aq) return "__ATOMIC_ACQUIRE";
+    // load不能用release
+    if (insn->rl && !load) return "__ATOMIC_RELEASE";
+    return "__ATOMIC_RELAXED";
+}
+
+#define FUNC(typ)                                                                         \
+    REG_GET(insn->rs1, rs1);                                                              \
+    sprintf(funcbuf, "    " typ " val = __atomic_load_n((" typ " *)TO_HOST(rs1), %s);\n", \
+            atomic_order(insn, true));                                                    \
+    s = str_append(s, funcbuf);                                                           \
+    s = str_append(s, "    state->reserve_addr = rs1;\n");                                \
+    s = str_append(s, "    state->reserve_val = (uint64_t)val;\n");                       \
+    REG_SET_EXPR(insn->rd, "(int64_t)val");                                               \
+    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rd, -1);                             \
+    return s;                                                                             \
+
+static str_t func_lr_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int32_t");
+}
+
+static str_t func_lr_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int64_t");
+}
+
+#undef FUNC
+
+// sc: lr读到的值还在内存里，就认为reservation有效，用一次cas完成写入
+#define FUNC(typ)                                                                       \
+    REG_GET(insn->rs1, rs1);                                                            \
+    REG_GET(insn->rs2, rs2);                                                            \
+    s = str_append(s, "    " typ " *p = (" typ " *)TO_HOST(rs1);\n");                   \
+    s = str_append(s, "    " typ " expected = (" typ ")state->reserve_val;\n");         \
+    s = str_append(s, "    uint64_t rd = !(state->reserve_addr == rs1 &&\n");           \
+    sprintf(funcbuf, "        __atomic_compare_exchange_n(p, &expected, (" typ ")rs2, " \
+            "0, %s, __ATOMIC_RELAXED));\n", atomic_order(insn, false));                 \
+    s = str_append(s, funcbuf);                                                         \
+    s = str_append(s, "    state->reserve_addr = 0;\n");                                \
+    REG_SET_EXPR(insn->rd, "rd");                                                       \
+    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1);                \
+    return s;                                                                           \
+
+static str_t func_sc_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int32_t");
+}
+
+static str_t func_sc_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int64_t");
+}
+
+#undef FUNC
+
+// rd为x0的时候不使用旧值，clang会生成lock add/and/or/xor，而不是cmpxchg循环
+#define FUNC(typ, op)                                                                  \
+    REG_GET(insn->rs1, rs1);                                                           \
+    REG_GET(insn->rs2, rs2);                                                           \
+    sprintf(funcbuf, "    %s" op "((" typ " *)TO_HOST(rs1), (" typ ")rs2, %s);\n",     \
+            insn->rd == zero ? "(void)" : "int64_t rd = ", atomic_order(insn, false)); \
+    s = str_append(s, funcbuf);                                                        \
+    REG_SET_EXPR(insn->rd, "rd");                                                      \
+    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1);               \
+    return s;                                                                          \
+
+static str_t func_amoswap_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int32_t", "__atomic_exchange_n");
+}
+
+static str_t func_amoadd_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int32_t", "__atomic_fetch_add");
+}
+
+static str_t func_amoxor_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int32_t", "__atomic_fetch_xor");
+}
+
+static str_t func_amoand_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int32_t", "__atomic_fetch_and");
+}
+
+static str_t func_amoor_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int32_t", "__atomic_fetch_or");
+}
+
+static str_t func_amoswap_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int64_t", "__atomic_exchange_n");
+}
+
+static str_t func_amoadd_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int64_t", "__atomic_fetch_add");
+}
+
+static str_t func_amoxor_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int64_t", "__atomic_fetch_xor");
+}
+
+static str_t func_amoand_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int64_t", "__atomic_fetch_and");
+}
+
+static str_t func_amoor_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int64_t", "__atomic_fetch_or");
+}
+
+#undef FUNC
+
+// min/max在x86上没有对应的原子指令，用cas循环
+#define FUNC(typ, expr)                                                                 \
+    REG_GET(insn->rs1, rs1);                                                            \
+    REG_GET(insn->rs2, rs2);                                                            \
+    s = str_append(s, "    " typ " *p = (" typ " *)TO_HOST(rs1);\n");                   \
+    s = str_append(s, "    " typ " old = __atomic_load_n(p, __ATOMIC_RELAXED), nv;\n"); \
+    s = str_append(s, "    do {\n");                                                    \
+    s = str_append(s, "        nv = " expr ";\n");                                      \
+    sprintf(funcbuf, "    } while (!__atomic_compare_exchange_n(p, &old, nv, 1, %s, "   \
+            "__ATOMIC_RELAXED));\n", atomic_order(insn, false));                        \
+    s = str_append(s, funcbuf);                                                         \
+    REG_SET_EXPR(insn->rd, "(int64_t)old");                                             \
+    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1);                \
+    return s;                                                                           \
+
+static str_t func_amomin_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int32_t", "old < (int32_t)rs2 ? old : (int32_t)rs2");
+}
+
+static str_t func_amomax_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int32_t", "old > (int32_t)rs2 ? old : (int32_t)rs2");
+}
+
+static str_t func_amominu_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int32_t", "(uint32_t)old < (uint32_t)rs2 ? old : (int32_t)rs2");
+}
+
+static str_t func_amomaxu_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int32_t", "(uint32_t)old > (uint32_t)rs2 ? old : (int32_t)rs2");
+}
+
+static str_t func_amomin_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int64_t", "old < (int64_t)rs2 ? old : (int64_t)rs2");
+}
+
+static str_t func_amomax_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int64_t", "old > (int64_t)rs2 ? old : (int64_t)rs2");
+}
+
+static str_t func_amominu_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int64_t", "(uint64_t)old < rs2 ? old : (int64_t)rs2");
+}
+
+static str_t func_amomaxu_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("int64_t", "(uint64_t)old > rs2 ? old : (int64_t)rs2");
+}
+
+#undef FUNC
+
+//
+// RVV: 常见的向量运算直接展开成循环，运行时按照vtype中的SEW选择元素类型，LMUL只影响vl，
+// clang会把这些循环向量化；带mask的、少见的指令，以及运行时vtype不支持的情况，都退回解释器
+//
+
+static str_t func_vsetvli(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    u64 vtype = (u64)insn->imm;
+    u64 vlmax = vector_vlmax(vtype);
+    if (vlmax == 0) return exit_to_interp(s, insn, pc);
+
+    if (insn->rs1 != zero) {
+        REG_GET(insn->rs1, avl);
+        sprintf(funcbuf, "    uint64_t vl = avl < %luULL ? avl : %luULL;\n", vlmax, vlmax);
+    } else if (insn->rd != zero) {
+        sprintf(funcbuf, "    uint64_t vl = %luULL;\n", vlmax);
+    } else {
+        sprintf(funcbuf, "    uint64_t vl = state->vl < %luULL ? state->vl : %luULL;\n", vlmax, vlmax);
+    }
+    s = str_append(s, funcbuf);
+    s = str_append(s, "    state->vl = vl;\n");
+    sprintf(funcbuf, "    state->vtype = %luULL;\n", vtype);
+    s = str_append(s, funcbuf);
+    REG_SET_EXPR(insn->rd, "vl");
+    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rd, -1);
+    return s;
+}
+
+static str_t func_vsetivli(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    u64 vtype = (u64)insn->imm;
+    u64 vlmax = vector_vlmax(vtype);
+    if (vlmax == 0) return exit_to_interp(s, insn, pc);
+
+    i64 vl = MIN((u64)insn->rs1, vlmax);
+    sprintf(funcbuf, "    state->vl = %luULL;\n", vl);
+    s = str_append(s, funcbuf);
+    sprintf(funcbuf, "    state->vtype = %luULL;\n", vtype);
+    s = str_append(s, funcbuf);
+    REG_SET_VAL(insn->rd, vl);
+    tracer_add_gp_reg_usage(tracer, insn->rd, -1);
+    return s;
+}
+
+static str_t func_vsetvl(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    return exit_to_interp(s, insn, pc);
+}
+
+// 只展开没有mask的unit-stride和整个寄存器的load/store，都是按字节拷贝
+static str_t vec_mem(str_t s, insn_t *insn, tracer_t *tracer, u64 pc, bool store) {
+    u64 eew;
+    switch (insn->funct3) {
+    case 0x0: eew = 1; break;
+    case 0x5: eew = 2; break;
+    case 0x6: eew = 4; break;
+    case 0x7: eew = 8; break;
+    default: return exit_to_interp(s, insn, pc);
+    }
+    u32 mop = insn->funct6 & 0x3;
+    u32 nf = (insn->funct6 >> 3) + 1;
+
+    if (mop != 0 || !insn->vm) return exit_to_interp(s, insn, pc);
+    if (insn->rs2 == 0x08) {
+        sprintf(funcbuf, "    uint64_t n = %uULL;\n", nf * VLENB);
+    } else if ((insn->rs2 == 0x00 || insn->rs2 == 0x10) && nf == 1) {
+        sprintf(funcbuf, "    uint64_t n = state->vl * %luULL;\n", eew);
+    } else {
+        return exit_to_interp(s, insn, pc);
+    }
+    s = str_append(s, funcbuf);
+
+    REG_GET(insn->rs1, rs1);
+    s = str_append(s, "    uint8_t *m = (uint8_t *)TO_HOST(rs1);\n");
+    sprintf(funcbuf, "    uint8_t *r = (uint8_t *)state->vregs[%d];\n", insn->rd);
+    s = str_append(s, funcbuf);
+    if (store) {
+        s = str_append(s, "    for (uint64_t i = 0; i < n; i++) m[i] = r[i];\n");
+    } else {
+        s = str_append(s, "    for (uint64_t i = 0; i < n; i++) r[i] = m[i];\n");
+    }
+    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
+    return s;
+}
+
+static str_t func_vload(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    return vec_mem(s, insn, tracer, pc, false);
+}
+
+static str_t func_vstore(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    return vec_mem(s, insn, tracer, pc, true);
+}
+
+// 元素级运算的表达式：a是vs2的元素，b是vs1的元素或者标量，d是vd原来的元素
+// T比int窄的时候乘法会提升成int，溢出是未定义行为，先转成uint64_t再乘
+static const char *vec_int_expr(insn_t *insn) {
+    bool opm = insn->funct3 == OPMVV || insn->funct3 == OPMVX;
+    if (opm) {
+        switch (insn->funct6) {
+        case 0x25: return "(T)((uint64_t)a * b)";               // vmul
+        case 0x2d: return "(T)((uint64_t)b * a + d)";           // vmacc
+        default: return NULL;
+        }
+    }
+    switch (insn->funct6) {
+    case 0x00: return "a + b";                                  // vadd
+    case 0x02: return "a - b";                                  // vsub
+    case 0x03: return "b - a";                                  // vrsub
+    case 0x04: return "a < b ? a : b";                          // vminu
+    case 0x05: return "(S)a < (S)b ? a : b";                    // vmin
+    case 0x06: return "a > b ? a : b";                          // vmaxu
+    case 0x07: return "(S)a > (S)b ? a : b";                    // vmax
+    case 0x09: return "a & b";                                  // vand
+    case 0x0a: return "a | b";                                  // vor
+    case 0x0b: return "a ^ b";                                  // vxor
+    case 0x17: return insn->vm ? "b" : NULL;                    // vmv.v
+    case 0x25: return "a << (b & (sizeof(T) * 8 - 1))";         // vsll
+    case 0x28: return "a >> (b & (sizeof(T) * 8 - 1))";         // vsrl
+    case 0x29: return "(S)a >> (b & (sizeof(T) * 8 - 1))";      // vsra
+    default: return NULL;
+    }
+}
+
+// vfmacc和解释器一样只舍入一次，没有FMA的时候交给解释器(见func_fmadd_s)
+static const char *vec_fp_expr(insn_t *insn) {
+    switch (insn->funct6) {
+    case 0x00: return "a + b";                                  // vfadd
+    case 0x02: return "a - b";                                  // vfsub
+    case 0x17: return insn->funct3 == OPFVF ? "b" : NULL;       // vfmv.v.f
+    case 0x20: return "a / b";                                  // vfdiv
+    case 0x24: return "a * b";                                  // vfmul
+    case 0x2c: return cpu_has(CPU_FMA) ?                        // vfmacc
+                      "_Generic(a, float: __builtin_fmaf, double: __builtin_fma)(b, a, d)" : NULL;
+    default: return NULL;
+    }
+}
+
+static const char *vec_types[4][2] = {
+    { "uint8_t", "int8_t" },
+    { "uint16_t", "int16_t" },
+    { "uint32_t", "int32_t" },
+    { "uint64_t", "int64_t" },
+};
+
+// 运行时按SEW分派，每个case里的T是元素类型
+static str_t vec_switch_begin(str_t s) {
+    s = str_append(s, "    uint64_t vl = state->vl;\n");
+    s = str_append(s, "    switch ((state->vtype >> 3) & 7) {\n");
+    return s;
+}
+
+static str_t vec_switch_end(str_t s, u64 pc) {
+    s = str_append(s, "    default:\n");
+    s = str_append(s, "        instret--;\n");
+    s = str_append(s, "        state->exit_reason = interp;\n");
+    sprintf(funcbuf, "        state->reenter_pc = %luULL;\n", pc);
+    s = str_append(s, funcbuf);
+    s = str_append(s, "        goto end;\n");
+    s = str_append(s, "    }\n");
+    return s;
+}
+
+static str_t vec_case_begin(str_t s, insn_t *insn, int sew, const char *t, const char *st) {
+    sprintf(funcbuf, "    case %d: {\n", sew);
+    s = str_append(s, funcbuf);
+    sprintf(funcbuf, "        typedef %s T;\n", t);
+    s = str_append(s, funcbuf);
+    if (st) {
+        sprintf(funcbuf, "        typedef %s S;\n", st);
+        s = str_append(s, funcbuf);
+    }
+    sprintf(funcbuf, "        T *vd = (T *)state->vregs[%d];\n", insn->rd);
+    s = str_append(s, funcbuf);
+    sprintf(funcbuf, "        T *vs2 = (T *)state->vregs[%d];\n", insn->rs2);
+    s = str_append(s, funcbuf);
+    sprintf(funcbuf, "        T *vs1 = (T *)state->vregs[%d];\n", insn->rs1);
+    s = str_append(s, funcbuf);
+    s = str_append(s, "        (void)vs1;\n");
+    return s;
+}
+
+static str_t vec_case_loop(str_t s, const char *bexpr, const char *expr) {
+    s = str_append(s, "        for (uint64_t i = 0; i < vl; i++) {\n");
+    sprintf(funcbuf, "            T a = vs2[i], b = %s, d = vd[i];\n", bexpr);
+    s = str_append(s, funcbuf);
+    sprintf(funcbuf, "            vd[i] = %s;\n", expr);
+    s = str_append(s, funcbuf);
+    s = str_append(s, "            (void)a; (void)d;\n");
+    s = str_append(s, "        }\n");
+    s = str_append(s, "        break;\n");
+    s = str_append(s, "    }\n");
+    return s;
+}
+
+static str_t func_vop(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    bool fp = insn->funct3 == OPFVV || insn->funct3 == OPFVF;
+    bool vv = insn->funct3 == OPIVV || insn->funct3 == OPMVV || insn->funct3 == OPFVV;
+
+    // vmv.x.s和vfmv.f.s
+    if (insn->funct6 == 0x10 && insn->rs1 == 0 && (insn->funct3 == OPMVV || insn->funct3 == OPFVV)) {
+        if (insn->funct3 == OPMVV && insn->rd == zero) return s;
+        s = vec_switch_begin(s);
+        for (int sew = fp ? 2 : 0; sew < 4; sew++) {
+            sprintf(funcbuf, "    case %d: ", sew);
+            s = str_append(s, funcbuf);
+            if (fp) {
+                sprintf(funcbuf, "f%d.v = (uint64_t)-1; f%d.%s = *(%s *)state->vregs[%d]; break;\n",
+                        insn->rd, insn->rd, sew == 2 ? "f" : "d", sew == 2 ? "float" : "double",
+                        insn->rs2);
+            } else {
+                sprintf(funcbuf, "x%d = (int64_t)*(%s *)state->vregs[%d]; break;\n",
+                        insn->rd, vec_types[sew][1], insn->rs2);
+            }
+            s = str_append(s, funcbuf);
+        }
+        s = vec_switch_end(s, pc);
+        if (fp) tracer_add_fp_reg_usage(tracer, insn->rd, -1);
+        else tracer_add_gp_reg_usage(tracer, insn->rd, -1);
+        return s;
+    }
+
+    // 归约：vredsum.vs和vfredusum.vs
+    if (insn->vm && ((insn->funct3 == OPMVV && insn->funct6 == 0x00) ||
+                     (insn->funct3 == OPFVV && insn->funct6 == 0x01))) {
+        s = vec_switch_begin(s);
+        for (int sew = fp ? 2 : 0; sew < 4; sew++) {
+            const char *t = fp ? (sew == 2 ? "float" : "double") : vec_types[sew][0];
+            s = vec_case_begin(s, insn, sew, t, NULL);
+            s = str_append(s, "        T acc = vs1[0];\n");
+            s = str_append(s, "        for (uint64_t i = 0; i < vl; i++) acc += vs2[i];\n");
+            s = str_append(s, "        if (vl > 0) vd[0] = acc;\n");
+            s = str_append(s, "        break;\n");
+            s = str_append(s, "    }\n");
+        }
+        return vec_switch_end(s, pc);
+    }
+
+    const char *expr = fp ? vec_fp_expr(insn) : vec_int_expr(insn);
+    if (expr == NULL || !insn->vm) return exit_to_interp(s, insn, pc);
+
+    // 标量操作数
+    if (insn->funct3 == OPIVX || insn->funct3 == OPMVX) {
+        REG_GET(insn->rs1, bx);
+        tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
+    } else if (insn->funct3 == OPIVI) {
+        // 移位的立即数是uimm5
+        i64 imm = insn->funct6 >= 0x25 ? (i64)insn->rs1 : (i64)insn->imm;
+        sprintf(funcbuf, "    uint64_t bx = %ldLL;\n", imm);
+        s = str_append(s, funcbuf);
+    } else if (insn->funct3 == OPFVF) {
+        sprintf(funcbuf, "    fp_reg_t bf = f%d;\n", insn->rs1);
+        s = str_append(s, funcbuf);
+        tracer_add_fp_reg_usage(tracer, insn->rs1, -1);
+    }
+
+    s = vec_switch_begin(s);
+    if (fp) {
+        s = vec_case_begin(s, insn, 2, "float", NULL);
+        s = vec_case_loop(s, vv ? "vs1[i]" : "bf.f", expr);
+        s = vec_case_begin(s, insn, 3, "double", NULL);
+        s = vec_case_loop(s, vv ? "vs1[i]" : "bf.d", expr);
+    } else {
+        for (int sew = 0; sew < 4; sew++) {
+            s = vec_case_begin(s, insn, sew, vec_types[sew][0], vec_types[sew][1]);
+            s = vec_case_loop(s, vv ? "vs1[i]" : "(T)bx", expr);
+        }
+    }
+    return vec_switch_end(s, pc);
+}
+
+//
+// Zba/Zbb/Zbs: 生成的C代码使用builtin和移位/旋转的惯用写法，
+// clang会把它们分别选择成lzcnt/tzcnt/popcnt/bswap/rol/ror/bts/btr/btc/bt
+// clz/ctz输入为0时RISC-V的结果是位宽，和lzcnt/tzcnt一致，带上判断之后clang可以直接用一条指令
+//
+
+#define FUNC(expr)                                                       \
+    REG_GET(insn->rs1, rs1);                                             \
+    REG_GET(insn->rs2, rs2);                                             \
+    REG_SET_EXPR(insn->rd, expr);                                        \
+    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1); \
+    return s;                                                            \
+
+static str_t func_sh1add(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs2 + (rs1 << 1)");
+}
+
+static str_t func_sh2add(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs2 + (rs1 << 2)");
+}
+
+static str_t func_sh3add(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs2 + (rs1 << 3)");
+}
+
+static str_t func_add_uw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs2 + (uint32_t)rs1");
+}
+
+static str_t func_sh1add_uw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs2 + ((uint64_t)(uint32_t)rs1 << 1)");
+}
+
+static str_t func_sh2add_uw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs2 + ((uint64_t)(uint32_t)rs1 << 2)");
+}
+
+static str_t func_sh3add_uw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs2 + ((uint64_t)(uint32_t)rs1 << 3)");
+}
+
+static str_t func_andn(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs1 & ~rs2");
+}
+
+static str_t func_orn(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs1 | ~rs2");
+}
+
+static str_t func_xnor(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("~(rs1 ^ rs2)");
+}
+
+static str_t func_max(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("(int64_t)rs1 > (int64_t)rs2 ? rs1 : rs2");
+}
+
+static str_t func_maxu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs1 > rs2 ? rs1 : rs2");
+}
+
+static str_t func_min(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("(int64_t)rs1 < (int64_t)rs2 ? rs1 : rs2");
+}
+
+static str_t func_minu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs1 < rs2 ? rs1 : rs2");
+}
+
+static str_t func_zext_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("(uint16_t)rs1");
+}
+
+static str_t func_rol(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("(rs1 << (rs2 & 0x3f)) | (rs1 >> (-rs2 & 0x3f))");
+}
+
+static str_t func_rolw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("(int64_t)(int32_t)(((uint32_t)rs1 << (rs2 & 0x1f)) | ((uint32_t)rs1 >> (-rs2 & 0x1f)))");
+}
+
+static str_t func_ror(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("(rs1 >> (rs2 & 0x3f)) | (rs1 << (-rs2 & 0x3f))");
+}
+
+static str_t func_rorw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("(int64_t)(int32_t)(((uint32_t)rs1 >> (rs2 & 0x1f)) | ((uint32_t)rs1 << (-rs2 & 0x1f)))");
+}
+
+static str_t func_bclr(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs1 & ~(1ULL << (rs2 & 0x3f))");
+}
+
+static str_t func_bext(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("(rs1 >> (rs2 & 0x3f)) & 1");
+}
+
+static str_t func_binv(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs1 ^ (1ULL << (rs2 & 0x3f))");
+}
+
+static str_t func_bset(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs1 | (1ULL << (rs2 & 0x3f))");
+}
+
+#undef FUNC
+
+#define FUNC(stmt)                                            \
+    REG_GET(insn->rs1, rs1);                                  \
+    stmt;                                                     \
+    REG_SET_EXPR(insn->rd, funcbuf2);                         \
+    tracer_add_gp_reg_usage(tracer, insn->rs1, insn->rd, -1); \
+    return s;                                                 \
+
+static str_t func_clz(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "rs1 ? __builtin_clzll(rs1) : 64")));
+}
+
+static str_t func_clzw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "(uint32_t)rs1 ? __builtin_clz((uint32_t)rs1) : 32")));
+}
+
+static str_t func_ctz(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "rs1 ? __builtin_ctzll(rs1) : 64")));
+}
+
+static str_t func_ctzw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "(uint32_t)rs1 ? __builtin_ctz((uint32_t)rs1) : 32")));
+}
+
+static str_t func_cpop(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "__builtin_popcountll(rs1)")));
+}
+
+static str_t func_cpopw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "__builtin_popcount((uint32_t)rs1)")));
+}
+
+static str_t func_sext_b(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "(int64_t)(int8_t)rs1")));
+}
+
+static str_t func_sext_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "(int64_t)(int16_t)rs1")));
+}
+
+static str_t func_orc_b(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "((((((rs1 & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | rs1) & 0x8080808080808080ULL) >> 7) * 0xff)")));
+}
+
+static str_t func_rev8(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "__builtin_bswap64(rs1)")));
+}
+
+static str_t func_slli_uw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "(uint64_t)(uint32_t)rs1 << %d", insn->imm & 0x3f)));
+}
+
+static str_t func_rori(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "(rs1 >> %d) | (rs1 << %d)", insn->imm & 0x3f, -insn->imm & 0x3f)));
+}
+
+static str_t func_roriw(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "(int64_t)(int32_t)(((uint32_t)rs1 >> %d) | ((uint32_t)rs1 << %d))", insn->imm & 0x1f, -insn->imm & 0x1f)));
+}
+
+static str_t func_bclri(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "rs1 & ~(1ULL << %d)", insn->imm & 0x3f)));
+}
+
+static str_t func_bexti(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "(rs1 >> %d) & 1", insn->imm & 0x3f)));
+}
+
+static str_t func_binvi(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "rs1 ^ (1ULL << %d)", insn->imm & 0x3f)));
+}
+
+static str_t func_bseti(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC((sprintf(funcbuf2, "rs1 | (1ULL << %d)", insn->imm & 0x3f)));
+}
+
+#undef FUNC
+
+// Zfh: 读寄存器的时候检查NaN-boxing，没有正确box的值当作canonical NaN
+#define F16_GET(reg, name)                                                                   \
+    sprintf(funcbuf, "    uint16_t " #name " = (f%d.v >> 16) == 0xffffffffffffULL ? "         \
+            "(uint16_t)f%d.v : 0x7e00;\n", (reg), (reg));                                     \
+    s = str_append(s, funcbuf);                                                              \
+
+#define F16_SET_EXPR(reg, expr)                                                              \
+    sprintf(funcbuf, "    f%d.v = (uint64_t)(uint16_t)(%s) | 0xffffffffffff0000ULL;\n",      \
+            (reg), (expr));                                                                  \
+    s = str_append(s, funcbuf);                                                              \
+
+static str_t func_flh(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    REG_GET(insn->rs1, rs1);
+    sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm);
+    MEM_LOAD(funcbuf2, "uint16_t", rd);
+    F16_SET_EXPR(insn->rd, "rd");
+    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
+    tracer_add_fp_reg_usage(tracer, insn->rd, -1);
+    return s;
+}
+
+static str_t func_fsh(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    REG_GET(insn->rs1, rs1);
+    FREG_GET(insn->rs2, rs2, uint64_t, v);
+    sprintf(funcbuf2, "rs1 + (int64_t)%ldLL", (i64)insn->imm);
+    MEM_STORE(funcbuf2, "uint16_t", rs2);
+    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
+    tracer_add_fp_reg_usage(tracer, insn->rs2, -1);
+    return s;
+}
+
+// 有F16C的时候生成的代码用-mf16c编译，_Float16和float之间的转换就是vcvtph2ps/vcvtps2ph，
+// 舍入模式用的是MXCSR；float的精度足够，先算float再舍入成半精度结果是对的
+#define FUNC(op)                                                                     \
+    if (!cpu_has(CPU_F16C)) return exit_to_interp(s, insn, pc);                     \
+    F16_GET(insn->rs1, rs1);                                                        \
+    F16_GET(insn->rs2, rs2);                                                        \
+    s = str_append(s, "    union { uint16_t u; _Float16 h; } a = { .u = rs1 }, "    \
+                      "b = { .u = rs2 }, r;\n");                                    \
+    s = str_append(s, "    float rd = (float)a.h " op " (float)b.h;\n");            \
+    s = str_append(s, "    r.h = (_Float16)rd;\n");                                 \
+    F16_SET_EXPR(insn->rd, "rd != rd ? 0x7e00 : r.u");                              \
+    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1);            \
+    return s;                                                                       \
+
+static str_t func_fadd_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
+    FUNC("+");
+}
+
+static str_t func_fsub_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
+    FUNC("-");
+}
+
+static str_t func_fmul_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
+    FUNC("*");
+}
+
+static str_t func_fdiv_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FP_STATIC_RM();
+    FUNC("/");
+}
+
+#undef FUNC
+
+#define FUNC(v)                                                                  \
+    F16_GET(insn->rs1, rs1);                                                    \
+    F16_GET(insn->rs2, rs2);                                                    \
+    F16_SET_EXPR(insn->rd, "(rs1 & 0x7fff) | ((" v " ^ rs2) & 0x8000)");        \
+    tracer_add_fp_reg_usage(tracer, insn->rs1, insn->rs2, insn->rd, -1);        \
+    return s;                                                                   \
+
+static str_t func_fsgnj_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("0");
+}
+
+static str_t func_fsgnjn_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("0x8000");
+}
+
+static str_t func_fsgnjx_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC("rs1");
+}
+
+#undef FUNC
+
+static str_t func_fmv_x_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FREG_GET(insn->rs1, rs1, uint64_t, v);
+    REG_SET_EXPR(insn->rd, "(int64_t)(int16_t)rs1");
+    tracer_add_gp_reg_usage(tracer, insn->rd, -1);
+    tracer_add_fp_reg_usage(tracer, insn->rs1, -1);
+    return s;
+}
+
+static str_t func_fmv_h_x(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    REG_GET(insn->rs1, rs1);
+    F16_SET_EXPR(insn->rd, "rs1");
+    tracer_add_gp_reg_usage(tracer, insn->rs1, -1);
+    tracer_add_fp_reg_usage(tracer, insn->rd, -1);
+    return s;
+}
+
+// 其他的半精度指令需要round to odd或者饱和转换，交给解释器
+#define FUNC() \
+    return exit_to_interp(s, insn, pc); \
+
+static str_t func_fmadd_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fmsub_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fnmsub_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fnmadd_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fsqrt_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fmin_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fmax_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fcvt_s_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fcvt_h_s(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fcvt_d_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fcvt_h_d(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_feq_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_flt_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fle_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fclass_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fcvt_w_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fcvt_wu_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fcvt_l_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fcvt_lu_h(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fcvt_h_w(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fcvt_h_wu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fcvt_h_l(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+static str_t func_fcvt_h_lu(str_t s, insn_t *insn, tracer_t *tracer, stack_t *stack, u64 pc) {
+    FUNC();
+}
+
+#undef FUNC
+
 typedef str_t (func_t)(str_t, insn_t *, tracer_t *, stack_t *, u64);
 
 static func_t *funcs[] = {
@@ -916,7 +1824,7 @@ static func_t *funcs[] = {
     func_lhu,
     func_lwu,
     func_empty, // fence
-    func_empty, // fence_i
+    func_fence_i,
     func_addi,
     func_slli,
     func_slti,
@@ -1041,17 +1949,137 @@ static func_t *funcs[] = {
     func_fcvt_d_l,
     func_fcvt_d_lu,
     func_fmv_d_x,
+    func_lr_w,
+    func_sc_w,
+    func_amoswap_w,
+    func_amoadd_w,
+    func_amoxor_w,
+    func_amoand_w,
+    func_amoor_w,
+    func_amomin_w,
+    func_amomax_w,
+    func_amominu_w,
+    func_amomaxu_w,
+    func_lr_d,
+    func_sc_d,
+    func_amoswap_d,
+    func_amoadd_d,
+    func_amoxor_d,
+    func_amoand_d,
+    func_amoor_d,
+    func_amomin_d,
+    func_amomax_d,
+    func_amominu_d,
+    func_amomaxu_d,
+    func_vsetvli,
+    func_vsetivli,
+    func_vsetvl,
+    func_vload,
+    func_vstore,
+    func_vop,
+    func_sh1add,
+    func_sh2add,
+    func_sh3add,
+    func_add_uw,
+    func_sh1add_uw,
+    func_sh2add_uw,
+    func_sh3add_uw,
+    func_slli_uw,
+    func_andn,
+    func_orn,
+    func_xnor,
+    func_clz,
+    func_clzw,
+    func_ctz,
+    func_ctzw,
+    func_cpop,
+    func_cpopw,
+    func_max,
+    func_maxu,
+    func_min,
+    func_minu,
+    func_sext_b,
+    func_sext_h,
+    func_zext_h,
+    func_rol,
+    func_rolw,
+    func_ror,
+    func_rori,
+    func_roriw,
+    func_rorw,
+    func_orc_b,
+    func_rev8,
+    func_bclr,
+    func_bclri,
+    func_bext,
+    func_bexti,
+    func_binv,
+    func_binvi,
+    func_bset,
+    func_bseti,
+    func_flh,
+    func_fsh,
+    func_fmadd_h,
+    func_fmsub_h,
+    func_fnmsub_h,
+    func_fnmadd_h,
+    func_fadd_h,
+    func_fsub_h,
+    func_fmul_h,
+    func_fdiv_h,
+    func_fsqrt_h,
+    func_fsgnj_h,
+    func_fsgnjn_h,
+    func_fsgnjx_h,
+    func_fmin_h,
+    func_fmax_h,
+    func_fcvt_s_h,
+    func_fcvt_h_s,
+    func_fcvt_d_h,
+    func_fcvt_h_d,
+    func_feq_h,
+    func_flt_h,
+    func_fle_h,
+    func_fclass_h,
+    func_fcvt_w_h,
+    func_fcvt_wu_h,
+    func_fcvt_l_h,
+    func_fcvt_lu_h,
+    func_fcvt_h_w,
+    func_fcvt_h_wu,
+    func_fcvt_h_l,
+    func_fcvt_h_lu,
+    func_fmv_x_h,
+    func_fmv_h_x,
 };
 
+// guest内存的基地址在入口读到局部变量mem里，整段代码里它一直待在一个寄存器中，
+// 每次访存都是一个[mem + reg + disp]的寻址，不用每次都把64位的常量OFFSET物化出来再加上去
+// 生成的代码里没有写死基地址，放在不同slot里的guest跑同一段代码也没问题
+// fmin/fmax: 只有一个操作数是NaN的时候结果是另一个，两个都是NaN的时候是canonical NaN，-0.0比+0.0小
+// x86的minsd/maxsd在这两种情况下总是返回第二个操作数，clang会用比较和blend处理这些特殊情况
+// 有一个操作数是signaling NaN的时候和解释器的fminmax32/fminmax64一样，在fcsr里设置NV
+// 表达式比较长，放在prologue里定义成宏，指令里只生成一次宏调用
 #define CODEGEN_PROLOGUE                                \
-    "#define OFFSET 0x088800000000ULL               \n" \
-    "#define TO_HOST(addr) (addr + OFFSET)          \n" \
+    "#define TO_HOST(addr) (mem + (addr))           \n" \
+    "static inline bool snan32(float x) { uint32_t u; __builtin_memcpy(&u, &x, 4); " \
+    "return (u & 0x7fc00000) == 0x7f800000 && (u & 0x003fffff); }\n"                   \
+    "static inline bool snan64(double x) { uint64_t u; __builtin_memcpy(&u, &x, 8); " \
+    "return (u & 0x7ff8000000000000ULL) == 0x7ff0000000000000ULL && (u & 0x0007ffffffffffffULL); }\n" \
+    "#define FSNAN(a) _Generic((a), float: snan32, double: snan64)(a)\n"                \
+    "#define FNV(a, b) ((FSNAN(a) || FSNAN(b)) ? (void)(state->fcsr |= 0x10) : (void)0)\n" \
+    "#define FMIN(a, b, nan) (FNV(a, b), (a) != (a) ? ((b) != (b) ? (nan) : (b)) : (b) != (b) ? (a) : " \
+    "(a) == (b) ? (__builtin_signbit(a) ? (a) : (b)) : (a) < (b) ? (a) : (b))\n"              \
+    "#define FMAX(a, b, nan) (FNV(a, b), (a) != (a) ? ((b) != (b) ? (nan) : (b)) : (b) != (b) ? (a) : " \
+    "(a) == (b) ? (__builtin_signbit(a) ? (b) : (a)) : (a) > (b) ? (a) : (b))\n"              \
     "enum exit_reason_t {                           \n" \
     "   none,                                       \n" \
     "   direct_branch,                              \n" \
     "   indirect_branch,                            \n" \
     "   interp,                                     \n" \
     "   ecall,                                      \n" \
+    "   side_exit,                                  \n" \
+    "   deopt,                                      \n" \
     "};                                             \n" \
     "typedef union {                                \n" \
     "    uint64_t v;                                \n" \
@@ -1065,13 +2093,189 @@ static func_t *funcs[] = {
     "    uint64_t gp_regs[32];                      \n" \
     "    fp_reg_t fp_regs[32];                      \n" \
     "    uint64_t pc;                               \n" \
+    "    uint64_t reserve_addr;                     \n" \
+    "    uint64_t reserve_val;                      \n" \
+    "    uint64_t vl;                               \n" \
+    "    uint64_t vtype;                            \n" \
+    "    uint8_t vregs[32][16];                     \n" \
     "    uint32_t fcsr;                             \n" \
+    "    uint64_t instret;                          \n" \
+    "    uint64_t guest_base;                       \n" \
+    "    uint64_t deopt_pc;                         \n" \
+    "    uint64_t host_call_pc;                     \n" \
     "} state_t;                                     \n" \
     "void start(volatile state_t *restrict state) { \n" \
+    "    uint8_t *const mem = (uint8_t *)state->guest_base; \n" \
+    "    uint64_t instret = 0;                      \n" \
 
 #define CODEGEN_EPILOGUE "}"
 
-str_t machine_genblock(machine_t *m) {
+// 区域里直接跳转的目标，作为区域的入口
+static void region_add_entry(region_t *region, u64 pc) {
+    if (region->num_entries == REGION_MAX_ENTRIES) return;
+    for (u64 i = 0; i < region->num_entries; i++) {
+        if (region->entries[i] == pc) return;
+    }
+    region->entries[region->num_entries++] = pc;
+}
+
+// 拷贝、填充、扫描的循环整个换成一次host的函数调用，放在循环第一条指令的最前面，
+// guest的寄存器和instret都算成循环一次一次执行完之后的样子，然后直接跳到循环后面
+// 长度是0、拷贝的两段内存有重叠的时候什么都不做，按原来的循环一次一次执行
+// 生成的代码没有办法链接libc，host的函数直接用它们在这个进程里的地址
+// host函数里的段错误不在jit的代码里，调用期间把循环的pc记在state->host_call_pc，fault.c用它报告
+static str_t idiom_append(str_t s, idiom_t *idiom, tracer_t *tracer, u64 pc, u64 exit_pc) {
+    static char buf[512];
+    s = str_append(s, "    {\n");
+    sprintf(buf, "        state->host_call_pc = %luULL;\n", pc);
+    s = str_append(s, buf);
+    if (idiom->src != zero) {
+        sprintf(buf, "        uint64_t src = x%d + (int64_t)%ldLL;\n", idiom->src, idiom->src_off);
+        s = str_append(s, buf);
+    }
+    if (idiom->dst != zero) {
+        sprintf(buf, "        uint64_t dst = x%d + (int64_t)%ldLL;\n", idiom->dst, idiom->dst_off);
+        s = str_append(s, buf);
+    }
+
+    switch (idiom->cond) {
+    case cond_counter:
+        sprintf(buf, "        uint64_t n = x%d;\n"
+                     "        bool ok = n != 0;\n", idiom->counter);
+        break;
+    case cond_ne:
+    case cond_lt:
+        sprintf(buf, "        uint64_t n = x%d - x%d;\n"
+                     "        bool ok = x%d %s x%d;\n", idiom->end, idiom->ptr,
+                idiom->ptr, idiom->cond == cond_ne ? "!=" : "<", idiom->end);
+        break;
+    case cond_zero:
+        sprintf(buf, "        uint64_t n = ((uint64_t (*)(const void *))%luULL)(TO_HOST(src)) + 1;\n"
+                     "        bool ok = true;\n", (u64)strlen);
+        break;
+    case cond_chr:
+        sprintf(buf, "        uint8_t *hit = x%d < 256 ? ((uint8_t *(*)(const void *, int, uint64_t))%luULL)"
+                     "(TO_HOST(src), (int)x%d, %luULL - src) : 0;\n"
+                     "        uint64_t n = hit - TO_HOST(src) + 1;\n"
+                     "        bool ok = hit != 0;\n", idiom->end, (u64)memchr, idiom->end, (u64)GUEST_SLOT_SIZE);
+        break;
+    }
+    s = str_append(s, buf);
+
+    switch (idiom->kind) {
+    case idiom_copy:
+        // 从前往后一个字节一个字节地拷贝，dst在src前面的时候和memmove一样，在后面就只有不重叠的时候一样
+        sprintf(buf, "        if (ok && dst - src >= n) {\n"
+                     "            ((void *(*)(void *, const void *, uint64_t))%luULL)(TO_HOST(dst), TO_HOST(src), n);\n"
+                     "            x%d = (%s)*(%s *)TO_HOST(dst + n - 1);\n",
+                (u64)memmove, idiom->val, idiom->sign ? "int64_t" : "uint64_t",
+                idiom->sign ? "int8_t" : "uint8_t");
+        break;
+    case idiom_fill:
+        if (idiom->val == zero) sprintf(buf, "        if (ok) {\n"
+                                             "            ((void *(*)(void *, int, uint64_t))%luULL)(TO_HOST(dst), 0, n);\n",
+                                        (u64)memset);
+        else sprintf(buf, "        if (ok) {\n"
+                          "            ((void *(*)(void *, int, uint64_t))%luULL)(TO_HOST(dst), (uint8_t)x%d, n);\n",
+                     (u64)memset, idiom->val);
+        break;
+    case idiom_scan:
+        if (idiom->cond == cond_zero) sprintf(buf, "        if (ok) {\n"
+                                                   "            x%d = 0;\n", idiom->val);
+        else sprintf(buf, "        if (ok) {\n"
+                          "            x%d = x%d;\n", idiom->val, idiom->end);
+        break;
+    default:
+        unreachable();
+    }
+    s = str_append(s, buf);
+
+    if (idiom->src != zero) {
+        sprintf(buf, "            x%d += n;\n", idiom->src);
+        s = str_append(s, buf);
+    }
+    if (idiom->dst != zero) {
+        sprintf(buf, "            x%d += n;\n", idiom->dst);
+        s = str_append(s, buf);
+    }
+    if (idiom->cond == cond_counter) {
+        sprintf(buf, "            x%d = 0;\n", idiom->counter);
+        s = str_append(s, buf);
+    }
+    sprintf(buf, "            instret += n * %uULL;\n"
+                 "            state->host_call_pc = 0;\n"
+                 "            goto insn_%lx;\n"
+                 "        }\n"
+                 "        state->host_call_pc = 0;\n"
+                 "    }\n", idiom->num_insns, exit_pc);
+    s = str_append(s, buf);
+
+    tracer_add_gp_reg_usage(tracer, idiom->src, idiom->dst, idiom->val, idiom->counter, idiom->ptr,
+                            idiom->end, -1);
+    return s;
+}
+
+// 条件跳转的一个后继：很少走的放到cold，不太走的放到late，等比较热的路径都排完了再翻译，
+// 生成的代码里热的路径就连在一起，不太走的块都在后面
+static void push_successor(cfg_t *cfg, profile_t *profile, u64 pc, bool taken, u64 succ,
+                           u32 percent, stack_t *stack, stack_t *late, stack_t *cold) {
+    if (cfg_edge_cold(cfg, profile, pc, taken, succ)) stack_push(cold, succ);
+    else if ((taken ? percent : 100 - percent) < 100 - LIKELY_PERCENT) stack_push(late, succ);
+    else stack_push(stack, succ);
+}
+
+// 每条指令和每个出口的代码是body里的一段，从"insn_<pc>: {"开始，最后按循环的嵌套重新排列
+// 每一段都以goto、continue结尾，不会顺序执行到下一段，所以怎么排都对
+static u64 chunk_pc[SET_SIZE];
+static u64 chunk_off[SET_SIZE + 1];
+static u64 num_chunks = 0;
+
+static void chunk_add(u64 pc, str_t body) {
+    chunk_pc[num_chunks] = pc;
+    chunk_off[num_chunks++] = str_len(body);
+}
+
+// 把一段代码接到s后面，跳回header的goto换成continue
+static str_t chunk_append(str_t s, const char *from, const char *to, u64 header) {
+    static char needle[64];
+    u64 n = header ? sprintf(needle, "goto insn_%lx;", header) : 0;
+    for (const char *p = from; n != 0 && p + n <= to; p++) {
+        if (memcmp(p, needle, n) != 0) continue;
+        s = str_appendn(s, from, p - from);
+        s = str_append(s, "continue;");
+        from = p + n;
+        p += n - 1;
+    }
+    return str_appendn(s, from, to - from);
+}
+
+// 生成header这一层循环：header那一段放在for (;;)里面，后面跟着最里层是这个循环的其他指令，
+// 里面一层的循环递归生成；header为0的时候是最外面，不在任何循环里的代码
+// 只有本层的回边换成continue，跳到外层header的还是goto，guest的寄存器本来就都在局部变量里
+static str_t emit_loop(str_t s, cfg_graph_t *graph, str_t body, u64 header) {
+    static char buf[64];
+    for (u64 i = 0; i < num_chunks; i++) {
+        if (chunk_pc[i] != header) continue;
+        // 标号放在for上，这一段去掉自己的标号
+        u64 n = sprintf(buf, "insn_%lx: ", header);
+        s = str_append(s, buf);
+        s = str_append(s, "for (;;) {\n");
+        s = chunk_append(s, body + chunk_off[i] + n, body + chunk_off[i + 1], header);
+    }
+    for (u64 i = 0; i < num_chunks; i++) {
+        cfg_node_t *node = cfg_node(graph, chunk_pc[i]);
+        u64 loop = node ? node->loop : 0;
+        if (loop == chunk_pc[i] && node->parent == header && loop != header) {
+            s = emit_loop(s, graph, body, loop);
+        } else if (loop == header && chunk_pc[i] != header) {
+            s = chunk_append(s, body + chunk_off[i], body + chunk_off[i + 1], header);
+        }
+    }
+    if (header != 0) s = str_append(s, "}\n");
+    return s;
+}
+
+str_t machine_genblock(machine_t *m, region_t *region) {
     DECLEAR_STATIC_STR(body);
 
     static stack_t stack = {0};
@@ -1086,47 +2290,219 @@ str_t machine_genblock(machine_t *m) {
     static tracer_t tracer;
     tracer_reset(&tracer);
 
-    // 这个栈是用来模拟pc指针的移动过程的
-    // 遇到跳转指令，需要进栈；遇到返回指令需要弹栈
+    // 这个栈是区域的工作栈，放的是还没有翻译的基本块的开始地址
+    // 跳转指令把目标压栈，顺序执行的后继由这里压栈；间接跳转的目标不知道，是区域的出口
     stack_push(&stack, m->state.pc);
 
+    // 条件跳转很少走的那一边，先放在这里，等热的路径都翻译完了再看
+    static stack_t cold = {0};
+    stack_reset(&cold);
+    // 不太走的那一边，stack空了之后再翻译
+    static stack_t late = {0};
+    stack_reset(&late);
+    // 这条指令的跳转目标
+    static stack_t succ = {0};
+
+    // 翻译了的指令和它们之间的边，最后找循环
+    static cfg_graph_t graph;
+    graph.num_nodes = graph.num_succs = 0;
+
+    // 区域里的函数调用返回到的地方：被调用的函数和调用点后面的代码都翻译进来，
+    // 函数返回的时候按ra跳回对应的调用点，不用退出到machine_step再查cache
+    // ra不是这些地址的时候(比如区域是从被调用的函数中间开始的)，和普通的间接跳转一样退出
+    static u64 return_sites[STACK_CAP];
+    u64 num_return_sites = 0;
+    bool has_return = false;
+
+    // 超过预算之后还没有翻译的后继和冷的后继，它们的入口不能登记
+    static u64 exits[STACK_CAP];
+    u64 num_exits = 0;
+
+    cfg_t *cfg = m->cache->cfg;
+    // 冷热和跳转目标用的是正在编译的这个线程自己在解释器里统计的
+    profile_t *profile = m->state.profile;
+    u64 num_insns = 0, num_blocks = 0;
     u64 pc = -1;
-
-    while (stack_pop(&stack, &pc)) {
-        // 按照指令执行顺序一直向下
-        // 如果pc地址已经出现过了，那就跳过
-        if (!set_add(&set, pc)) {
+    num_chunks = 0;
+    // 这段代码翻译了哪些guest指令，guest改写代码的时候按这个范围作废
+    region->lo = region->hi = m->state.pc;
+    region->num_entries = 0;
+    region_add_entry(region, m->state.pc);
+
+    while (stack_pop(&stack, &pc) || stack_pop(&late, &pc)) {
+        // 如果pc地址已经翻译过了，那就跳过
+        if (set_has(&set, pc)) continue;
+
+        static char buf[256] = {0};
+
+        // 超过了预算，跳到这里就退出这段代码，回到machine_step
+        if (num_insns >= cfg->max_insns || str_len(body) >= cfg->max_source ||
+            num_blocks >= REGION_MAX_BLOCKS) {
+            set_add(&set, pc);
+            exits[num_exits++] = pc;
+            chunk_add(pc, body);
+            sprintf(buf, "insn_%lx: {\n"
+                         "    state->exit_reason = direct_branch;\n"
+                         "    state->reenter_pc = %luULL;\n"
+                         "    goto end;\n"
+                         "}\n", pc, pc);
+            body = str_append(body, buf);
             continue;
         }
 
-        static char buf[128] = {0};
-        static insn_t insn = {0};
+        cfg_block_t *block = cfg_block(cfg, m->mmu, pc);
+        num_blocks++;
+
+        for (u32 i = 0; i < block->num_insns; i++) {
+            // 别的块已经翻译过这条指令了，上一条指令的goto跳过去就行
+            if (!set_add(&set, pc)) break;
+            // 译码的结果是共用的，翻译的时候会改cont
+            insn_t insn = block->insns[i];
+            num_insns++;
+
+            chunk_add(pc, body);
+            sprintf(buf, "insn_%lx: {\n", pc);
+            body = str_append(body, buf);
+            // 循环后面的代码也是循环第一条指令的后继，和条件跳转的两个后继一起多算一个块
+            static idiom_t idiom;
+            bool idiom_loop = i == 0 && num_blocks < REGION_MAX_BLOCKS && cfg_idiom(block, &idiom);
+            if (idiom_loop) {
+                body = idiom_append(body, &idiom, &tracer, pc, block->end);
+                num_blocks++;
+            }
+            // 每条指令加1，clang会把一个基本块里的加法合并成一条，在end的时候一次写回state
+            body = str_append(body, "    instret++;\n");
+
+            region->lo = MIN(region->lo, pc);
+            region->hi = MAX(region->hi, pc + 4);
+            if ((insn.type >= insn_beq && insn.type <= insn_bgeu) || insn.type == insn_jal) {
+                region_add_entry(region, pc + (i64)insn.imm);
+            }
+            bool branch = insn.type >= insn_beq && insn.type <= insn_bgeu;
+            taken_percent = branch ? cfg_taken_percent(profile, pc) : 50;
+            // 一个块最多往工作栈里压两个后继，跳转表的目标每两个也算一个块，工作栈才不会满
+            num_jump_targets = insn.type == insn_jalr ? cfg_jump_table(m->mmu, block, jump_targets) : 0;
+            if (num_blocks + (num_jump_targets + 1) / 2 > REGION_MAX_BLOCKS) num_jump_targets = 0;
+            num_blocks += (num_jump_targets + 1) / 2;
+            for (u32 k = 0; k < num_jump_targets; k++) region_add_entry(region, jump_targets[k]);
+            return_dispatch = insn.type == insn_jalr && insn.rd == zero && insn.rs1 == ra &&
+                              num_jump_targets == 0;
+            has_return |= return_dispatch;
+            speculated_target = insn.type == insn_jalr && num_jump_targets == 0 && !return_dispatch ?
+                                cfg_jalr_target(cfg, profile, pc) : 0;
+            if (speculated_target != 0) region_add_entry(region, speculated_target);
+            stack_reset(&succ);
+            if (idiom_loop) stack_push(&succ, block->end);
+            body = funcs[insn.type](body, &insn, &tracer, &succ, pc);
+            // 函数调用：返回之后的代码也是这条指令的后继，和被调用的函数共用这个块的两个名额
+            if (insn.type == insn_jal && insn.rd == ra) {
+                u64 site = pc + (insn.rvc ? 2 : 4);
+                return_sites[num_return_sites++] = site;
+                region_add_entry(region, site);
+                stack_push(&succ, site);
+            }
+
+            cfg_node_t *node = &graph.nodes[graph.num_nodes++];
+            node->pc = pc;
+            node->first_succ = graph.num_succs;
+            for (i64 k = 0; k < succ.top; k++) graph.succs[graph.num_succs++] = succ.elems[k];
+            if (!insn.cont) graph.succs[graph.num_succs++] = pc + (insn.rvc ? 2 : 4);
+            node->num_succ = graph.num_succs - node->first_succ;
+
+            // 条件跳转的目标等到顺序执行的后继知道了之后一起排
+            u64 target = 0;
+            if (branch) stack_pop(&succ, &target);
+            else while (stack_pop(&succ, &target)) stack_push(&stack, target);
+
+            // 如果指令的cont是true，即如果是跳转指令(ecall, jalr...等的话，这个块就结束了
+            // 翻译的时候退回解释器的指令也会设置cont
+            if (insn.cont) break;
+
+            u64 next = pc + (insn.rvc ? 2 : 4);
+            sprintf(buf, "    goto insn_%lx;\n}\n", next);
+            body = str_append(body, buf);
+            // 块的最后一条指令，顺序执行的后继是下一个基本块
+            // 条件跳转一定是块的最后一条指令，先压不太走的一边，比较可能走的一边接着翻译
+            if (branch && taken_percent >= 50) {
+                push_successor(cfg, profile, pc, false, next, taken_percent, &stack, &late, &cold);
+                push_successor(cfg, profile, pc, true, target, taken_percent, &stack, &late, &cold);
+            } else if (branch) {
+                push_successor(cfg, profile, pc, true, target, taken_percent, &stack, &late, &cold);
+                push_successor(cfg, profile, pc, false, next, taken_percent, &stack, &late, &cold);
+            } else if (i == block->num_insns - 1) {
+                stack_push(&stack, next);
+            }
+            pc = next;
+        }
+    }
 
-        sprintf(buf, "insn_%lx: {\n", pc);
+    // 冷的后继没有被热的路径翻译到的，跳到那里就退回解释器接着执行
+    while (stack_pop(&cold, &pc)) {
+        if (!set_add(&set, pc)) continue;
+        exits[num_exits++] = pc;
+        chunk_add(pc, body);
+        static char buf[256];
+        sprintf(buf, "insn_%lx: {\n"
+                     "    state->exit_reason = side_exit;\n"
+                     "    state->reenter_pc = %luULL;\n"
+                     "    goto end;\n"
+                     "}\n", pc, pc);
         body = str_append(body, buf);
+    }
 
-        u32 data = *(u32 *)TO_HOST(pc);
-        insn_decode(&insn, data);
-        body = funcs[insn.type](body, &insn, &tracer, &stack, pc);
+    // 最后一段代码的结尾，后面的ret_dispatch不属于任何一条指令
+    chunk_off[num_chunks] = str_len(body);
 
-        // 如果指令的cont是true，即如果是跳转指令(ecall, jalr...等的话，就会跳出循环)
-        // 这儿写的是continue，但是每次循环最多添加一个pc指针，如果continue，肯定会跳出
-        if (insn.cont) continue;
+    if (has_return) {
+        body = str_append(body, "ret_dispatch:\n");
+        body = str_append(body, "    switch (ret_target) {\n");
+        for (u64 i = 0; i < num_return_sites; i++) {
+            static char buf[128];
+            sprintf(buf, "    case %luULL: goto insn_%lx;\n", return_sites[i], return_sites[i]);
+            body = str_append(body, buf);
+        }
+        body = str_append(body, "    }\n");
+        body = str_append(body, "    state->exit_reason = indirect_branch;\n");
+        body = str_append(body, "    state->reenter_pc = ret_target;\n");
+        body = str_append(body, "    goto end;\n");
+    }
 
-        pc += (insn.rvc ? 2 : 4);
-        sprintf(buf, "    goto insn_%lx;\n", pc);
-        body = str_append(body, buf);
-        body = str_append(body, "}\n");
-        stack_push(&stack, pc);
+    // 跳到出口的入口不能登记，不然从那里进来之后马上又退出到同一个pc
+    // 循环中间的入口也不登记，从下面的switch跳进去的话，循环就不止一个入口了，
+    // clang认不出来，不会优化它；以后从那里进来的时候按它自己的热度另外编译
+    region->num_loops = cfg_find_loops(&graph, m->state.pc);
+    u64 kept = 0;
+    for (u64 i = 0; i < region->num_entries; i++) {
+        bool exit = false;
+        for (u64 j = 0; j < num_exits; j++) exit |= exits[j] == region->entries[i];
+        cfg_node_t *node = cfg_node(&graph, region->entries[i]);
+        if (i > 0 && node != NULL && node->inner) exit = true;
+        if (!exit) region->entries[kept++] = region->entries[i];
     }
+    region->num_entries = kept;
 
     DECLEAR_STATIC_STR(source);
     source = str_append(source, "#include <stdint.h>\n");
     source = str_append(source, "#include <stdbool.h>\n");
     source = str_append(source, CODEGEN_PROLOGUE);
     source = tracer_append_prologue(&tracer, source);
-    source = str_append(source, body);
+    if (has_return) source = str_append(source, "    uint64_t ret_target = 0;\n");
+    // 别的入口进来的时候，寄存器已经在上面全部读好了，直接跳到对应的指令
+    // 没有匹配的就是entries[0]，也就是body的第一条指令
+    if (region->num_entries > 1) {
+        static char buf[128];
+        source = str_append(source, "    switch (state->pc) {\n");
+        for (u64 i = 1; i < region->num_entries; i++) {
+            sprintf(buf, "    case %luULL: goto insn_%lx;\n", region->entries[i], region->entries[i]);
+            source = str_append(source, buf);
+        }
+        source = str_append(source, "    }\n");
+    }
+    // 指令按循环的嵌套重新排列，每个循环是一个for
+    source = emit_loop(source, &graph, body, 0);
+    source = str_append(source, body + chunk_off[num_chunks]);
     source = str_append(source, "end:;\n");
+    source = str_append(source, "    state->instret += instret;\n");
     source = tracer_append_epilogue(&tracer, source);
     source = str_append(source, CODEGEN_EPILOGUE);
 
@@ -1,27 +1,37 @@
 #include "rvemu.h"
 
-#define BINBUF_CAP 64 * 1024
+#define BINBUF_CAP 1024 * 1024
 
 static u8 elfbuf[BINBUF_CAP] = {0};
 
+// 调用者需要持有m->cache->lock，elfbuf是共享的
+// 返回重定位好的代码，还没有登记到cache里，由调用者把区域的所有入口一起cache_publish
+// jitcode放不下的时候返回NULL
 u8 *machine_compile(machine_t *m, str_t source) {
-    int saved_stdout = dup(STDOUT_FILENO);
-    int outp[2];
-
-    if (pipe(outp) != 0) fatal("cannot make a pipe");
-    dup2(outp[1], STDOUT_FILENO);
-    close(outp[1]);
+    // clang的输出写到一个临时文件里，不能再把进程的stdout重定向到管道，
+    // 因为其他guest线程这时候可能正在写stdout
+    char path[] = "/tmp/rvemu-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) fatal("cannot create a temporary file");
+
+    char cmd[256];
+    // -fno-builtin: 不要把拷贝循环变成memcpy调用，生成的代码里没有办法链接libc
+    // -ffp-contract=off: guest分开的乘法和加法不能被合并成fma，舍入的结果会不一样
+    // 生成的代码只在这台机器上运行，所以可以用host所有的指令集扩展，比如guest的fmadd编译成一条vfmadd
+    snprintf(cmd, sizeof(cmd), "clang -O3 -fno-builtin -ffp-contract=off%s -c -xc -o %s -",
+             cpu_clang_flags(), path);
 
     FILE *f;
-    f = popen("clang -O3 -c -xc -o /dev/stdout -", "w");
+    f = popen(cmd, "w");
     if (f == NULL) fatal("cannot compile program");
     fwrite(source, 1, str_len(source), f);
-    pclose(f);
-    fflush(stdout);
+    if (pclose(f) != 0) fatal("cannot compile program");
 
-    // 首先从管道中读出BINBUF_CAP大小的内容，一般情况不会超过这个大小
-    read(outp[0], elfbuf, BINBUF_CAP);
-    dup2(saved_stdout, STDOUT_FILENO);
+    // 读出BINBUF_CAP大小的内容，一般情况不会超过这个大小
+    ssize_t len = read(fd, elfbuf, BINBUF_CAP);
+    close(fd);
+    unlink(path);
+    if (len <= 0 || len == BINBUF_CAP) fatal("bad object file");
 
     // 首先从中解析出elf header的结构
     elf64_ehdr_t *ehdr = (elf64_ehdr_t *)elfbuf;
@@ -57,19 +67,21 @@ u8 *machine_compile(machine_t *m, str_t source) {
     elf64_shdr_t *text_shdr = (elf64_shdr_t *)(elfbuf + text_shoff);
 
     if (rela_idx == 0 || rodata_idx == 0) {
-        return cache_add(m->cache, m->state.pc, elfbuf + text_shdr->sh_offset,
-                         text_shdr->sh_size, text_shdr->sh_addralign);
+        return cache_alloc(m->cache, elfbuf + text_shdr->sh_offset,
+                           text_shdr->sh_size, text_shdr->sh_addralign);
     }
 
+    // .text要等重定位完成之后才能cache_publish，不然其他线程可能执行到还没修正的代码
     u64 text_addr = 0;
     {
         // rodata段
         u64 shoff = ehdr->e_shoff + rodata_idx * sizeof(elf64_shdr_t);
         elf64_shdr_t *shdr = (elf64_shdr_t *)(elfbuf + shoff);
-        cache_add(m->cache, m->state.pc, elfbuf + shdr->sh_offset,
-                  shdr->sh_size, shdr->sh_addralign);
-        text_addr = (u64)cache_add(m->cache, m->state.pc, elfbuf + text_shdr->sh_offset,
-                                   text_shdr->sh_size, text_shdr->sh_addralign);
+        cache_alloc(m->cache, elfbuf + shdr->sh_offset,
+                    shdr->sh_size, shdr->sh_addralign);
+        text_addr = (u64)cache_alloc(m->cache, elfbuf + text_shdr->sh_offset,
+                                     text_shdr->sh_size, text_shdr->sh_addralign);
+        if (m->cache->full) return NULL;
     }
 
     // apply relocations to .text section.
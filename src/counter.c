@@ -0,0 +1,43 @@
+#include <time.h>
+
+#include "rvemu.h"
+
+//
+// 用户态的计数器：cycle、time、instret、hpmcounter3-31
+//
+// instret由执行代码的地方维护：解释器在一个块执行完的时候加上块里的指令数，
+// jit生成的代码在退出的时候把这段代码里执行的指令数加上去
+// time来自host的单调时钟，按照TIMEBASE_HZ换算
+// cycle没有真正的时序模型，按照固定的CPI从instret推出来，CPI可以用环境变量RVEMU_CPI设置
+//
+
+// 和qemu virt的timebase-frequency一样
+#define TIMEBASE_HZ 10000000
+
+static f64 cpi = 1.0;
+
+void counter_init() {
+    char *env = getenv("RVEMU_CPI");
+    if (env == NULL) return;
+    f64 v = strtod(env, NULL);
+    if (v <= 0) fatal("RVEMU_CPI must be positive");
+    cpi = v;
+}
+
+static u64 host_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * TIMEBASE_HZ + (u64)ts.tv_nsec / (1000000000 / TIMEBASE_HZ);
+}
+
+u64 counter_read_csr(state_t *state, u16 csr) {
+    switch (csr) {
+    case csr_cycle:   return (u64)((f64)state->instret * cpi);
+    case csr_time:    return host_time();
+    case csr_instret: return state->instret;
+    // 没有cache和分支预测的时序模型，hpmcounter都是0，规范允许这样实现
+    default:
+        assert(csr >= csr_hpmcounter3 && csr <= csr_hpmcounter31);
+        return 0;
+    }
+}
@@ -0,0 +1,93 @@
+#include <cpuid.h>
+
+#include "rvemu.h"
+
+//
+// host cpu的指令集扩展，启动的时候用cpuid检测一次
+// 模拟器本身是按照通用的x86-64编译的，检测到的扩展用在两个地方：
+// 解释器里热的handler多编译了一个用扩展指令的版本，interp_init的时候选一次；
+// jit编译生成的代码的时候把对应的-m参数交给clang
+//
+
+u32 cpu_features = 0;
+
+static char clang_flags[128];
+static char description[128];
+
+static const struct {
+    u32 feature;
+    const char *name;
+    const char *flags;
+} feature_names[] = {
+    { CPU_POPCNT, "popcnt", "-mpopcnt" },
+    { CPU_LZCNT,  "lzcnt",  "-mlzcnt" },
+    { CPU_BMI,    "bmi",    "-mbmi" },
+    { CPU_BMI2,   "bmi2",   "-mbmi2" },
+    { CPU_FMA,    "fma",    "-mfma" },
+    { CPU_F16C,   "f16c",   "-mf16c" },
+    { CPU_AVX2,   "avx2",   "-mavx2" },
+    { CPU_AVX512, "avx512", "-mavx512f -mavx512dq -mavx512bw -mavx512vl" },
+};
+
+// 操作系统有没有在上下文切换的时候保存ymm/zmm寄存器，cpuid说支持AVX还不够
+static u64 xgetbv() {
+    u32 lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((u64)hi << 32) | lo;
+}
+
+void cpu_detect() {
+    u32 eax, ebx, ecx, edx;
+    u32 features = 0;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        if (ecx & bit_POPCNT) features |= CPU_POPCNT;
+
+        bool avx = (ecx & bit_OSXSAVE) && (ecx & bit_AVX);
+        u64 xcr0 = avx ? xgetbv() : 0;
+        // xmm、ymm的状态
+        bool ymm = (xcr0 & 0x6) == 0x6;
+        // 再加上opmask和zmm的高半部分
+        bool zmm = (xcr0 & 0xe6) == 0xe6;
+
+        if (ymm && (ecx & bit_FMA)) features |= CPU_FMA;
+        if (ymm && (ecx & bit_F16C)) features |= CPU_F16C;
+
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+            if (ebx & bit_BMI) features |= CPU_BMI;
+            if (ebx & bit_BMI2) features |= CPU_BMI2;
+            if (ymm && (ebx & bit_AVX2)) features |= CPU_AVX2;
+            u32 avx512 = bit_AVX512F | bit_AVX512DQ | bit_AVX512BW | bit_AVX512VL;
+            if (zmm && (ebx & avx512) == avx512) features |= CPU_AVX512;
+        }
+    }
+
+    if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+        if (ecx & bit_LZCNT) features |= CPU_LZCNT;
+    }
+
+    // 环境变量RVEMU_CPU_GENERIC可以关掉所有的扩展，方便在同一台机器上比较
+    if (getenv("RVEMU_CPU_GENERIC")) features = 0;
+    cpu_features = features;
+
+    clang_flags[0] = '\0';
+    description[0] = '\0';
+    for (u64 i = 0; i < sizeof(feature_names) / sizeof(feature_names[0]); i++) {
+        if (!cpu_has(feature_names[i].feature)) continue;
+        strcat(clang_flags, " ");
+        strcat(clang_flags, feature_names[i].flags);
+        if (description[0] != '\0') strcat(description, " ");
+        strcat(description, feature_names[i].name);
+    }
+    if (description[0] == '\0') strcpy(description, "generic");
+}
+
+// 传给clang的-m参数，前面带一个空格，没有扩展的时候是空串
+const char *cpu_clang_flags() {
+    return clang_flags;
+}
+
+// 检测到的扩展，空格分隔
+const char *cpu_describe() {
+    return description;
+}
@@ -90,12 +90,26 @@ static inline insn_t insn_csrtype_read(u32 data) {
     };
 }
 
+// 向量指令，rd是vd/vs3，rs1是vs1/rs1/imm，rs2是vs2/rs2/lumop
+static inline insn_t insn_vtype_read(u32 data) {
+    return (insn_t) {
+        .imm = (i32)(data << 12) >> 27,
+        .rs1 = RS1(data),
+        .rs2 = RS2(data),
+        .rd = RD(data),
+        .funct3 = FUNCT3(data),
+        .funct6 = data >> 26,
+        .vm = (data >> 25) & 0x1,
+    };
+}
+
 static inline insn_t insn_fprtype_read(u32 data) {
     return (insn_t) {
         .rs1 = RS1(data),
         .rs2 = RS2(data),
         .rs3 = RS3(data),
         .rd =  RD(data),
+        .rm = FUNCT3(data),
     };
 }
 
@@ -640,6 +654,13 @@ void insn_decode(insn_t *insn, u32 data) {
             case 0x3: /* FLD */
                 insn->type = insn_fld;
                 return;
+            case 0x1: /* FLH */
+                insn->type = insn_flh;
+                return;
+            case 0x0: case 0x5: case 0x6: case 0x7: /* VL* */
+                *insn = insn_vtype_read(data);
+                insn->type = insn_vload;
+                return;
             default: unreachable();
             }
         }
@@ -658,6 +679,7 @@ void insn_decode(insn_t *insn, u32 data) {
                 insn_t _insn = {0};
                 *insn = _insn;
                 insn->type = insn_fence_i;
+                insn->cont = true;
                 return;
             }
             default: unreachable();
@@ -674,12 +696,43 @@ void insn_decode(insn_t *insn, u32 data) {
                 return;
             case 0x1: {
                 u32 imm116 = IMM116(data);
-                if (imm116 == 0) { /* SLLI */
+                switch (imm116) {
+                case 0x00: /* SLLI */
                     insn->type = insn_slli;
-                } else {
-                    unreachable();
+                    return;
+                case 0x0a: /* BSETI */
+                    insn->type = insn_bseti;
+                    return;
+                case 0x12: /* BCLRI */
+                    insn->type = insn_bclri;
+                    return;
+                case 0x1a: /* BINVI */
+                    insn->type = insn_binvi;
+                    return;
+                case 0x18: {
+                    // Zbb的单操作数指令，用rs2的位置区分
+                    switch (RS2(data)) {
+                    case 0x0: /* CLZ */
+                        insn->type = insn_clz;
+                        return;
+                    case 0x1: /* CTZ */
+                        insn->type = insn_ctz;
+                        return;
+                    case 0x2: /* CPOP */
+                        insn->type = insn_cpop;
+                        return;
+                    case 0x4: /* SEXT.B */
+                        insn->type = insn_sext_b;
+                        return;
+                    case 0x5: /* SEXT.H */
+                        insn->type = insn_sext_h;
+                        return;
+                    default: unreachable();
+                    }
+                }
+                unreachable();
+                default: unreachable();
                 }
-                return;
             }
             unreachable();
             case 0x2: /* SLTI */
@@ -694,14 +747,29 @@ void insn_decode(insn_t *insn, u32 data) {
             case 0x5: {
                 u32 imm116 = IMM116(data);
 
-                if (imm116 == 0x0) { /* SRLI */
+                switch (imm116) {
+                case 0x00: /* SRLI */
                     insn->type = insn_srli;
-                } else if (imm116 == 0x10) { /* SRAI */
+                    return;
+                case 0x10: /* SRAI */
                     insn->type = insn_srai;
-                } else {
-                    unreachable();
+                    return;
+                case 0x12: /* BEXTI */
+                    insn->type = insn_bexti;
+                    return;
+                case 0x18: /* RORI */
+                    insn->type = insn_rori;
+                    return;
+                case 0x0a: /* ORC.B */
+                    assert(RS2(data) == 0x7);
+                    insn->type = insn_orc_b;
+                    return;
+                case 0x1a: /* REV8 */
+                    assert(RS2(data) == 0x18);
+                    insn->type = insn_rev8;
+                    return;
+                default: unreachable();
                 }
-                return;
             }
             unreachable();
             case 0x6: /* ORI */
@@ -728,10 +796,35 @@ void insn_decode(insn_t *insn, u32 data) {
             case 0x0: /* ADDIW */
                 insn->type = insn_addiw;
                 return;
-            case 0x1: /* SLLIW */
-                assert(funct7 == 0);
-                insn->type = insn_slliw;
-                return;
+            case 0x1: {
+                // SLLI.UW的shamt有6位，占用了funct7的最低位
+                if (IMM116(data) == 0x02) { /* SLLI.UW */
+                    insn->type = insn_slli_uw;
+                    return;
+                }
+                switch (funct7) {
+                case 0x0: /* SLLIW */
+                    insn->type = insn_slliw;
+                    return;
+                case 0x30: {
+                    switch (RS2(data)) {
+                    case 0x0: /* CLZW */
+                        insn->type = insn_clzw;
+                        return;
+                    case 0x1: /* CTZW */
+                        insn->type = insn_ctzw;
+                        return;
+                    case 0x2: /* CPOPW */
+                        insn->type = insn_cpopw;
+                        return;
+                    default: unreachable();
+                    }
+                }
+                unreachable();
+                default: unreachable();
+                }
+            }
+            unreachable();
             case 0x5: {
                 switch (funct7) {
                 case 0x0: /* SRLIW */
@@ -740,6 +833,9 @@ void insn_decode(insn_t *insn, u32 data) {
                 case 0x20: /* SRAIW */
                     insn->type = insn_sraiw;
                     return;
+                case 0x30: /* RORIW */
+                    insn->type = insn_roriw;
+                    return;
                 default: unreachable();
                 }
             }
@@ -780,6 +876,67 @@ void insn_decode(insn_t *insn, u32 data) {
             case 0x3: /* FSD */
                 insn->type = insn_fsd;
                 return;
+            case 0x1: /* FSH */
+                insn->type = insn_fsh;
+                return;
+            case 0x0: case 0x5: case 0x6: case 0x7: /* VS* */
+                *insn = insn_vtype_read(data);
+                insn->type = insn_vstore;
+                return;
+            default: unreachable();
+            }
+        }
+        unreachable();
+        case 0xb: {
+            u32 funct3 = FUNCT3(data);
+            u32 funct5 = (data >> 27) & 0x1f;
+
+            *insn = insn_rtype_read(data);
+            insn->aq = (data >> 26) & 0x1;
+            insn->rl = (data >> 25) & 0x1;
+
+            // .d的指令在枚举中紧跟在对应的.w的指令之后，顺序相同
+            i32 width;
+            switch (funct3) {
+            case 0x2: width = 0; break;
+            case 0x3: width = insn_lr_d - insn_lr_w; break;
+            default: fatal("unrecognized funct3");
+            }
+
+            switch (funct5) {
+            case 0x02: /* LR */
+                insn->type = insn_lr_w + width;
+                return;
+            case 0x03: /* SC */
+                insn->type = insn_sc_w + width;
+                return;
+            case 0x01: /* AMOSWAP */
+                insn->type = insn_amoswap_w + width;
+                return;
+            case 0x00: /* AMOADD */
+                insn->type = insn_amoadd_w + width;
+                return;
+            case 0x04: /* AMOXOR */
+                insn->type = insn_amoxor_w + width;
+                return;
+            case 0x0c: /* AMOAND */
+                insn->type = insn_amoand_w + width;
+                return;
+            case 0x08: /* AMOOR */
+                insn->type = insn_amoor_w + width;
+                return;
+            case 0x10: /* AMOMIN */
+                insn->type = insn_amomin_w + width;
+                return;
+            case 0x14: /* AMOMAX */
+                insn->type = insn_amomax_w + width;
+                return;
+            case 0x18: /* AMOMINU */
+                insn->type = insn_amominu_w + width;
+                return;
+            case 0x1c: /* AMOMAXU */
+                insn->type = insn_amomaxu_w + width;
+                return;
             default: unreachable();
             }
         }
@@ -859,10 +1016,84 @@ void insn_decode(insn_t *insn, u32 data) {
                 case 0x5: /* SRA */
                     insn->type = insn_sra;
                     return;
+                case 0x4: /* XNOR */
+                    insn->type = insn_xnor;
+                    return;
+                case 0x6: /* ORN */
+                    insn->type = insn_orn;
+                    return;
+                case 0x7: /* ANDN */
+                    insn->type = insn_andn;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x10: {
+                switch (funct3) {
+                case 0x2: /* SH1ADD */
+                    insn->type = insn_sh1add;
+                    return;
+                case 0x4: /* SH2ADD */
+                    insn->type = insn_sh2add;
+                    return;
+                case 0x6: /* SH3ADD */
+                    insn->type = insn_sh3add;
+                    return;
                 default: unreachable();
                 }
             }
             unreachable();
+            case 0x5: {
+                switch (funct3) {
+                case 0x4: /* MIN */
+                    insn->type = insn_min;
+                    return;
+                case 0x5: /* MINU */
+                    insn->type = insn_minu;
+                    return;
+                case 0x6: /* MAX */
+                    insn->type = insn_max;
+                    return;
+                case 0x7: /* MAXU */
+                    insn->type = insn_maxu;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x30: {
+                switch (funct3) {
+                case 0x1: /* ROL */
+                    insn->type = insn_rol;
+                    return;
+                case 0x5: /* ROR */
+                    insn->type = insn_ror;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x24: {
+                switch (funct3) {
+                case 0x1: /* BCLR */
+                    insn->type = insn_bclr;
+                    return;
+                case 0x5: /* BEXT */
+                    insn->type = insn_bext;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x34: /* BINV */
+                assert(funct3 == 0x1);
+                insn->type = insn_binv;
+                return;
+            case 0x14: /* BSET */
+                assert(funct3 == 0x1);
+                insn->type = insn_bset;
+                return;
             default: unreachable();
             }
         }
@@ -926,6 +1157,46 @@ void insn_decode(insn_t *insn, u32 data) {
                 }
             }
             unreachable();
+            case 0x4: {
+                switch (funct3) {
+                case 0x0: /* ADD.UW */
+                    insn->type = insn_add_uw;
+                    return;
+                case 0x4: /* ZEXT.H */
+                    assert(insn->rs2 == zero);
+                    insn->type = insn_zext_h;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x10: {
+                switch (funct3) {
+                case 0x2: /* SH1ADD.UW */
+                    insn->type = insn_sh1add_uw;
+                    return;
+                case 0x4: /* SH2ADD.UW */
+                    insn->type = insn_sh2add_uw;
+                    return;
+                case 0x6: /* SH3ADD.UW */
+                    insn->type = insn_sh3add_uw;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x30: {
+                switch (funct3) {
+                case 0x1: /* ROLW */
+                    insn->type = insn_rolw;
+                    return;
+                case 0x5: /* RORW */
+                    insn->type = insn_rorw;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
             default: unreachable();
             }
         }
@@ -941,6 +1212,9 @@ void insn_decode(insn_t *insn, u32 data) {
             case 0x1: /* FMADD.D */
                 insn->type = insn_fmadd_d;
                 return;
+            case 0x2: /* FMADD.H */
+                insn->type = insn_fmadd_h;
+                return;
             default: unreachable();
             }
         }
@@ -956,6 +1230,9 @@ void insn_decode(insn_t *insn, u32 data) {
             case 0x1: /* FMSUB.D */
                 insn->type = insn_fmsub_d;
                 return;
+            case 0x2: /* FMSUB.H */
+                insn->type = insn_fmsub_h;
+                return;
             default: unreachable();
             }
         }
@@ -971,6 +1248,9 @@ void insn_decode(insn_t *insn, u32 data) {
             case 0x1: /* FNMSUB.D */
                 insn->type = insn_fnmsub_d;
                 return;
+            case 0x2: /* FNMSUB.H */
+                insn->type = insn_fnmsub_h;
+                return;
             default: unreachable();
             }
         }
@@ -986,6 +1266,9 @@ void insn_decode(insn_t *insn, u32 data) {
             case 0x1: /* FNMADD.D */
                 insn->type = insn_fnmadd_d;
                 return;
+            case 0x2: /* FNMADD.H */
+                insn->type = insn_fnmadd_h;
+                return;
             default: unreachable();
             }
         }
@@ -994,6 +1277,8 @@ void insn_decode(insn_t *insn, u32 data) {
             u32 funct7 = FUNCT7(data);
 
             *insn = insn_rtype_read(data);
+            // 对于fsgnj、fmin这些指令，funct3不是舍入模式，执行的时候不会用到rm
+            insn->rm = FUNCT3(data);
             switch (funct7) {
             case 0x0:  /* FADD.S */
                 insn->type = insn_fadd_s;
@@ -1019,6 +1304,18 @@ void insn_decode(insn_t *insn, u32 data) {
             case 0xd:  /* FDIV.D */
                 insn->type = insn_fdiv_d;
                 return;
+            case 0x2:  /* FADD.H */
+                insn->type = insn_fadd_h;
+                return;
+            case 0x6:  /* FSUB.H */
+                insn->type = insn_fsub_h;
+                return;
+            case 0xa:  /* FMUL.H */
+                insn->type = insn_fmul_h;
+                return;
+            case 0xe:  /* FDIV.H */
+                insn->type = insn_fdiv_h;
+                return;
             case 0x10: {
                 u32 funct3 = FUNCT3(data);
 
@@ -1081,14 +1378,48 @@ void insn_decode(insn_t *insn, u32 data) {
                 }
             }
             unreachable();
-            case 0x20: /* FCVT.S.D */
-                assert(RS2(data) == 1);
-                insn->type = insn_fcvt_s_d;
-                return;
-            case 0x21: /* FCVT.D.S */
-                assert(RS2(data) == 0);
-                insn->type = insn_fcvt_d_s;
-                return;
+            case 0x20: {
+                u32 rs2 = RS2(data);
+
+                switch (rs2) {
+                case 0x1: /* FCVT.S.D */
+                    insn->type = insn_fcvt_s_d;
+                    return;
+                case 0x2: /* FCVT.S.H */
+                    insn->type = insn_fcvt_s_h;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x21: {
+                u32 rs2 = RS2(data);
+
+                switch (rs2) {
+                case 0x0: /* FCVT.D.S */
+                    insn->type = insn_fcvt_d_s;
+                    return;
+                case 0x2: /* FCVT.D.H */
+                    insn->type = insn_fcvt_d_h;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x22: {
+                u32 rs2 = RS2(data);
+
+                switch (rs2) {
+                case 0x0: /* FCVT.H.S */
+                    insn->type = insn_fcvt_h_s;
+                    return;
+                case 0x1: /* FCVT.H.D */
+                    insn->type = insn_fcvt_h_d;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
             case 0x2c: /* FSQRT.S */
                 assert(insn->rs2 == 0);
                 insn->type = insn_fsqrt_s;
@@ -1097,6 +1428,117 @@ void insn_decode(insn_t *insn, u32 data) {
                 assert(insn->rs2 == 0);
                 insn->type = insn_fsqrt_d;
                 return;
+            case 0x2e: /* FSQRT.H */
+                assert(insn->rs2 == 0);
+                insn->type = insn_fsqrt_h;
+                return;
+            case 0x12: {
+                u32 funct3 = FUNCT3(data);
+
+                switch (funct3) {
+                case 0x0: /* FSGNJ.H */
+                    insn->type = insn_fsgnj_h;
+                    return;
+                case 0x1: /* FSGNJN.H */
+                    insn->type = insn_fsgnjn_h;
+                    return;
+                case 0x2: /* FSGNJX.H */
+                    insn->type = insn_fsgnjx_h;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x16: {
+                u32 funct3 = FUNCT3(data);
+
+                switch (funct3) {
+                case 0x0: /* FMIN.H */
+                    insn->type = insn_fmin_h;
+                    return;
+                case 0x1: /* FMAX.H */
+                    insn->type = insn_fmax_h;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x52: {
+                u32 funct3 = FUNCT3(data);
+
+                switch (funct3) {
+                case 0x0: /* FLE.H */
+                    insn->type = insn_fle_h;
+                    return;
+                case 0x1: /* FLT.H */
+                    insn->type = insn_flt_h;
+                    return;
+                case 0x2: /* FEQ.H */
+                    insn->type = insn_feq_h;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x62: {
+                u32 rs2 = RS2(data);
+
+                switch (rs2) {
+                case 0x0: /* FCVT.W.H */
+                    insn->type = insn_fcvt_w_h;
+                    return;
+                case 0x1: /* FCVT.WU.H */
+                    insn->type = insn_fcvt_wu_h;
+                    return;
+                case 0x2: /* FCVT.L.H */
+                    insn->type = insn_fcvt_l_h;
+                    return;
+                case 0x3: /* FCVT.LU.H */
+                    insn->type = insn_fcvt_lu_h;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x6a: {
+                u32 rs2 = RS2(data);
+
+                switch (rs2) {
+                case 0x0: /* FCVT.H.W */
+                    insn->type = insn_fcvt_h_w;
+                    return;
+                case 0x1: /* FCVT.H.WU */
+                    insn->type = insn_fcvt_h_wu;
+                    return;
+                case 0x2: /* FCVT.H.L */
+                    insn->type = insn_fcvt_h_l;
+                    return;
+                case 0x3: /* FCVT.H.LU */
+                    insn->type = insn_fcvt_h_lu;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x72: {
+                assert(RS2(data) == 0);
+                u32 funct3 = FUNCT3(data);
+
+                switch (funct3) {
+                case 0x0: /* FMV.X.H */
+                    insn->type = insn_fmv_x_h;
+                    return;
+                case 0x1: /* FCLASS.H */
+                    insn->type = insn_fclass_h;
+                    return;
+                default: unreachable();
+                }
+            }
+            unreachable();
+            case 0x7a: /* FMV.H.X */
+                assert(RS2(data) == 0 && FUNCT3(data) == 0);
+                insn->type = insn_fmv_h_x;
+                return;
             case 0x50: {
                 u32 funct3 = FUNCT3(data);
 
@@ -1280,6 +1722,25 @@ void insn_decode(insn_t *insn, u32 data) {
             }
         }
         unreachable();
+        case 0x15: {
+            *insn = insn_vtype_read(data);
+            if (insn->funct3 != OPCFG) {
+                insn->type = insn_vop;
+                return;
+            }
+
+            if ((data >> 31) == 0) { /* VSETVLI */
+                insn->imm = (data >> 20) & 0x7ff;
+                insn->type = insn_vsetvli;
+            } else if ((data >> 30) == 0x3) { /* VSETIVLI */
+                insn->imm = (data >> 20) & 0x3ff;
+                insn->type = insn_vsetivli;
+            } else { /* VSETVL */
+                insn->type = insn_vsetvl;
+            }
+            return;
+        }
+        unreachable();
         case 0x19: /* JALR */
             *insn = insn_itype_read(data);
             insn->type = insn_jalr;
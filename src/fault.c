@@ -0,0 +1,82 @@
+#define _GNU_SOURCE
+
+// signal.h里的stack_t和stack.c的stack_t重名
+#define stack_t host_stack_t
+#include <signal.h>
+#include <ucontext.h>
+#undef stack_t
+
+#include "rvemu.h"
+
+//
+// guest的访存不检查边界：guest窗口前后是一大段PROT_NONE的保护区(见mmu.c)，
+// 野指针、空指针、写只读的代码段都会在host上触发SIGSEGV，
+// 这里根据出错的host pc找到对应的guest pc，打印出来之后按照段错误结束进程，
+// 和guest在真机上没有装信号处理函数的时候一样
+// 访存的快路径上没有任何多余的指令，代价全在出错的时候
+//
+
+// 当前host线程正在执行的guest线程
+static __thread machine_t *current = NULL;
+
+// 每个guest线程在进入执行循环的时候调用一次
+void fault_enter(machine_t *m) {
+    current = m;
+}
+
+static void fault_on_signal(int sig, siginfo_t *info, void *ctx) {
+    machine_t *m = current;
+    u64 addr = (u64)info->si_addr;
+    // 不是guest内存里的地址，是模拟器自己的问题
+    if (m == NULL || addr < GUEST_MEMORY_OFFSET || addr >= GUEST_POOL_END) {
+        outbuf_on_signal(sig);
+        return;
+    }
+
+    u64 guest_addr = TO_GUEST(m->state.guest_base, addr);
+    // guest写了一页翻译过的代码：作废上面的代码块，恢复写权限之后返回，重新执行这条store
+    // 两个线程同时写同一页的时候，另一个线程可能已经恢复了写权限，这里看到的就是page_data，
+    // 这时候machine_invalidate什么都不做，直接重新执行就行
+    // 不能访问的页都是page_none，只读的页是page_readonly，这两种才是guest真的访存出错
+    // SIGSEGV是同步的，出错的地方是guest的访存，不会正好持有cache->lock，这里可以拿锁
+    if (sig == SIGSEGV && info->si_code == SEGV_ACCERR &&
+        guest_addr < TO_GUEST(m->state.guest_base, m->mmu->host_alloc)) {
+        u8 state = __atomic_load_n(&m->mmu->code_pages[guest_addr / getpagesize()], __ATOMIC_ACQUIRE);
+        if (state == page_code || state == page_data) {
+            machine_invalidate(m, guest_addr, 1);
+            return;
+        }
+    }
+
+    const char *what = sig == SIGBUS ? "bus error" : "segmentation fault";
+    u8 *rip = (u8 *)((ucontext_t *)ctx)->uc_mcontext.gregs[REG_RIP];
+
+    char buf[160];
+    int len;
+    if (rip >= m->cache->jitcode && rip < m->cache->jitcode + CACHE_SIZE) {
+        // jit的代码里guest的寄存器都在host的寄存器里，只能定位到是哪一段代码
+        len = snprintf(buf, sizeof(buf), "[fault] guest %s at 0x%lx, in jit block 0x%lx\n",
+                       what, guest_addr, cache_lookup_host(m->cache, rip));
+    } else if (m->state.host_call_pc != 0) {
+        // jit的代码把整个循环换成了一次memmove/memset/strlen/memchr，出错的是这个循环
+        len = snprintf(buf, sizeof(buf), "[fault] guest %s at 0x%lx, in the loop at 0x%lx\n",
+                       what, guest_addr, m->state.host_call_pc);
+    } else {
+        // 解释器执行每条指令的时候state->pc就是这条指令，syscall的时候是ecall的下一条
+        len = snprintf(buf, sizeof(buf), "[fault] guest %s at 0x%lx, pc 0x%lx\n",
+                       what, guest_addr, m->state.pc);
+    }
+    if (write(2, buf, len) < 0) {}
+    outbuf_on_signal(sig);
+}
+
+// 在outbuf_init之后调用，SIGSEGV和SIGBUS换成这里的处理函数，其他的还是outbuf的
+void fault_init() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = fault_on_signal;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+    sigaction(SIGBUS, &sa, NULL);
+}
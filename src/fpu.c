@@ -0,0 +1,284 @@
+#include <immintrin.h>
+
+#include "rvemu.h"
+
+//
+// 浮点的舍入模式和异常标志
+// guest的frm直接对应host的MXCSR.RC，frm变化的时候才写一次MXCSR，
+// 所以不论是解释器还是jit生成的代码，动态舍入模式的浮点运算直接用host的指令就是正确的
+//
+// 异常标志是懒惰计算的：运算的时候不做任何检查，host的MXCSR里的sticky位自然地累积了标志，
+// 只有guest读fflags/fcsr，或者进入syscall的时候，才把它们读出来合并到state->fcsr
+// MXCSR是每个host线程一份，正好对应每个guest线程自己的fcsr
+//
+
+#define MXCSR_IE 0x01
+#define MXCSR_DE 0x02
+#define MXCSR_ZE 0x04
+#define MXCSR_OE 0x08
+#define MXCSR_UE 0x10
+#define MXCSR_PE 0x20
+#define MXCSR_FLAGS 0x3f
+#define MXCSR_RC_SHIFT 13
+#define MXCSR_RC_MASK (0x3 << MXCSR_RC_SHIFT)
+
+// 下标是RISC-V的舍入模式，值是MXCSR.RC
+// RMM在x86上没有对应的模式，用RNE近似，只有正好在两个数中间的时候结果不同
+static const u32 mxcsr_rc[8] = {
+    [FRM_RNE] = 0,
+    [FRM_RTZ] = 3,
+    [FRM_RDN] = 1,
+    [FRM_RUP] = 2,
+    [FRM_RMM] = 0,
+};
+
+// 切换host的舍入模式，不影响已经累积的异常标志
+// 不能是inline的：调用前后的浮点运算不能被编译器挪到切换的另一边
+void fpu_set_host_rm(u32 rm) {
+    u32 csr = _mm_getcsr();
+    _mm_setcsr((csr & ~MXCSR_RC_MASK) | (mxcsr_rc[rm & 0x7] << MXCSR_RC_SHIFT));
+}
+
+// 把host累积的异常标志合并到fcsr，然后清掉host的标志
+void fpu_collect_flags(state_t *state) {
+    u32 csr = _mm_getcsr();
+    if (!(csr & MXCSR_FLAGS)) return;
+
+    u32 flags = 0;
+    if (csr & MXCSR_IE) flags |= FFLAGS_NV;
+    if (csr & MXCSR_ZE) flags |= FFLAGS_DZ;
+    if (csr & MXCSR_OE) flags |= FFLAGS_OF;
+    if (csr & MXCSR_UE) flags |= FFLAGS_UF;
+    if (csr & MXCSR_PE) flags |= FFLAGS_NX;
+    state->fcsr |= flags;
+    _mm_setcsr(csr & ~MXCSR_FLAGS);
+}
+
+// 丢掉host累积的异常标志，比如模拟器自己做的浮点运算
+void fpu_clear_host_flags() {
+    _mm_setcsr(_mm_getcsr() & ~MXCSR_FLAGS);
+}
+
+u64 fpu_read_csr(state_t *state, u16 csr) {
+    fpu_collect_flags(state);
+    switch (csr) {
+    case fflags: return state->fcsr & FFLAGS_MASK;
+    case frm:    return FCSR_FRM(state->fcsr);
+    case fcsr:   return state->fcsr & 0xff;
+    default: unreachable();
+    }
+}
+
+void fpu_write_csr(state_t *state, u16 csr, u64 val) {
+    u32 old_frm = FCSR_FRM(state->fcsr);
+    switch (csr) {
+    case fflags:
+        state->fcsr = (state->fcsr & ~FFLAGS_MASK) | (val & FFLAGS_MASK);
+        break;
+    case frm:
+        state->fcsr = (state->fcsr & FFLAGS_MASK) | ((val & 0x7) << 5);
+        break;
+    case fcsr:
+        state->fcsr = val & 0xff;
+        break;
+    default: unreachable();
+    }
+
+    // 写了fflags之后，host上还没收集的标志就作废了
+    if (csr != frm) fpu_clear_host_flags();
+    // 只在舍入模式真的变化的时候才写MXCSR
+    if (FCSR_FRM(state->fcsr) != old_frm) fpu_set_host_rm(FCSR_FRM(state->fcsr));
+}
+
+// 按照舍入模式把x舍入成整数值，不依赖host当前的舍入模式
+static f64 round_rm(f64 x, u32 rm) {
+    switch (rm) {
+    case FRM_RTZ: return trunc(x);
+    case FRM_RDN: return floor(x);
+    case FRM_RUP: return ceil(x);
+    case FRM_RMM: return round(x);
+    default: {
+        // RNE: round是远离0的，正好在中间的时候改成偶数
+        f64 r = round(x);
+        if (fabs(r - x) == 0.5) r = 2.0 * round(x / 2.0);
+        return r;
+    }
+    }
+}
+
+// fcvt.w/l: 超出范围的时候饱和到min/max，NaN的结果是max，都会设置NV
+// x86的cvtsd2si在这些情况下返回的是0x80000000，所以不能直接转换
+i64 fpu_to_int(state_t *state, f64 x, u32 rm, i64 min, i64 max) {
+    if (rm == FRM_DYN) rm = FCSR_FRM(state->fcsr);
+    if (isnan(x)) {
+        state->fcsr |= FFLAGS_NV;
+        return max;
+    }
+    f64 r = round_rm(x, rm);
+    if (r < (f64)min) {
+        state->fcsr |= FFLAGS_NV;
+        return min;
+    }
+    // (f64)max + 1.0正好是2的幂，可以精确表示
+    if (r >= (f64)max + 1.0) {
+        state->fcsr |= FFLAGS_NV;
+        return max;
+    }
+    if (r != x) state->fcsr |= FFLAGS_NX;
+    return (i64)r;
+}
+
+// fcvt.wu/lu
+u64 fpu_to_uint(state_t *state, f64 x, u32 rm, u64 max) {
+    if (rm == FRM_DYN) rm = FCSR_FRM(state->fcsr);
+    if (isnan(x)) {
+        state->fcsr |= FFLAGS_NV;
+        return max;
+    }
+    f64 r = round_rm(x, rm);
+    if (r < 0.0) {
+        state->fcsr |= FFLAGS_NV;
+        return 0;
+    }
+    if (r >= (f64)max + 1.0) {
+        state->fcsr |= FFLAGS_NV;
+        return max;
+    }
+    if (r != x) state->fcsr |= FFLAGS_NX;
+    return (u64)r;
+}
+
+//
+// 半精度浮点(Zfh)的转换
+// 有F16C的时候用vcvtph2ps/vcvtps2ph，没有的时候用软件实现，两者的舍入模式都是MXCSR.RC，
+// 异常标志也都是累积在MXCSR里的，和其他的浮点运算一样懒惰地收集
+//
+// 半精度的加减乘除和开方都是先转成float计算再舍入成半精度：
+// float的24位有效数字不少于2 * 11 + 2，两次舍入的结果和直接舍入的一样
+//
+
+__attribute__((target("f16c"))) static f32 f16_to_f32_f16c(u16 h) {
+    return _cvtsh_ss(h);
+}
+
+__attribute__((target("f16c"))) static u16 f32_to_f16_f16c(f32 x) {
+    return _cvtss_sh(x, _MM_FROUND_CUR_DIRECTION);
+}
+
+// 半精度能精确地表示成float，只有sNaN会设置IE，和vcvtph2ps一样
+static f32 f16_to_f32_soft(u16 h) {
+    u32 sign = (u32)(h & 0x8000) << 16;
+    u32 exp = (h >> 10) & 0x1f;
+    u32 frac = h & 0x3ff;
+    union { u32 u; f32 f; } r;
+
+    if (exp == 0x1f) {
+        if (frac && !(frac & 0x200)) _mm_setcsr(_mm_getcsr() | MXCSR_IE);
+        r.u = sign | 0x7f800000 | (frac << 13) | (frac ? 0x400000 : 0);
+    } else if (exp == 0) {
+        // 非规格化数是frac * 2^-24
+        r.f = (f32)frac * 0x1p-24f;
+        r.u |= sign;
+    } else {
+        r.u = sign | ((exp + 112) << 23) | (frac << 13);
+    }
+    return r.f;
+}
+
+// 截断之后的q要不要加1，rem是截掉的部分，rc是MXCSR.RC
+static bool round_up(u32 q, u32 rem, u32 halfway, u16 sign, u32 rc) {
+    switch (rc) {
+    case 0: return rem > halfway || (rem == halfway && (q & 1));
+    case 1: return sign && rem;
+    case 2: return !sign && rem;
+    default: return false;
+    }
+}
+
+static u16 f32_to_f16_soft(f32 x) {
+    union { u32 u; f32 f; } v = { .f = x };
+    u16 sign = (v.u >> 16) & 0x8000;
+    i32 exp = (i32)((v.u >> 23) & 0xff) - 127;
+    u32 frac = v.u & 0x7fffff;
+    u32 csr = _mm_getcsr();
+
+    if (exp == 128) {
+        if (!frac) return sign | 0x7c00;
+        if (!(frac & 0x400000)) _mm_setcsr(csr | MXCSR_IE);
+        return sign | 0x7e00 | (frac >> 13);
+    }
+    if (exp == -127 && frac == 0) return sign;
+
+    // float的非规格化数远小于半精度能表示的范围，只会影响舍入，当成最小的规格化数处理
+    u32 mant = exp == -127 ? frac : frac | 0x800000;
+    if (exp == -127) exp = -126;
+
+    // 规格化的半精度保留11位有效数字，非规格化的时候更少
+    i32 shift = exp >= -14 ? 13 : 13 - 14 - exp;
+    if (shift > 25) shift = 25;
+    u32 q = mant >> shift;
+    u32 rc = (csr & MXCSR_RC_MASK) >> MXCSR_RC_SHIFT;
+    q += round_up(q, mant & ((1u << shift) - 1), 1u << (shift - 1), sign, rc);
+
+    // 进位的时候q正好变成下一个指数的隐含位，直接加上去就是对的编码
+    u32 h = (exp >= -14 ? (u32)(exp + 14) << 10 : 0) + q;
+    u32 flags = mant & ((1u << shift) - 1) ? MXCSR_PE : 0;
+    if (h >= 0x7c00) {
+        // 上溢：RTZ和往0方向的定向舍入得到最大的有限数
+        bool to_max = rc == 3 || (rc == 1 && !sign) || (rc == 2 && sign);
+        h = to_max ? 0x7bff : 0x7c00;
+        flags = MXCSR_OE | MXCSR_PE;
+    } else if (flags && exp < -14) {
+        // 和x86一样在舍入之后判断tiny：假设指数没有下界，保留11位有效数字舍入之后是不是还小于2^-14
+        u32 m = mant >> 13;
+        bool tiny = exp < -15 || m + round_up(m, mant & 0x1fff, 0x1000, sign, rc) < 0x800;
+        if (tiny) flags |= MXCSR_UE;
+    }
+    if (flags) _mm_setcsr(csr | flags);
+    return sign | h;
+}
+
+f32 fpu_f16_to_f32(u16 h) {
+    return cpu_has(CPU_F16C) ? f16_to_f32_f16c(h) : f16_to_f32_soft(h);
+}
+
+// 按照当前的舍入模式把float舍入成半精度
+u16 fpu_f32_to_f16(f32 x) {
+    return cpu_has(CPU_F16C) ? f32_to_f16_f16c(x) : f32_to_f16_soft(x);
+}
+
+// 双精度的值直接转成float再舍入成半精度会有两次舍入的问题：先向0截断，
+// 不精确的时候把最低位置1(round to odd)，多出来的位数足够保留舍入需要的信息，再舍入一次就是对的
+// volatile保证运算不会被挪到切换舍入模式的另一边
+u16 fpu_f64_to_f16(f64 x) {
+    if (isnan(x) || isinf(x)) return fpu_f32_to_f16((f32)x);
+
+    volatile f64 in = x;
+    volatile f32 out;
+    u32 csr = _mm_getcsr();
+    _mm_setcsr(csr | MXCSR_RC_MASK);
+    out = (f32)in;
+    _mm_setcsr(csr);
+
+    union { u32 u; f32 f; } v = { .f = out };
+    if ((f64)v.f != x) v.u |= 1;
+    return fpu_f32_to_f16(v.f);
+}
+
+// fmadd.h: 半精度的乘积在double里是精确的，但是再加上rs3不一定，所以加法也要round to odd
+// 要知道这一次运算是不是精确的，先把host已经累积的异常标志拿开，算完之后再合并回去
+u16 fpu_f16_fma(f32 a, f32 b, f32 c) {
+    volatile f64 va = a, vb = b, vc = c;
+    volatile f64 out;
+    u32 csr = _mm_getcsr();
+    _mm_setcsr((csr & ~MXCSR_FLAGS) | MXCSR_RC_MASK);
+    out = fma(va, vb, vc);
+    u32 flags = _mm_getcsr() & MXCSR_FLAGS;
+    _mm_setcsr(csr | flags);
+
+    union { u64 u; f64 f; } v = { .f = out };
+    // 精确的0的符号由舍入模式决定，按照当前的舍入模式重新算一次
+    if (v.f == 0 && !(flags & MXCSR_PE)) v.f = fma(va, vb, vc);
+    if (flags & MXCSR_PE) v.u |= 1;
+    return fpu_f64_to_f16(v.f);
+}
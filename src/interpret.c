@@ -13,14 +13,19 @@ static void func_empty(state_t *state, insn_t *insn) {}
 typedef void (func_t)(state_t *, insn_t *);
 
 
-#define FUNC(type)                                         \
-    u64 addr = state->gp_regs[insn->rs1] + (i64)insn->imm; \
-    state->gp_regs[insn->rd] = *(type *)TO_HOST(addr);     \
+#define FUNC(type)                                                        \
+    u64 addr = state->gp_regs[insn->rs1] + (i64)insn->imm;                \
+    state->gp_regs[insn->rd] = *(type *)TO_HOST(state->guest_base, addr); \
 
 // function signature
 #define FUNC_SIG(type)                                     \
     static void func_##type(state_t *state, insn_t *insn)  \
 
+// 热的handler用host的指令集扩展再编译一份func_xxx_host，interp_init的时候按照cpu_features选择
+#define FUNC_MULTIVERSION(type, features, ...)                                          \
+    FUNC_SIG(type) { __VA_ARGS__; }                                                     \
+    __attribute__((target(features))) FUNC_SIG(type##_host) { __VA_ARGS__; }            \
+
 // 0: load byte, rd = (i8)[rs1 + imm]
 FUNC_SIG(lb) {
     FUNC(i8);
@@ -141,10 +146,10 @@ FUNC_SIG(auipc) {
 }
 
 // 这个FUNC模板: mem(foo(rs1) + bar(imm)) = f(rs2)
-#define FUNC(type)                                \
-    u64 rs1 = state->gp_regs[insn->rs1];          \
-    u64 rs2 = state->gp_regs[insn->rs2];          \
-    *(type *)TO_HOST(rs1 + insn->imm) = (type)rs2 \
+#define FUNC(type)                                                   \
+    u64 rs1 = state->gp_regs[insn->rs1];                             \
+    u64 rs2 = state->gp_regs[insn->rs2];                             \
+    *(type *)TO_HOST(state->guest_base, rs1 + insn->imm) = (type)rs2 \
 
 // Store Byte, u8[rs1 + offset] ← rs2
 FUNC_SIG(sb) {
@@ -419,74 +424,123 @@ FUNC_SIG(jal) {
     state->exit_reason = direct_branch;
 }
 
+// fence.i结束当前的块，后面的指令回到machine_step重新取
+// guest改写代码的时候翻译过的代码已经作废了，解释器每次都重新取指译码，没有别的要做
+FUNC_SIG(fence_i) {
+    state->exit_reason = direct_branch;
+    state->reenter_pc = state->pc + 4;
+}
+
 // 64: 
 FUNC_SIG(ecall) {
     state->exit_reason = ecall;
     state->reenter_pc = state->pc + 4;
 }
 
-// 状态寄存器
-#define FUNC()                      \
-    switch (insn->csr) {            \
-        case fflags:                \
-        case frm:                   \
-        case fcsr:                  \
-            break;                  \
-        default:                    \
-            fatal("unsupport csr"); \
-    }                               \
-    state->gp_regs[insn->rd] = 0;   \
+// 状态寄存器，目前有浮点的fflags、frm、fcsr，以及用户态的计数器
+static u64 csr_read(state_t *state, u16 csr) {
+    switch (csr) {
+    case fflags:
+    case frm:
+    case fcsr:
+        return fpu_read_csr(state, csr);
+    case csr_cycle:
+    case csr_time:
+    case csr_instret:
+    case csr_hpmcounter3 ... csr_hpmcounter31:
+        return counter_read_csr(state, csr);
+    default:
+        fatal("unsupport csr");
+    }
+}
+
+static void csr_write(state_t *state, u16 csr, u64 val) {
+    switch (csr) {
+    case fflags:
+    case frm:
+    case fcsr:
+        fpu_write_csr(state, csr, val);
+        return;
+    case csr_cycle:
+    case csr_time:
+    case csr_instret:
+    case csr_hpmcounter3 ... csr_hpmcounter31:
+        fatal("read-only csr");
+    default:
+        fatal("unsupport csr");
+    }
+}
 
+// csrrs/csrrc的源操作数是x0(或者uimm为0)的时候只读不写
+#define FUNC(src, expr, write)                      \
+    u64 val = csr_read(state, insn->csr);           \
+    u64 rs1 = (src);                                \
+    if (write) csr_write(state, insn->csr, (expr)); \
+    state->gp_regs[insn->rd] = val;                 \
 
-// 65: 
+
+// 65: t = csr; csr = t & ~x[rs1]; x[rd] = t
 FUNC_SIG(csrrc) {
-    FUNC();
+    FUNC(state->gp_regs[insn->rs1], val & ~rs1, insn->rs1 != zero);
 }
 
 // 66
 FUNC_SIG(csrrci) {
-    FUNC();
+    FUNC((u64)insn->rs1, val & ~rs1, insn->rs1 != 0);
 }
 
-// 67
+// 67: t = csr; csr = t | x[rs1]; x[rd] = t
 FUNC_SIG(csrrs) {
-    FUNC();
+    FUNC(state->gp_regs[insn->rs1], val | rs1, insn->rs1 != zero);
 }
 
 // 68
 FUNC_SIG(csrrsi) {
-    FUNC();
+    FUNC((u64)insn->rs1, val | rs1, insn->rs1 != 0);
 }
 
-// 69
+// 69: t = csr; csr = x[rs1]; x[rd] = t
 FUNC_SIG(csrrw) {
-    FUNC();
+    FUNC(state->gp_regs[insn->rs1], rs1, true);
 }
 
 // 70
 FUNC_SIG(csrrwi) {
-    FUNC();
+    FUNC((u64)insn->rs1, rs1, true);
 }
 
 #undef FUNC
 
+// 会舍入的浮点运算：指令的静态舍入模式和frm不一样的时候，临时切换host的舍入模式
+// host的舍入模式平时总是和frm一致，DYN的指令不需要做任何事情
+#define FPU_ROUND(stmt)                                    \
+    u32 frm_ = FCSR_FRM(state->fcsr);                      \
+    if (insn->rm == FRM_DYN || insn->rm == frm_) {         \
+        stmt;                                              \
+    } else {                                               \
+        fpu_set_host_rm(insn->rm);                         \
+        stmt;                                              \
+        fpu_set_host_rm(frm_);                             \
+    }                                                      \
+
+
 
 // 71: 
 FUNC_SIG(flw) {
     u64 addr = state->gp_regs[insn->rs1] + (i64)insn->imm;
-    state->fp_regs[insn->rd].v = *(u32 *)TO_HOST(addr) | ((u64) - 1 << 32);
+    state->fp_regs[insn->rd].v = *(u32 *)TO_HOST(state->guest_base, addr) | ((u64) - 1 << 32);
 }
 // 101
 FUNC_SIG(fld) {
     u64 addr = state->gp_regs[insn->rs1] + (i64)insn->imm;
-    state->fp_regs[insn->rd].v = *(u64 *)TO_HOST(addr);    
+    state->fp_regs[insn->rd].v = *(u64 *)TO_HOST(state->guest_base, addr);    
 }
 
 
-#define FUNC(type)                                 \
-    u64 rs1 = state->gp_regs[insn->rs1];           \
-    u64 rs2 = state->fp_regs[insn->rs2].v;         \
-    *(type *)TO_HOST(rs1 + insn->imm) = (type)rs2; \
+#define FUNC(type)                                                    \
+    u64 rs1 = state->gp_regs[insn->rs1];                              \
+    u64 rs2 = state->fp_regs[insn->rs2].v;                            \
+    *(type *)TO_HOST(state->guest_base, rs1 + insn->imm) = (type)rs2; \
 
 // 72
 FUNC_SIG(fsw) {
@@ -500,108 +554,97 @@ FUNC_SIG(fsd) {
 #undef FUNC
 
 
-#define FUNC(expr)                            \
-    f32 rs1 = state->fp_regs[insn->rs1].f;    \
-    f32 rs2 = state->fp_regs[insn->rs2].f;    \
-    f32 rs3 = state->fp_regs[insn->rs3].f;    \
-    state->fp_regs[insn->rd].f = (f32)(expr); \
+// 通用的版本调用glibc的fma()，它是在加载的时候按照host是否支持FMA选择实现的
+// func_xxx_host是用FMA编译的，fma()直接就是一条vfmadd
+// 结果只舍入一次；x86的NaN会保留输入的payload，RISC-V要求结果是canonical NaN
+#define FUNC(expr)                                           \
+    f32 rs1 = state->fp_regs[insn->rs1].f;                   \
+    f32 rs2 = state->fp_regs[insn->rs2].f;                   \
+    f32 rs3 = state->fp_regs[insn->rs3].f;                   \
+    f32 rd = (expr);                                         \
+    state->fp_regs[insn->rd].f = isnan(rd) ? NAN : rd;       \
 
 
 // 73: f[rd] = f[rs1]×f[rs2]+f[rs3]
-FUNC_SIG(fmadd_s) {
-    FUNC(rs1 * rs2 + rs3);
-}
+FUNC_MULTIVERSION(fmadd_s, "fma", FPU_ROUND(FUNC(fmaf(rs1, rs2, rs3))))
 
 // 74: f[rd] = f[rs1]×f[rs2]-f[rs3]
-FUNC_SIG(fmsub_s) {
-    FUNC(rs1 * rs2 - rs3);
-}
+FUNC_MULTIVERSION(fmsub_s, "fma", FPU_ROUND(FUNC(fmaf(rs1, rs2, -rs3))))
 
 // 75: f[rd] = -f[rs1]×f[rs2]+f[rs3]
-FUNC_SIG(fnmsub_s) {
-    FUNC(-(rs1 * rs2) +rs3);
-}
+FUNC_MULTIVERSION(fnmsub_s, "fma", FPU_ROUND(FUNC(fmaf(-rs1, rs2, rs3))))
 
 // 76: f[rd] = -f[rs1]×f[rs2]-f[rs3]
-FUNC_SIG(fnmadd_s) {
-    FUNC(-(rs1 * rs2) - rs3);
-}
+FUNC_MULTIVERSION(fnmadd_s, "fma", FPU_ROUND(FUNC(fmaf(-rs1, rs2, -rs3))))
 
 #undef FUNC
 
 
-#define FUNC(expr)                         \
-    f64 rs1 = state->fp_regs[insn->rs1].d; \
-    f64 rs2 = state->fp_regs[insn->rs1].d; \
-    f64 rs3 = state->fp_regs[insn->rs1].d; \
-    state->fp_regs[insn->rd].d = (expr);   \
+#define FUNC(expr)                                           \
+    f64 rs1 = state->fp_regs[insn->rs1].d;                   \
+    f64 rs2 = state->fp_regs[insn->rs2].d;                   \
+    f64 rs3 = state->fp_regs[insn->rs3].d;                   \
+    f64 rd = (expr);                                         \
+    state->fp_regs[insn->rd].d = isnan(rd) ? (f64)NAN : rd;  \
 
 
 // 103: f[rd] = f[rs1]×f[rs2]+f[rs3]
-FUNC_SIG(fmadd_d) {
-    FUNC(rs1 * rs2 + rs3);
-}
+FUNC_MULTIVERSION(fmadd_d, "fma", FPU_ROUND(FUNC(fma(rs1, rs2, rs3))))
 
 
 // 104: f[rd] = f[rs1]×f[rs2]-f[rs3]
-FUNC_SIG(fmsub_d) {
-    FUNC(rs1 * rs2 - rs3);
-}
+FUNC_MULTIVERSION(fmsub_d, "fma", FPU_ROUND(FUNC(fma(rs1, rs2, -rs3))))
 
 // 105: f[rd] = -f[rs1]×f[rs2+f[rs3]
-FUNC_SIG(fnmsub_d) {
-    FUNC(-(rs1 * rs2) + rs3);
-}
+FUNC_MULTIVERSION(fnmsub_d, "fma", FPU_ROUND(FUNC(fma(-rs1, rs2, rs3))))
 
 
 // 106: f[rd] = -f[rs1]×f[rs2]-f[rs3]
-FUNC_SIG(fnmadd_d) {
-    FUNC(-(rs1 * rs2) - rs3);
-}
+FUNC_MULTIVERSION(fnmadd_d, "fma", FPU_ROUND(FUNC(fma(-rs1, rs2, -rs3))))
 
 #undef FUNC
 
 #define FUNC(expr)                                               \
     f32 rs1 = state->fp_regs[insn->rs1].f;                       \
     __attribute((unused)) f32 rs2 = state->fp_regs[insn->rs2].f; \
-    state->fp_regs[insn->rs1].f = (f32)(expr);                   \
+    state->fp_regs[insn->rd].f = (f32)(expr);                    \
 
 
 // 77: f[rd] = f[rs1] + f[rs2]
 // rs1、rs2解释为float，然后相加
 // riscv和x86的float相加指令有差别
 FUNC_SIG(fadd_s) {
-    FUNC(rs1 + rs2);
+    FPU_ROUND(FUNC(rs1 + rs2));
 }
 
 // 78: f[rd] = f[rs1] - f[rs2]
 FUNC_SIG(fsub_s) {
-    FUNC(rs1 - rs2);
+    FPU_ROUND(FUNC(rs1 - rs2));
 }
 
 // 79: f[rd] = f[rs1] × f[rs2]
 FUNC_SIG(fmul_s) {
-    FUNC(rs1 * rs2);
+    FPU_ROUND(FUNC(rs1 * rs2));
 }
 
 // 80: f[rd] = f[rs1] / f[rs2]
 FUNC_SIG(fdiv_s) {
-    FUNC(rs1 / rs2);
+    FPU_ROUND(FUNC(rs1 / rs2));
 }
 
 // 81: f[rd] = sqrt(f[rs1])
 FUNC_SIG(fsqrt_s) {
-    FUNC(sqrtf(rs1));
+    FPU_ROUND(FUNC(sqrtf(rs1)));
 }
 
 // 85: f[rd] = min(f[rs1], f[rs2])
 FUNC_SIG(fmin_s) {
-    FUNC(rs1 < rs2 ? rs1 : rs2);
+    FUNC(fminmax32(rs1, rs2, false, &state->fcsr));
 }
 
 // 86: f[rd] = max(f[rs1], f[rs2])
 FUNC_SIG(fmax_s) {
-    FUNC(rs1 < rs2 ? rs2 : rs1);
+    FUNC(fminmax32(rs1, rs2, true, &state->fcsr));
 }
 
 #undef FUNC
@@ -615,37 +658,37 @@ FUNC_SIG(fmax_s) {
 
 // 107: f[rd] = f[rs1] + f[rs2]
 FUNC_SIG(fadd_d) {
-    FUNC(rs1 + rs2);
+    FPU_ROUND(FUNC(rs1 + rs2));
 }
 
 // 108: f[rd] = f[rs1] - f[rs2]
 FUNC_SIG(fsub_d) {
-    FUNC(rs1 - rs2);
+    FPU_ROUND(FUNC(rs1 - rs2));
 }
 
 // 109: f[rd] = f[rs1] × f[rs2]
 FUNC_SIG(fmul_d) {
-    FUNC(rs1 * rs2);
+    FPU_ROUND(FUNC(rs1 * rs2));
 }
 
 // 110: f[rd] = f[rs1] / f[rs2]
 FUNC_SIG(fdiv_d) {
-    FUNC(rs1 / rs2);
+    FPU_ROUND(FUNC(rs1 / rs2));
 }
 
 // 111: f[rd] = sqrt(f[rs1])
 FUNC_SIG(fsqrt_d) {
-    FUNC(sqrt(rs1));
+    FPU_ROUND(FUNC(sqrt(rs1)));
 }
 
 // 115: f[rd] = min(f[rs1], f[rs2])
 FUNC_SIG(fmin_d) {
-    FUNC(rs1 < rs2 ? rs1 : rs2);
+    FUNC(fminmax64(rs1, rs2, false, &state->fcsr));
 }
 
 // 116: f[rd] = max(f[rs1], f[rs2])
 FUNC_SIG(fmax_d) {
-    FUNC(rs1 > rs2 ? rs1 : rs2)
+    FUNC(fminmax64(rs1, rs2, true, &state->fcsr));
 }
 
 #undef FUNC
@@ -697,33 +740,38 @@ FUNC_SIG(fsgnjx_d) {
 
 #undef FUNC
 
+// 浮点转整数按照指令的舍入模式计算，结果是饱和的，异常标志直接写到fcsr
 // 87:
 FUNC_SIG(fcvt_w_s) {
-    state->gp_regs[insn->rd] = (i64)(i32)llrintf(state->fp_regs[insn->rs1].f);
+    state->gp_regs[insn->rd] =
+        fpu_to_int(state, state->fp_regs[insn->rs1].f, insn->rm, INT32_MIN, INT32_MAX);
 }
 
 // 88:
 FUNC_SIG(fcvt_wu_s) {
-    state->gp_regs[insn->rd] = (i64)(i32)(u32)llrintf(state->fp_regs[insn->rs1].f);
+    state->gp_regs[insn->rd] =
+        (i64)(i32)(u32)fpu_to_uint(state, state->fp_regs[insn->rs1].f, insn->rm, UINT32_MAX);
 }
 
 // 123
 FUNC_SIG(fcvt_w_d) {
-    state->gp_regs[insn->rd] = (i64)(i32)llrint(state->fp_regs[insn->rs1].d);
+    state->gp_regs[insn->rd] =
+        fpu_to_int(state, state->fp_regs[insn->rs1].d, insn->rm, INT32_MIN, INT32_MAX);
 }
 // 124
 FUNC_SIG(fcvt_wu_d) {
-    state->gp_regs[insn->rd] = (i64)(i32)(u32)llrint(state->fp_regs[insn->rs1].d);
+    state->gp_regs[insn->rd] =
+        (i64)(i32)(u32)fpu_to_uint(state, state->fp_regs[insn->rs1].d, insn->rm, UINT32_MAX);
 }
 
 // 94:
 FUNC_SIG(fcvt_s_w) {
-    state->fp_regs[insn->rd].f = (f32)(i32)state->gp_regs[insn->rs1];
+    FPU_ROUND(state->fp_regs[insn->rd].f = (f32)(i32)state->gp_regs[insn->rs1]);
 }
 
 // 95:
 FUNC_SIG(fcvt_s_wu) {
-    state->fp_regs[insn->rd].f = (f32)(u32)state->gp_regs[insn->rs1];
+    FPU_ROUND(state->fp_regs[insn->rd].f = (f32)(u32)state->gp_regs[insn->rs1]);
 }
 
 // 125
@@ -799,6 +847,8 @@ FUNC_SIG(fle_d) {
     FUNC(rs1 <= rs2);
 }
 
+#undef FUNC
+
 
 // 93
 // https://msyksphinz-self.github.io/riscv-isadoc/html/rvfd.html
@@ -814,48 +864,52 @@ FUNC_SIG(fclass_d) {
 
 // 97
 FUNC_SIG(fcvt_l_s) {
-    state->gp_regs[insn->rd] = (i64)llrintf(state->fp_regs[insn->rs1].f);
+    state->gp_regs[insn->rd] =
+        fpu_to_int(state, state->fp_regs[insn->rs1].f, insn->rm, INT64_MIN, INT64_MAX);
 }
 
 // 98
 FUNC_SIG(fcvt_lu_s) {
-    state->gp_regs[insn->rd] = (u64)llrintf(state->fp_regs[insn->rs1].f);
+    state->gp_regs[insn->rd] =
+        fpu_to_uint(state, state->fp_regs[insn->rs1].f, insn->rm, UINT64_MAX);
 }
 
 // 127
 FUNC_SIG(fcvt_l_d) {
-    state->gp_regs[insn->rd] = (i64)llrint(state->fp_regs[insn->rs1].d);
+    state->gp_regs[insn->rd] =
+        fpu_to_int(state, state->fp_regs[insn->rs1].d, insn->rm, INT64_MIN, INT64_MAX);
 }
 
 // 128
 FUNC_SIG(fcvt_lu_d) {
-    state->gp_regs[insn->rd] = (u64)llrint(state->fp_regs[insn->rs1].d);
+    state->gp_regs[insn->rd] =
+        fpu_to_uint(state, state->fp_regs[insn->rs1].d, insn->rm, UINT64_MAX);
 }
 
 // 99
 FUNC_SIG(fcvt_s_l) {
-    state->fp_regs[insn->rd].f = (f32)(i64)state->gp_regs[insn->rs1];
+    FPU_ROUND(state->fp_regs[insn->rd].f = (f32)(i64)state->gp_regs[insn->rs1]);
 }
 
 // 100
 FUNC_SIG(fcvt_s_lu) {
-    state->fp_regs[insn->rd].f = (f32)(u64)state->gp_regs[insn->rs1];
+    FPU_ROUND(state->fp_regs[insn->rd].f = (f32)(u64)state->gp_regs[insn->rs1]);
 }
 
 
 // 130
 FUNC_SIG(fcvt_d_l) {
-    state->fp_regs[insn->rd].d = (f64)(i64)state->gp_regs[insn->rs1];
+    FPU_ROUND(state->fp_regs[insn->rd].d = (f64)(i64)state->gp_regs[insn->rs1]);
 }
 
 // 131
 FUNC_SIG(fcvt_d_lu) {
-    state->fp_regs[insn->rd].d = (f64)(u64)state->gp_regs[insn->rs1];
+    FPU_ROUND(state->fp_regs[insn->rd].d = (f64)(u64)state->gp_regs[insn->rs1]);
 }
 
 // 117
 FUNC_SIG(fcvt_s_d) {
-    state->fp_regs[insn->rd].f = (f32)state->fp_regs[insn->rs1].d;
+    FPU_ROUND(state->fp_regs[insn->rd].f = (f32)state->fp_regs[insn->rs1].d);
 }
 
 // 118
@@ -863,6 +917,655 @@ FUNC_SIG(fcvt_d_s) {
     state->fp_regs[insn->rd].d = (f64)state->fp_regs[insn->rs1].f;
 }
 
+//
+// Zfh 半精度浮点
+// 半精度的值放在fp寄存器的低16位，高48位全是1(NaN-boxing)，读的时候没有正确box的值当作canonical NaN
+// 运算都是转换成float做的，转换用F16C的vcvtph2ps/vcvtps2ph，舍入模式和异常标志都和单精度一样
+//
+
+#define F16_NAN 0x7e00
+#define F16_GET(reg)                                                            \
+    ((state->fp_regs[reg].v >> 16) == 0xffffffffffffULL ?                       \
+     (u16)state->fp_regs[reg].v : F16_NAN)                                      \
+
+#define F16_SET(reg, h) state->fp_regs[reg].v = (u64)(u16)(h) | ((u64)-1 << 16)
+
+// RISC-V要求NaN的结果是canonical NaN
+static inline u16 f16_round(f32 x) {
+    return isnan(x) ? F16_NAN : fpu_f32_to_f16(x);
+}
+
+// 201
+FUNC_SIG(flh) {
+    u64 addr = state->gp_regs[insn->rs1] + (i64)insn->imm;
+    F16_SET(insn->rd, *(u16 *)TO_HOST(state->guest_base, addr));
+}
+
+// 202: 不管有没有正确box，都是写低16位
+FUNC_SIG(fsh) {
+    u64 addr = state->gp_regs[insn->rs1] + (i64)insn->imm;
+    *(u16 *)TO_HOST(state->guest_base, addr) = (u16)state->fp_regs[insn->rs2].v;
+}
+
+// 结果的指数全1、尾数不为0的是NaN
+#define FUNC(expr)                                                 \
+    f32 rs1 = fpu_f16_to_f32(F16_GET(insn->rs1));                  \
+    f32 rs2 = fpu_f16_to_f32(F16_GET(insn->rs2));                  \
+    f32 rs3 = fpu_f16_to_f32(F16_GET(insn->rs3));                  \
+    u16 rd = (expr);                                               \
+    F16_SET(insn->rd, (rd & 0x7fff) > 0x7c00 ? F16_NAN : rd);      \
+
+// 203: f[rd] = f[rs1]×f[rs2]+f[rs3]
+FUNC_SIG(fmadd_h) {
+    FPU_ROUND(FUNC(fpu_f16_fma(rs1, rs2, rs3)));
+}
+
+// 204: f[rd] = f[rs1]×f[rs2]-f[rs3]
+FUNC_SIG(fmsub_h) {
+    FPU_ROUND(FUNC(fpu_f16_fma(rs1, rs2, -rs3)));
+}
+
+// 205: f[rd] = -f[rs1]×f[rs2]+f[rs3]
+FUNC_SIG(fnmsub_h) {
+    FPU_ROUND(FUNC(fpu_f16_fma(-rs1, rs2, rs3)));
+}
+
+// 206: f[rd] = -f[rs1]×f[rs2]-f[rs3]
+FUNC_SIG(fnmadd_h) {
+    FPU_ROUND(FUNC(fpu_f16_fma(-rs1, rs2, -rs3)));
+}
+
+#undef FUNC
+
+#define FUNC(expr)                                     \
+    f32 rs1 = fpu_f16_to_f32(F16_GET(insn->rs1));      \
+    f32 rs2 = fpu_f16_to_f32(F16_GET(insn->rs2));      \
+    F16_SET(insn->rd, f16_round(expr));                \
+
+// 207: f[rd] = f[rs1] + f[rs2]
+FUNC_SIG(fadd_h) {
+    FPU_ROUND(FUNC(rs1 + rs2));
+}
+
+// 208: f[rd] = f[rs1] - f[rs2]
+FUNC_SIG(fsub_h) {
+    FPU_ROUND(FUNC(rs1 - rs2));
+}
+
+// 209: f[rd] = f[rs1] × f[rs2]
+FUNC_SIG(fmul_h) {
+    FPU_ROUND(FUNC(rs1 * rs2));
+}
+
+// 210: f[rd] = f[rs1] / f[rs2]
+FUNC_SIG(fdiv_h) {
+    FPU_ROUND(FUNC(rs1 / rs2));
+}
+
+// 215: min、max的结果总是其中一个操作数，转换回半精度是精确的
+FUNC_SIG(fmin_h) {
+    FUNC(fminmax32(rs1, rs2, false, &state->fcsr));
+}
+
+// 216
+FUNC_SIG(fmax_h) {
+    FUNC(fminmax32(rs1, rs2, true, &state->fcsr));
+}
+
+#undef FUNC
+
+// 211: f[rd] = sqrt(f[rs1])
+FUNC_SIG(fsqrt_h) {
+    f32 rs1 = fpu_f16_to_f32(F16_GET(insn->rs1));
+    FPU_ROUND(F16_SET(insn->rd, f16_round(sqrtf(rs1))));
+}
+
+#define FUNC(n, x)                                              \
+    u16 rs1 = F16_GET(insn->rs1);                               \
+    u16 rs2 = F16_GET(insn->rs2);                               \
+    u16 v = x ? rs1 : n ? 0x8000 : 0;                           \
+    F16_SET(insn->rd, (rs1 & 0x7fff) | ((v ^ rs2) & 0x8000));   \
+
+// 212: f[rd] = {f[rs2][15], f[rs1][14:0]}
+FUNC_SIG(fsgnj_h) {
+    FUNC(false, false);
+}
+
+// 213: f[rd] = {~f[rs2][15], f[rs1][14:0]}
+FUNC_SIG(fsgnjn_h) {
+    FUNC(true, false);
+}
+
+// 214: f[rd] = {f[rs1][15] ^ f[rs2][15], f[rs1][14:0]}
+FUNC_SIG(fsgnjx_h) {
+    FUNC(false, true);
+}
+
+#undef FUNC
+
+// 217: 半精度转换成float是精确的
+FUNC_SIG(fcvt_s_h) {
+    f32 rs1 = fpu_f16_to_f32(F16_GET(insn->rs1));
+    state->fp_regs[insn->rd].f = isnan(rs1) ? NAN : rs1;
+}
+
+// 218
+FUNC_SIG(fcvt_h_s) {
+    FPU_ROUND(F16_SET(insn->rd, f16_round(state->fp_regs[insn->rs1].f)));
+}
+
+// 219
+FUNC_SIG(fcvt_d_h) {
+    f32 rs1 = fpu_f16_to_f32(F16_GET(insn->rs1));
+    state->fp_regs[insn->rd].d = isnan(rs1) ? (f64)NAN : (f64)rs1;
+}
+
+// 220
+FUNC_SIG(fcvt_h_d) {
+    f64 rs1 = state->fp_regs[insn->rs1].d;
+    FPU_ROUND(F16_SET(insn->rd, isnan(rs1) ? F16_NAN : fpu_f64_to_f16(rs1)));
+}
+
+#define FUNC(expr)                                     \
+    f32 rs1 = fpu_f16_to_f32(F16_GET(insn->rs1));      \
+    f32 rs2 = fpu_f16_to_f32(F16_GET(insn->rs2));      \
+    state->gp_regs[insn->rd] = (expr);                 \
+
+// 221
+FUNC_SIG(feq_h) {
+    FUNC(rs1 == rs2);
+}
+
+// 222
+FUNC_SIG(flt_h) {
+    FUNC(rs1 < rs2);
+}
+
+// 223
+FUNC_SIG(fle_h) {
+    FUNC(rs1 <= rs2);
+}
+
+#undef FUNC
+
+// 224
+FUNC_SIG(fclass_h) {
+    state->gp_regs[insn->rd] = f16_classify(F16_GET(insn->rs1));
+}
+
+// 225
+FUNC_SIG(fcvt_w_h) {
+    state->gp_regs[insn->rd] =
+        fpu_to_int(state, fpu_f16_to_f32(F16_GET(insn->rs1)), insn->rm, INT32_MIN, INT32_MAX);
+}
+
+// 226
+FUNC_SIG(fcvt_wu_h) {
+    state->gp_regs[insn->rd] =
+        (i64)(i32)(u32)fpu_to_uint(state, fpu_f16_to_f32(F16_GET(insn->rs1)), insn->rm, UINT32_MAX);
+}
+
+// 227
+FUNC_SIG(fcvt_l_h) {
+    state->gp_regs[insn->rd] =
+        fpu_to_int(state, fpu_f16_to_f32(F16_GET(insn->rs1)), insn->rm, INT64_MIN, INT64_MAX);
+}
+
+// 228
+FUNC_SIG(fcvt_lu_h) {
+    state->gp_regs[insn->rd] =
+        fpu_to_uint(state, fpu_f16_to_f32(F16_GET(insn->rs1)), insn->rm, UINT64_MAX);
+}
+
+// 整数转换成半精度：超出半精度范围的整数转换成double的时候即使不精确，结果也一样是上溢
+// 229
+FUNC_SIG(fcvt_h_w) {
+    FPU_ROUND(F16_SET(insn->rd, fpu_f64_to_f16((f64)(i32)state->gp_regs[insn->rs1])));
+}
+
+// 230
+FUNC_SIG(fcvt_h_wu) {
+    FPU_ROUND(F16_SET(insn->rd, fpu_f64_to_f16((f64)(u32)state->gp_regs[insn->rs1])));
+}
+
+// 231
+FUNC_SIG(fcvt_h_l) {
+    FPU_ROUND(F16_SET(insn->rd, fpu_f64_to_f16((f64)(i64)state->gp_regs[insn->rs1])));
+}
+
+// 232
+FUNC_SIG(fcvt_h_lu) {
+    FPU_ROUND(F16_SET(insn->rd, fpu_f64_to_f16((f64)(u64)state->gp_regs[insn->rs1])));
+}
+
+// 233: 不检查NaN-boxing，直接取低16位做符号扩展
+FUNC_SIG(fmv_x_h) {
+    state->gp_regs[insn->rd] = (i64)(i16)state->fp_regs[insn->rs1].v;
+}
+
+// 234
+FUNC_SIG(fmv_h_x) {
+    F16_SET(insn->rd, state->gp_regs[insn->rs1]);
+}
+
+#undef FPU_ROUND
+
+//
+// RV64A 原子指令
+// x86上带lock前缀的读改写指令本身就是全屏障，任意的aq/rl组合都满足，
+// 普通的load也已经有acquire语义，所以解释器里统一用__ATOMIC_SEQ_CST
+// sc用cas实现：lr记录下地址和读到的值，sc的时候内存里还是这个值就认为reservation有效
+//
+
+#define LR(typ)                                                           \
+    u64 addr = state->gp_regs[insn->rs1];                                 \
+    typ *p = (typ *)TO_HOST(state->guest_base, addr);                     \
+    typ val = __atomic_load_n(p, __ATOMIC_SEQ_CST);                       \
+    state->reserve_addr = addr;                                           \
+    state->reserve_val = (u64)val;                                        \
+    state->gp_regs[insn->rd] = (i64)val;                                  \
+
+#define SC(typ)                                                               \
+    u64 addr = state->gp_regs[insn->rs1];                                     \
+    typ expected = (typ)state->reserve_val;                                   \
+    bool ok = state->reserve_addr == addr &&                                  \
+        __atomic_compare_exchange_n((typ *)TO_HOST(state->guest_base, addr),  \
+                                    &expected, (typ)state->gp_regs[insn->rs2], \
+                                    false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+    state->reserve_addr = 0;                                                  \
+    state->gp_regs[insn->rd] = !ok;                                           \
+
+// rd = [rs1]; [rs1] = op([rs1], rs2)
+#define AMO(typ, op)                                                                  \
+    u64 addr = state->gp_regs[insn->rs1];                                             \
+    typ *p = (typ *)TO_HOST(state->guest_base, addr);                                 \
+    typ val = op(p, (typ)state->gp_regs[insn->rs2], __ATOMIC_SEQ_CST);                \
+    state->gp_regs[insn->rd] = (i64)val;                                              \
+
+// host没有对应指令的min/max，用cas循环
+#define AMO_CAS(typ, expr)                                                    \
+    u64 addr = state->gp_regs[insn->rs1];                                     \
+    typ *p = (typ *)TO_HOST(state->guest_base, addr);                         \
+    typ rs2 = (typ)state->gp_regs[insn->rs2];                                 \
+    typ old = __atomic_load_n(p, __ATOMIC_RELAXED);                           \
+    while (!__atomic_compare_exchange_n(p, &old, (expr), true,                \
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {} \
+    state->gp_regs[insn->rd] = (i64)old;                                      \
+
+// 133: load reserved word
+FUNC_SIG(lr_w) {
+    LR(i32);
+}
+
+// 134: store conditional word, rd = 0表示成功
+FUNC_SIG(sc_w) {
+    SC(i32);
+}
+
+// 135
+FUNC_SIG(amoswap_w) {
+    AMO(i32, __atomic_exchange_n);
+}
+
+// 136
+FUNC_SIG(amoadd_w) {
+    AMO(i32, __atomic_fetch_add);
+}
+
+// 137
+FUNC_SIG(amoxor_w) {
+    AMO(i32, __atomic_fetch_xor);
+}
+
+// 138
+FUNC_SIG(amoand_w) {
+    AMO(i32, __atomic_fetch_and);
+}
+
+// 139
+FUNC_SIG(amoor_w) {
+    AMO(i32, __atomic_fetch_or);
+}
+
+// 140
+FUNC_SIG(amomin_w) {
+    AMO_CAS(i32, old < rs2 ? old : rs2);
+}
+
+// 141
+FUNC_SIG(amomax_w) {
+    AMO_CAS(i32, old > rs2 ? old : rs2);
+}
+
+// 142
+FUNC_SIG(amominu_w) {
+    AMO_CAS(i32, (u32)old < (u32)rs2 ? old : rs2);
+}
+
+// 143
+FUNC_SIG(amomaxu_w) {
+    AMO_CAS(i32, (u32)old > (u32)rs2 ? old : rs2);
+}
+
+// 144: load reserved double word
+FUNC_SIG(lr_d) {
+    LR(i64);
+}
+
+// 145
+FUNC_SIG(sc_d) {
+    SC(i64);
+}
+
+// 146
+FUNC_SIG(amoswap_d) {
+    AMO(i64, __atomic_exchange_n);
+}
+
+// 147
+FUNC_SIG(amoadd_d) {
+    AMO(i64, __atomic_fetch_add);
+}
+
+// 148
+FUNC_SIG(amoxor_d) {
+    AMO(i64, __atomic_fetch_xor);
+}
+
+// 149
+FUNC_SIG(amoand_d) {
+    AMO(i64, __atomic_fetch_and);
+}
+
+// 150
+FUNC_SIG(amoor_d) {
+    AMO(i64, __atomic_fetch_or);
+}
+
+// 151
+FUNC_SIG(amomin_d) {
+    AMO_CAS(i64, old < rs2 ? old : rs2);
+}
+
+// 152
+FUNC_SIG(amomax_d) {
+    AMO_CAS(i64, old > rs2 ? old : rs2);
+}
+
+// 153
+FUNC_SIG(amominu_d) {
+    AMO_CAS(i64, (u64)old < (u64)rs2 ? old : rs2);
+}
+
+// 154
+FUNC_SIG(amomaxu_d) {
+    AMO_CAS(i64, (u64)old > (u64)rs2 ? old : rs2);
+}
+
+#undef LR
+#undef SC
+#undef AMO
+#undef AMO_CAS
+
+//
+// RVV 向量扩展，具体的实现在vector.c
+//
+
+// 155: vsetvli rd, rs1, vtypei
+FUNC_SIG(vsetvli) {
+    // rs1 = x0的时候：rd != x0表示vl取最大值，rd = x0表示保持vl不变
+    u64 avl = insn->rs1 != zero ? state->gp_regs[insn->rs1] :
+              insn->rd != zero ? UINT64_MAX : state->vl;
+    state->gp_regs[insn->rd] = vector_setvl(state, avl, (u64)insn->imm);
+}
+
+// 156: vsetivli rd, uimm, vtypei
+FUNC_SIG(vsetivli) {
+    state->gp_regs[insn->rd] = vector_setvl(state, (u64)insn->rs1, (u64)insn->imm);
+}
+
+// 157: vsetvl rd, rs1, rs2
+FUNC_SIG(vsetvl) {
+    u64 avl = insn->rs1 != zero ? state->gp_regs[insn->rs1] :
+              insn->rd != zero ? UINT64_MAX : state->vl;
+    state->gp_regs[insn->rd] = vector_setvl(state, avl, state->gp_regs[insn->rs2]);
+}
+
+// 158
+FUNC_SIG(vload) {
+    vector_load(state, insn);
+}
+
+// 159
+FUNC_SIG(vstore) {
+    vector_store(state, insn);
+}
+
+// 160
+FUNC_SIG(vop) {
+    vector_op(state, insn);
+}
+
+//
+// Zba/Zbb/Zbs 位操作扩展，尽量用builtin，clang会选择对应的host指令
+//
+
+// orc.b: 每个字节，非零就变成0xff，否则是0
+static inline u64 orc_b(u64 x) {
+    u64 t = (((x & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | x) & 0x8080808080808080ULL;
+    return (t >> 7) * 0xff;
+}
+
+#define FUNC(expr)                       \
+    u64 rs1 = state->gp_regs[insn->rs1]; \
+    u64 rs2 = state->gp_regs[insn->rs2]; \
+    state->gp_regs[insn->rd] = (expr)    \
+
+// 161: Shift Left by 1 and Add, rd ← rs2 + (rs1 « 1)
+FUNC_SIG(sh1add) {
+    FUNC(rs2 + (rs1 << 1));
+}
+
+// 162
+FUNC_SIG(sh2add) {
+    FUNC(rs2 + (rs1 << 2));
+}
+
+// 163
+FUNC_SIG(sh3add) {
+    FUNC(rs2 + (rs1 << 3));
+}
+
+// 164: Add Unsigned Word, rd ← rs2 + zx(u32(rs1))
+FUNC_SIG(add_uw) {
+    FUNC(rs2 + (u32)rs1);
+}
+
+// 165
+FUNC_SIG(sh1add_uw) {
+    FUNC(rs2 + ((u64)(u32)rs1 << 1));
+}
+
+// 166
+FUNC_SIG(sh2add_uw) {
+    FUNC(rs2 + ((u64)(u32)rs1 << 2));
+}
+
+// 167
+FUNC_SIG(sh3add_uw) {
+    FUNC(rs2 + ((u64)(u32)rs1 << 3));
+}
+
+// 169: And with inverted operand, rd ← rs1 ∧ ¬rs2
+FUNC_SIG(andn) {
+    FUNC(rs1 & ~rs2);
+}
+
+// 170
+FUNC_SIG(orn) {
+    FUNC(rs1 | ~rs2);
+}
+
+// 171
+FUNC_SIG(xnor) {
+    FUNC(~(rs1 ^ rs2));
+}
+
+// 178
+FUNC_SIG(max) {
+    FUNC((i64)rs1 > (i64)rs2 ? rs1 : rs2);
+}
+
+// 179
+FUNC_SIG(maxu) {
+    FUNC(rs1 > rs2 ? rs1 : rs2);
+}
+
+// 180
+FUNC_SIG(min) {
+    FUNC((i64)rs1 < (i64)rs2 ? rs1 : rs2);
+}
+
+// 181
+FUNC_SIG(minu) {
+    FUNC(rs1 < rs2 ? rs1 : rs2);
+}
+
+// 185: Rotate Left
+FUNC_SIG(rol) {
+    FUNC((rs1 << (rs2 & 0x3f)) | (rs1 >> (-rs2 & 0x3f)));
+}
+
+// 186
+FUNC_SIG(rolw) {
+    FUNC((i64)(i32)(((u32)rs1 << (rs2 & 0x1f)) | ((u32)rs1 >> (-rs2 & 0x1f))));
+}
+
+// 187: Rotate Right
+FUNC_SIG(ror) {
+    FUNC((rs1 >> (rs2 & 0x3f)) | (rs1 << (-rs2 & 0x3f)));
+}
+
+// 190
+FUNC_SIG(rorw) {
+    FUNC((i64)(i32)(((u32)rs1 >> (rs2 & 0x1f)) | ((u32)rs1 << (-rs2 & 0x1f))));
+}
+
+// 193: Single-Bit Clear
+FUNC_SIG(bclr) {
+    FUNC(rs1 & ~(1ULL << (rs2 & 0x3f)));
+}
+
+// 195: Single-Bit Extract
+FUNC_SIG(bext) {
+    FUNC((rs1 >> (rs2 & 0x3f)) & 1);
+}
+
+// 197: Single-Bit Invert
+FUNC_SIG(binv) {
+    FUNC(rs1 ^ (1ULL << (rs2 & 0x3f)));
+}
+
+// 199: Single-Bit Set
+FUNC_SIG(bset) {
+    FUNC(rs1 | (1ULL << (rs2 & 0x3f)));
+}
+
+#undef FUNC
+
+// Zbb里只有一个操作数的指令
+#define FUNC(expr)                       \
+    u64 rs1 = state->gp_regs[insn->rs1]; \
+    state->gp_regs[insn->rd] = (expr);   \
+
+// 172: Count Leading Zeros，RISC-V规定输入为0的时候结果是64
+FUNC_MULTIVERSION(clz, "lzcnt", FUNC(rs1 == 0 ? 64 : __builtin_clzll(rs1)))
+
+// 173
+FUNC_MULTIVERSION(clzw, "lzcnt", FUNC((u32)rs1 == 0 ? 32 : __builtin_clz((u32)rs1)))
+
+// 174: Count Trailing Zeros
+FUNC_MULTIVERSION(ctz, "bmi", FUNC(rs1 == 0 ? 64 : __builtin_ctzll(rs1)))
+
+// 175
+FUNC_MULTIVERSION(ctzw, "bmi", FUNC((u32)rs1 == 0 ? 32 : __builtin_ctz((u32)rs1)))
+
+// 176: Count Set Bits
+FUNC_MULTIVERSION(cpop, "popcnt", FUNC(__builtin_popcountll(rs1)))
+
+// 177
+FUNC_MULTIVERSION(cpopw, "popcnt", FUNC(__builtin_popcount((u32)rs1)))
+
+// 182
+FUNC_SIG(sext_b) {
+    FUNC((i64)(i8)rs1);
+}
+
+// 183
+FUNC_SIG(sext_h) {
+    FUNC((i64)(i16)rs1);
+}
+
+// 184: Zero-extend halfword, zext.h是rs2 = x0的pack
+FUNC_SIG(zext_h) {
+    FUNC((u16)rs1);
+}
+
+// 191: Bitwise OR-Combine, byte granule
+FUNC_SIG(orc_b) {
+    FUNC(orc_b(rs1));
+}
+
+// 192: Byte-reverse register
+FUNC_SIG(rev8) {
+    FUNC(__builtin_bswap64(rs1));
+}
+
+#undef FUNC
+
+#define FUNC(expr)                       \
+    u64 rs1 = state->gp_regs[insn->rs1]; \
+    i64 imm = (i64)insn->imm;            \
+    state->gp_regs[insn->rd] = (expr);   \
+
+// 168: Shift Left Unsigned Word Immediate, rd ← zx(u32(rs1)) « imm
+FUNC_SIG(slli_uw) {
+    FUNC((u64)(u32)rs1 << (imm & 0x3f));
+}
+
+// 188
+FUNC_SIG(rori) {
+    FUNC((rs1 >> (imm & 0x3f)) | (rs1 << (-imm & 0x3f)));
+}
+
+// 189
+FUNC_SIG(roriw) {
+    FUNC((i64)(i32)(((u32)rs1 >> (imm & 0x1f)) | ((u32)rs1 << (-imm & 0x1f))));
+}
+
+// 194
+FUNC_SIG(bclri) {
+    FUNC(rs1 & ~(1ULL << (imm & 0x3f)));
+}
+
+// 196
+FUNC_SIG(bexti) {
+    FUNC((rs1 >> (imm & 0x3f)) & 1);
+}
+
+// 198
+FUNC_SIG(binvi) {
+    FUNC(rs1 ^ (1ULL << (imm & 0x3f)));
+}
+
+// 200
+FUNC_SIG(bseti) {
+    FUNC(rs1 | (1ULL << (imm & 0x3f)));
+}
+
+#undef FUNC
+
+
 
 static func_t *funcs[] = {
 /* 0   */    func_lb,
@@ -873,7 +1576,7 @@ static func_t *funcs[] = {
 /* 5   */    func_lhu,
 /* 6   */    func_lwu,
 /* 7   */    func_empty,  // insn_fench
-/* 8   */    func_empty,  // insn_fenth_i
+/* 8   */    func_fence_i,
 /* 9   */    func_addi,
 /* 10  */    func_slli,
 /* 11  */    func_slti,
@@ -998,19 +1701,177 @@ static func_t *funcs[] = {
 /* 130 */    func_fcvt_d_l,
 /* 131 */    func_fcvt_d_lu,
 /* 132 */    func_fmv_d_x,
+/* 133 */    func_lr_w,
+/* 134 */    func_sc_w,
+/* 135 */    func_amoswap_w,
+/* 136 */    func_amoadd_w,
+/* 137 */    func_amoxor_w,
+/* 138 */    func_amoand_w,
+/* 139 */    func_amoor_w,
+/* 140 */    func_amomin_w,
+/* 141 */    func_amomax_w,
+/* 142 */    func_amominu_w,
+/* 143 */    func_amomaxu_w,
+/* 144 */    func_lr_d,
+/* 145 */    func_sc_d,
+/* 146 */    func_amoswap_d,
+/* 147 */    func_amoadd_d,
+/* 148 */    func_amoxor_d,
+/* 149 */    func_amoand_d,
+/* 150 */    func_amoor_d,
+/* 151 */    func_amomin_d,
+/* 152 */    func_amomax_d,
+/* 153 */    func_amominu_d,
+/* 154 */    func_amomaxu_d,
+/* 155 */    func_vsetvli,
+/* 156 */    func_vsetivli,
+/* 157 */    func_vsetvl,
+/* 158 */    func_vload,
+/* 159 */    func_vstore,
+/* 160 */    func_vop,
+/* 161 */    func_sh1add,
+/* 162 */    func_sh2add,
+/* 163 */    func_sh3add,
+/* 164 */    func_add_uw,
+/* 165 */    func_sh1add_uw,
+/* 166 */    func_sh2add_uw,
+/* 167 */    func_sh3add_uw,
+/* 168 */    func_slli_uw,
+/* 169 */    func_andn,
+/* 170 */    func_orn,
+/* 171 */    func_xnor,
+/* 172 */    func_clz,
+/* 173 */    func_clzw,
+/* 174 */    func_ctz,
+/* 175 */    func_ctzw,
+/* 176 */    func_cpop,
+/* 177 */    func_cpopw,
+/* 178 */    func_max,
+/* 179 */    func_maxu,
+/* 180 */    func_min,
+/* 181 */    func_minu,
+/* 182 */    func_sext_b,
+/* 183 */    func_sext_h,
+/* 184 */    func_zext_h,
+/* 185 */    func_rol,
+/* 186 */    func_rolw,
+/* 187 */    func_ror,
+/* 188 */    func_rori,
+/* 189 */    func_roriw,
+/* 190 */    func_rorw,
+/* 191 */    func_orc_b,
+/* 192 */    func_rev8,
+/* 193 */    func_bclr,
+/* 194 */    func_bclri,
+/* 195 */    func_bext,
+/* 196 */    func_bexti,
+/* 197 */    func_binv,
+/* 198 */    func_binvi,
+/* 199 */    func_bset,
+/* 200 */    func_bseti,
+/* 201 */    func_flh,
+/* 202 */    func_fsh,
+/* 203 */    func_fmadd_h,
+/* 204 */    func_fmsub_h,
+/* 205 */    func_fnmsub_h,
+/* 206 */    func_fnmadd_h,
+/* 207 */    func_fadd_h,
+/* 208 */    func_fsub_h,
+/* 209 */    func_fmul_h,
+/* 210 */    func_fdiv_h,
+/* 211 */    func_fsqrt_h,
+/* 212 */    func_fsgnj_h,
+/* 213 */    func_fsgnjn_h,
+/* 214 */    func_fsgnjx_h,
+/* 215 */    func_fmin_h,
+/* 216 */    func_fmax_h,
+/* 217 */    func_fcvt_s_h,
+/* 218 */    func_fcvt_h_s,
+/* 219 */    func_fcvt_d_h,
+/* 220 */    func_fcvt_h_d,
+/* 221 */    func_feq_h,
+/* 222 */    func_flt_h,
+/* 223 */    func_fle_h,
+/* 224 */    func_fclass_h,
+/* 225 */    func_fcvt_w_h,
+/* 226 */    func_fcvt_wu_h,
+/* 227 */    func_fcvt_l_h,
+/* 228 */    func_fcvt_lu_h,
+/* 229 */    func_fcvt_h_w,
+/* 230 */    func_fcvt_h_wu,
+/* 231 */    func_fcvt_h_l,
+/* 232 */    func_fcvt_h_lu,
+/* 233 */    func_fmv_x_h,
+/* 234 */    func_fmv_h_x,
+};
+
+// 有host版本的handler，以及需要的指令集扩展
+static const struct {
+    enum insn_type_t type;
+    func_t *func;
+    u32 features;
+} host_funcs[] = {
+    { insn_fmadd_s,  func_fmadd_s_host,  CPU_FMA },
+    { insn_fmsub_s,  func_fmsub_s_host,  CPU_FMA },
+    { insn_fnmsub_s, func_fnmsub_s_host, CPU_FMA },
+    { insn_fnmadd_s, func_fnmadd_s_host, CPU_FMA },
+    { insn_fmadd_d,  func_fmadd_d_host,  CPU_FMA },
+    { insn_fmsub_d,  func_fmsub_d_host,  CPU_FMA },
+    { insn_fnmsub_d, func_fnmsub_d_host, CPU_FMA },
+    { insn_fnmadd_d, func_fnmadd_d_host, CPU_FMA },
+    { insn_clz,      func_clz_host,      CPU_LZCNT },
+    { insn_clzw,     func_clzw_host,     CPU_LZCNT },
+    { insn_ctz,      func_ctz_host,      CPU_BMI },
+    { insn_ctzw,     func_ctzw_host,     CPU_BMI },
+    { insn_cpop,     func_cpop_host,     CPU_POPCNT },
+    { insn_cpopw,    func_cpopw_host,    CPU_POPCNT },
 };
 
+// 启动的时候调用一次，在cpu_detect之后，创建guest线程之前
+void interp_init() {
+    for (u64 i = 0; i < sizeof(host_funcs) / sizeof(host_funcs[0]); i++) {
+        if (cpu_has(host_funcs[i].features)) funcs[host_funcs[i].type] = host_funcs[i].func;
+    }
+}
+
 // 解释执行指令，与此对应的还有JIT just-in-time方式的指令执行方式
 void exec_block_interp(state_t *state){
-    static insn_t insn = {0};
+    // 多个guest线程会同时执行，不能用static
+    insn_t insn = {0};
+    // 这个块里已经执行的指令数，块结束的时候才加到instret上
+    u64 retired = 0;
     while(true){
         // 从pc指针地址处取指
-        u32 data = *(u32 *)TO_HOST(state->pc);
+        u32 data = *(u32 *)TO_HOST(state->guest_base, state->pc);
         // 指令解码到insn
         insn_decode(&insn, data);
 
+        // csr指令可能会读instret/cycle，先把已经执行的指令数加上去
+        if (insn.type >= insn_csrrc && insn.type <= insn_csrrwi) {
+            state->instret += retired;
+            retired = 0;
+        }
+
         // 执行指令
+        u64 pc = state->pc;
         funcs[insn.type](state, &insn);
+        retired++;
+
+        // 条件跳转跳走的时候cont是true，编译区域的时候用这个统计找出很少走的一边
+        if (insn.type >= insn_beq && insn.type <= insn_bgeu) {
+            profile_t *p = profile_of(state->profile, pc);
+            if (insn.cont) p->taken++;
+            else p->not_taken++;
+        }
+        // jalr跳到的地址，编译的时候推测它
+        if (insn.type == insn_jalr) {
+            profile_t *p = profile_of(state->profile, pc);
+            if (p->target == state->reenter_pc) p->target_hits++;
+            else {
+                p->target = state->reenter_pc;
+                p->target_misses++;
+            }
+        }
         
         // 因为zero寄存器无论怎么给他赋值其结果都是0，所以执行一条执行
         // 都把zero寄存器清零
@@ -1025,6 +1886,7 @@ void exec_block_interp(state_t *state){
         // 是的话指针后移2个字节16位，否则普通指令后移4个字节32位
         state->pc += insn.rvc ? 2 : 4;
     }
+    state->instret += retired;
 }
 
 
@@ -113,4 +113,58 @@ inline u16 f64_classify(f64 a) {
         (isNaN && !isSNaN)                       << 9;
 }
 
+
+// fmin/fmax，RISC-V的语义是IEEE 754-2019的minimumNumber/maximumNumber：
+// 只有一个操作数是NaN的时候结果是另一个操作数，两个都是NaN的时候结果是canonical NaN，
+// -0.0比+0.0小，任何一个操作数是signaling NaN都要设置NV
+// x86的minss/maxss在有NaN或者两个都是0的时候总是返回第二个操作数，不能直接用
+inline f32 fminmax32(f32 a, f32 b, bool max, u32 *fcsr) {
+    union u32_f32 uA = { .f = a }, uB = { .f = b };
+    if (isnan(a) || isnan(b)) {
+        if (isSigNaNF32UI(uA.ui) || isSigNaNF32UI(uB.ui)) *fcsr |= FFLAGS_NV;
+        if (isnan(a) && isnan(b)) return NAN;
+        return isnan(a) ? b : a;
+    }
+    if (a == b) {
+        union u32_f32 r = { .ui = max ? uA.ui & uB.ui : uA.ui | uB.ui };
+        return r.f;
+    }
+    return (a < b) != max ? a : b;
+}
+
+inline f64 fminmax64(f64 a, f64 b, bool max, u32 *fcsr) {
+    union u64_f64 uA = { .f = a }, uB = { .f = b };
+    if (isnan(a) || isnan(b)) {
+        if (isSigNaNF64UI(uA.ui) || isSigNaNF64UI(uB.ui)) *fcsr |= FFLAGS_NV;
+        if (isnan(a) && isnan(b)) return (f64)NAN;
+        return isnan(a) ? b : a;
+    }
+    if (a == b) {
+        union u64_f64 r = { .ui = max ? uA.ui & uB.ui : uA.ui | uB.ui };
+        return r.f;
+    }
+    return (a < b) != max ? a : b;
+}
+
+inline u16 f16_classify(u16 a) {
+    bool sign = a >> 15;
+    bool infOrNaN = ((a >> 10) & 0x1f) == 0x1f;
+    bool subnormalOrZero = ((a >> 10) & 0x1f) == 0;
+    bool fracZero = (a & 0x3ff) == 0;
+    bool isNaN = infOrNaN && !fracZero;
+    bool isSNaN = isNaN && !(a & 0x200);
+
+    return
+        (sign && infOrNaN && fracZero)          << 0 |
+        (sign && !infOrNaN && !subnormalOrZero) << 1 |
+        (sign && subnormalOrZero && !fracZero)  << 2 |
+        (sign && subnormalOrZero && fracZero)   << 3 |
+        (!sign && infOrNaN && fracZero)          << 7 |
+        (!sign && !infOrNaN && !subnormalOrZero) << 6 |
+        (!sign && subnormalOrZero && !fracZero)  << 5 |
+        (!sign && subnormalOrZero && fracZero)   << 4 |
+        (isNaN &&  isSNaN)                       << 8 |
+        (isNaN && !isSNaN)                       << 9;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,276 @@
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "rvemu.h"
+
+//
+// 可选的io_uring后端，guest的read/write/pread/pwrite通过machine持有的ring提交
+// 没有依赖liburing，直接用io_uring_setup、io_uring_enter这两个syscall
+//
+// 只有一个guest线程的时候，不大的write不马上提交：数据拷贝到ring自己的暂存区里，
+// sqe先填好放着，guest立刻拿到返回值继续执行，攒下来的write在这些时候一次io_uring_enter提交：
+//   - read/pread：排在攒下的write后面一起提交，能读到前面写的数据
+//   - 其他的syscall(fsync、close、dup、lseek、exit、clone……)：do_syscall先调用ioring_flush
+//   - sqe或者暂存区满了，进程退出
+// 同一批的sqe用IOSQE_IO_LINK串起来，内核按guest发出的顺序执行
+// 攒下的write失败了，错误记下来，和outbuf一样在这个fd下一次read/write/fsync/close的时候返回
+//
+// read、比暂存区大的write、多线程的时候的write还是同步的：提交之后等它完成再返回
+// io_uring_enter失败的时候不退出，没有提交的请求改用同步的syscall完成
+//
+
+// 和内核一样，单次读写最多0x7ffff000字节
+#define IORING_MAX_RW 0x7ffff000
+
+static int io_uring_setup(u32 entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, u32 to_submit, u32 min_complete, u32 flags) {
+    int ret;
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+    return ret;
+}
+
+// 创建一个io_uring，如果host内核不支持就返回NULL，这时候syscall退回同步的实现
+ioring_t *ioring_new(u32 entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = io_uring_setup(entries, &p);
+    if (fd < 0) return NULL;
+    // read/write要用当前的文件偏移(off = -1)
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(u32);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) sq_sz = cq_sz = MAX(sq_sz, cq_sz);
+
+    // 把SQ、CQ和sqe数组映射到用户态
+    u8 *sq = (u8 *)mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) goto fail;
+    u8 *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = (u8 *)mmap(NULL, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) goto fail;
+    }
+    u8 *sqes = (u8 *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) goto fail;
+
+    ioring_t *r = (ioring_t *)calloc(1, sizeof(ioring_t));
+    r->fd = fd;
+    r->sq_head = (u32 *)(sq + p.sq_off.head);
+    r->sq_tail = (u32 *)(sq + p.sq_off.tail);
+    r->sq_mask = (u32 *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (u32 *)(sq + p.sq_off.array);
+    r->sqes = (struct io_uring_sqe *)sqes;
+    r->cq_head = (u32 *)(cq + p.cq_off.head);
+    r->cq_tail = (u32 *)(cq + p.cq_off.tail);
+    r->cq_mask = (u32 *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sq_ring = sq;
+    r->cq_ring = cq;
+    r->sq_ring_sz = sq_sz;
+    r->cq_ring_sz = cq_sz;
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->entries = p.sq_entries;
+    r->stage = (u8 *)malloc(IORING_STAGE_SIZE);
+    return r;
+
+fail:
+    // 进程退出的时候映射会一起释放，这里只关闭fd
+    close(fd);
+    return NULL;
+}
+
+// 攒着write的ring，只有一个guest线程的时候才会攒，所以最多只有一个，异常退出的时候用
+static ioring_t *pending = NULL;
+// 正在填sqe或者提交，这时候信号处理函数不能再去提交
+static volatile bool busy = false;
+
+// ring里同时放着的sqe最多这么多个
+static u32 ioring_capacity(ioring_t *r) {
+    return MIN(r->entries, IORING_ENTRIES);
+}
+
+// 填好第queued个sqe，tail要等到ioring_submit的时候才移动，在那之前内核看不到它
+static void ioring_prep(ioring_t *r, u8 opcode, int fd, void *buf, size_t len, i64 off) {
+    u32 idx = (*r->sq_tail + r->queued) & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    // 和后面的sqe串起来，前一个完成之后才开始下一个
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = fd;
+    sqe->addr = (u64)buf;
+    sqe->len = (u32)len;
+    sqe->off = (u64)off;
+    sqe->user_data = r->queued;
+    r->sq_array[idx] = idx;
+    r->queued++;
+}
+
+// 用同步的syscall完成sqe剩下的部分，前done个字节已经读写过了
+static i64 ioring_sync(struct io_uring_sqe *sqe, u32 done) {
+    void *buf = (u8 *)sqe->addr + done;
+    size_t len = sqe->len - done;
+    i64 off = (i64)sqe->off;
+    if (sqe->opcode == IORING_OP_READ)
+        return off == -1 ? read(sqe->fd, buf, len) : pread(sqe->fd, buf, len, off + done);
+    return off == -1 ? write(sqe->fd, buf, len) : pwrite(sqe->fd, buf, len, off + done);
+}
+
+// 攒下的write出错了，guest已经拿到了成功的返回值，错误留到这个fd下一次读写的时候返回，只记第一个
+static void ioring_set_error(ioring_t *r, int fd, int err) {
+    if (r->error != 0) return;
+    r->error = err;
+    r->error_fd = fd;
+}
+
+// 提交所有填好的sqe并等它们全部完成
+// last为true的时候最后一个sqe是同步的请求，返回它的结果，失败的时候是-errno
+static i64 ioring_submit(ioring_t *r, bool last) {
+    u32 n = r->queued;
+    if (n == 0) return 0;
+    busy = true;
+    r->queued = 0;
+    pending = NULL;
+    // 只有本线程会写tail
+    u32 tail = *r->sq_tail;
+    u32 mask = *r->sq_mask;
+    // 链到这一批的最后一个为止
+    r->sqes[(tail + n - 1) & mask].flags &= ~IOSQE_IO_LINK;
+    __atomic_store_n(r->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+    // 一次enter提交整批并且等待它们完成，page cache命中的时候内核在提交过程中就直接完成了
+    // enter失败(比如内存不足)的时候内核没有收下的sqe收回来，下面改用同步的syscall
+    io_uring_enter(r->fd, n, n, IORING_ENTER_GETEVENTS);
+    u32 consumed = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) - tail;
+    if (consumed < n) __atomic_store_n(r->sq_tail, tail + consumed, __ATOMIC_RELEASE);
+
+    // 内核收下的请求一定要等它们完成，guest的缓冲区和暂存区在这之前都不能动
+    i32 res[IORING_ENTRIES];
+    for (u32 i = 0; i < n; i++) res[i] = -ECANCELED;
+    for (u32 done = 0; done < consumed;) {
+        u32 head = *r->cq_head;
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            // 等待也失败了就让出CPU之后再看CQ
+            if (io_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) sched_yield();
+            continue;
+        }
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        res[cqe->user_data] = cqe->res;
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+        done++;
+    }
+
+    // 按照guest发出的顺序处理结果
+    // 被取消的(前面的请求失败断了链，或者没有提交)用同步的syscall重做，攒下的write写了一部分的接着写完
+    i64 ret = 0;
+    for (u32 i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe = &r->sqes[(tail + i) & mask];
+        bool queued = !(last && i == n - 1);
+        i64 v = res[i];
+        if (v == -ECANCELED) {
+            v = ioring_sync(sqe, 0);
+            if (v < 0) v = -errno;
+        }
+        while (queued && v >= 0 && v < sqe->len) {
+            i64 rest = ioring_sync(sqe, (u32)v);
+            if (rest <= 0) {
+                v = rest < 0 ? -errno : -EIO;
+                break;
+            }
+            v += rest;
+        }
+        if (!queued) ret = v;
+        else if (v < 0) ioring_set_error(r, sqe->fd, (int)-v);
+    }
+    r->staged = 0;
+    busy = false;
+    return ret;
+}
+
+// 同步的请求排在攒下的write后面一起提交，等它完成再返回
+// 返回值和同步的read/write一样：失败返回-1并设置errno
+static i64 ioring_rw(ioring_t *r, u8 opcode, int fd, void *buf, size_t len, i64 off) {
+    int err = ioring_take_error(r, fd);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    // 留了一个sqe给它
+    ioring_prep(r, opcode, fd, buf, MIN(len, IORING_MAX_RW), off);
+    i64 res = ioring_submit(r, true);
+    if (res < 0) {
+        errno = (int)-res;
+        return -1;
+    }
+    return res;
+}
+
+i64 ioring_read(ioring_t *r, int fd, void *buf, size_t len, i64 off) {
+    return ioring_rw(r, IORING_OP_READ, fd, buf, len, off);
+}
+
+i64 ioring_write(ioring_t *r, int fd, void *buf, size_t len, i64 off) {
+    // 有别的guest线程的时候，它们不经过syscall就可能知道这次write已经返回，接着去读这个文件，不能攒着
+    // 比暂存区还大的write也不拷贝，直接提交
+    if (machine_threaded() || len > IORING_STAGE_SIZE)
+        return ioring_rw(r, IORING_OP_WRITE, fd, buf, len, off);
+    int err = ioring_take_error(r, fd);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    // 放不下了先把攒下的提交掉，最后一个sqe要留给read
+    if (r->queued + 2 > ioring_capacity(r) || r->staged + len > IORING_STAGE_SIZE)
+        ioring_flush(r);
+    busy = true;
+    u8 *data = r->stage + r->staged;
+    memcpy(data, buf, len);
+    r->staged += len;
+    ioring_prep(r, IORING_OP_WRITE, fd, data, len, off);
+    pending = r;
+    busy = false;
+    return len;
+}
+
+// 提交攒下的write，除了read/write之外的syscall之前都要调用
+void ioring_flush(ioring_t *r) {
+    ioring_submit(r, false);
+}
+
+// 攒下的write在fd上出过错的话取出这个错误，没有的话返回0
+int ioring_take_error(ioring_t *r, int fd) {
+    if (r->error == 0 || r->error_fd != fd) return 0;
+    int err = r->error;
+    r->error = 0;
+    return err;
+}
+
+// 进程异常退出或者调用exit的时候，把攒下的write提交掉
+// 信号可能打断了正在提交的线程，这时候只能放弃
+void ioring_on_exit() {
+    if (pending != NULL && !busy) ioring_flush(pending);
+}
+
+// guest线程退出的时候释放它的ring，攒下的write先提交掉
+void ioring_free(ioring_t *r) {
+    ioring_flush(r);
+    free(r->stage);
+    munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_sz);
+    munmap(r->sq_ring, r->sq_ring_sz);
+    close(r->fd);
+    free(r);
+}
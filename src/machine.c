@@ -1,5 +1,12 @@
+#include <linux/futex.h>
+#include <linux/sched.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+
 #include "rvemu.h"
 
+// 还活着的guest线程数，最后一个线程exit的时候整个进程退出
+static int live_threads = 1;
 
 enum exit_reason_t machine_step(machine_t *m){
     while(true) {
@@ -7,24 +14,57 @@ enum exit_reason_t machine_step(machine_t *m){
 
         // 根据当前机器的pc指针，在jit cache中检索，看看能不能找到相应的host的可执行代码片段
         u8 *code = cache_lookup(m->cache, m->state.pc);
-        if (code == NULL) {
-            // 找不到的话，更新这段代码的hot计数值
-            hot = cache_hot(m->cache, m->state.pc);
-            if (hot) {
-                printf("pc: 0x%lx, gen jit cache\n", m->state.pc);
+        // jitcode用完的时候还有别的线程，它们可能还在旧的代码里，不能清空，之后所有的代码都解释执行，
+        // 等到只剩这一个线程了，它现在也不在jit的代码里，这时候再清空，重新开始编译
+        if (code == NULL && __atomic_load_n(&m->cache->full, __ATOMIC_RELAXED) && !machine_threaded()) {
+            pthread_mutex_lock(&m->cache->lock);
+            STATS_INC(cache_flushes);
+            cache_flush(m->cache);
+            pthread_mutex_unlock(&m->cache->lock);
+        }
+        // 找不到的话，更新这段代码的hot计数值，计数不用拿锁
+        if (code == NULL) hot = cache_hot(m->cache, m->state.pc);
+        if (code == NULL && hot) {
+            // cache是所有线程共享的，拿到锁之后再查一次，可能别的线程刚刚编译好
+            pthread_mutex_lock(&m->cache->lock);
+            code = cache_lookup(m->cache, m->state.pc);
+            if (code == NULL) {
+                STATS_INC(blocks_compiled);
+                u64 start = stats_now_ns();
+                u64 used = m->cache->offset;
                 // 如果这段代码是hot的，而且在jit cache中没有缓存，那现在就编译成host的代码
-                str_t source = machine_genblock(m);
+                region_t region;
+                str_t source = machine_genblock(m, &region);
                 // source就是host的代码
-                // 然后编译成一段代码code，而且把jit的代码已经加入到jit cache中
+                // 然后编译成一段代码code，区域里的每个入口都指向它，以后从这些pc进来都不用再编译
                 code = machine_compile(m, source);
+                // jitcode用完了，只有这一个guest线程的时候没有别人在执行旧的代码，全部丢掉重新编译
+                if (code == NULL && !machine_threaded()) {
+                    STATS_INC(cache_flushes);
+                    cache_flush(m->cache);
+                    used = 0;
+                    code = machine_compile(m, source);
+                }
+                if (code == NULL) {
+                    // 多线程的时候别的线程可能还在旧的代码里，先解释执行，等只剩一个线程的时候在上面清空
+                    hot = false;
+                } else {
+                    cache_publish(m->cache, m->mmu, &region, code);
+                    STATS_ADD(region_entries, region.num_entries);
+                    STATS_ADD(loops, region.num_loops);
+                    STATS_ADD(compile_ns, stats_now_ns() - start);
+                    STATS_ADD(code_bytes, m->cache->offset - used);
+                }
             }
+            pthread_mutex_unlock(&m->cache->lock);
         }
 
-        printf("[jit]: cache hit\n");
-
         // 如果不是hot，就还是按照取指、译码、执行这样一步一步来做
         if (!hot) {
             code = (u8 *)exec_block_interp;
+            STATS_INC(interp_entries);
+        } else {
+            STATS_INC(jit_entries);
         }
         // 
         while (true) {
@@ -35,7 +75,11 @@ enum exit_reason_t machine_step(machine_t *m){
             if (m->state.exit_reason == indirect_branch ||
                 m->state.exit_reason == direct_branch ) {
                 code = cache_lookup(m->cache, m->state.reenter_pc);
-                if (code != NULL) continue;
+                // 多入口的代码按照state.pc选择从哪个入口进去
+                if (code != NULL) {
+                    m->state.pc = m->state.reenter_pc;
+                    continue;
+                }
             }
 
             if (m->state.exit_reason == interp) {
@@ -44,6 +88,35 @@ enum exit_reason_t machine_step(machine_t *m){
                 continue;
             }
 
+            // 编译的时候认为很冷的路径，在解释器里接着执行
+            // state.pc还是进入这段代码时的入口，出口变热的时候用它找到区域，重新编译
+            if (m->state.exit_reason == side_exit) {
+                STATS_INC(side_exits);
+                if (cfg_side_exit(m->state.profile, m->state.reenter_pc)) {
+                    pthread_mutex_lock(&m->cache->lock);
+                    cfg_hot_exit(m->cache->cfg, m->state.reenter_pc);
+                    if (cache_recompile(m->cache, m->state.pc)) STATS_INC(recompiles);
+                    pthread_mutex_unlock(&m->cache->lock);
+                }
+                m->state.pc = m->state.reenter_pc;
+                code = (u8 *)exec_block_interp;
+                continue;
+            }
+
+            // 推测的jalr目标不对，状态已经写回了，从真正的目标开始解释执行
+            if (m->state.exit_reason == deopt) {
+                STATS_INC(deopts);
+                if (cfg_deopt(m->state.profile, m->state.deopt_pc)) {
+                    pthread_mutex_lock(&m->cache->lock);
+                    cfg_no_speculate(m->cache->cfg, m->state.deopt_pc);
+                    if (cache_recompile(m->cache, m->state.pc)) STATS_INC(recompiles);
+                    pthread_mutex_unlock(&m->cache->lock);
+                }
+                m->state.pc = m->state.reenter_pc;
+                code = (u8 *)exec_block_interp;
+                continue;
+            }
+
             break;
         }
 
@@ -70,11 +143,14 @@ void machine_load_program(machine_t *m, char *prog) {
     fatal(strerror(errno));
   }
   // 根据elf文件的格式解析mmu
-  mmu_load_elf(&m->mmu, fd);
+  mmu_load_elf(m->mmu, fd);
   close(fd);
 
   // 解析可执行文件elf之后，设置进程的pc指针
-  m->state.pc = (u64)m->mmu.entry;
+  m->state.pc = (u64)m->mmu->entry;
+  // jit生成的代码从state里取guest内存的基地址，clone出来的线程跟着state一起复制
+  m->state.guest_base = m->mmu->guest_base;
+  m->state.profile = (profile_t *)calloc(PROFILE_SIZE, sizeof(profile_t));
 }
 
 // 初始化栈
@@ -82,7 +158,11 @@ void machine_setup(machine_t *machine, int argc, char *argv[]) {
   // 栈空间的大小
   size_t stack_size = 32 * 1024 * 1024; // 32MB
   // 在elf文件的mmap地址之后，继mmap相应的内存空间作为栈空间
-  u64 stack = mmu_alloc(&machine->mmu, stack_size);
+  u64 stack = mmu_alloc(machine->mmu, stack_size);
+  // 栈的最低一页作为保护页，guest栈溢出的时候触发段错误，而不是悄悄写坏前面的数据段
+  int page_size = getpagesize();
+  mprotect((void *)TO_HOST(machine->mmu->guest_base, ROUNDUP(stack, page_size)), page_size, PROT_NONE);
+  machine->mmu->code_pages[ROUNDUP(stack, page_size) / page_size] = page_none;
   // 初始化栈顶指针sp到栈底位置
   machine->state.gp_regs[sp] = stack + stack_size;
   // 栈底保存着这几个变量auxv、envp、argv、argc
@@ -97,17 +177,17 @@ void machine_setup(machine_t *machine, int argc, char *argv[]) {
     // 计算argv[i]的长度
     size_t len = strlen(argv[i]);
     // 继续调用mmu_alloc，调用mmap增加内存
-    u64 addr = mmu_alloc(&machine->mmu, len + 1);
+    u64 addr = mmu_alloc(machine->mmu, len + 1);
     // 把argv[i]写到分配出来的地址中
-    mmu_write(addr, (u8 *)argv[i], len);
+    mmu_write(machine->mmu, addr, (u8 *)argv[i], len);
     // 栈指针sp后移
     machine->state.gp_regs[sp] -= 8;   // argv[i]
     // 把argv[i]的地址写到栈的sp位置
-    mmu_write(machine->state.gp_regs[sp], (u8 *)&addr, sizeof(u64));
+    mmu_write(machine->mmu, machine->state.gp_regs[sp], (u8 *)&addr, sizeof(u64));
   }
   // 最后把argc写入栈中
   machine->state.gp_regs[sp] -= 8;
-  mmu_write(machine->state.gp_regs[sp], (u8 *)&argc, sizeof(u64));
+  mmu_write(machine->mmu, machine->state.gp_regs[sp], (u8 *)&args, sizeof(u64));
 
   // 最后的空间布局
   // 
@@ -115,4 +195,157 @@ void machine_setup(machine_t *machine, int argc, char *argv[]) {
   //  ^mmap的起始地址 ^ mmu.base指向此处                                                  ^ mmu.alloc指向此处，随着mmu_alloc的调用不断后移，每次mmu_alloc都映射到mmu.alloc的位置
   //  
 
-}
\ No newline at end of file
+}
+
+// guest要往[addr, addr + len)里写数据，这里面有翻译过的代码的页先恢复写权限，
+// 上面的代码块全部作废；写保护的SIGSEGV、往guest内存里写数据的syscall都走这里
+// 先不拿锁看一遍，没有代码页的时候什么都不做
+void machine_invalidate(machine_t *m, u64 addr, u64 len) {
+  int page_size = getpagesize();
+  // host_alloc之上的页从来没有映射过，上面不会有代码
+  u64 limit = TO_GUEST(m->state.guest_base, m->mmu->host_alloc);
+  if (addr >= limit) return;
+  u64 end = addr + MIN(len, limit - addr);
+  bool locked = false;
+  for (u64 page = ROUNDDOWN(addr, page_size); page < end; page += page_size) {
+    if (m->mmu->code_pages[page / page_size] != page_code) continue;
+    if (!locked) {
+      pthread_mutex_lock(&m->cache->lock);
+      locked = true;
+    }
+    // 拿到锁之后可能已经被别的线程处理过了
+    if (mmu_unprotect_code(m->mmu, page)) cache_invalidate(m->cache, page, page + page_size);
+  }
+  if (locked) pthread_mutex_unlock(&m->cache->lock);
+}
+
+// 一个guest线程的执行循环，主线程和clone出来的线程都跑这个循环，不会返回
+void machine_run(machine_t *m) {
+  // guest访存越界的时候，信号处理函数要知道是哪个guest线程
+  fault_enter(m);
+  while(true){
+    enum exit_reason_t exit_reason = machine_step(m);
+    assert(exit_reason == ecall);
+
+    // 发生syscall的时候，a7寄存器保存的就是syscall number
+    // a0-a6保存的就是syscall的参数
+    u64 syscall_num = machine_get_gp_reg(m, a7);
+
+    // 离开guest代码之前，把host累积的浮点异常标志收集到fcsr里
+    // syscall处理过程中模拟器自己的浮点运算产生的标志不能算到guest头上，处理完之后清掉
+    fpu_collect_flags(&m->state);
+    // 用syscall_num查找syscall table，调用syscall的处理函数，最后得到返回值ret
+    u64 ret = do_syscall(m, syscall_num);
+    fpu_clear_host_flags();
+    // 把syscall的返回值ret写入到a0寄存器，然后重新译码执行
+    machine_set_gp_reg(m, a0, ret);
+  }
+}
+
+//
+// guest线程：clone(CLONE_VM | CLONE_THREAD)对应一个host的pthread
+// guest看到的tid就是host线程的tid，所以gettid、tgkill、futex都可以直接交给host
+//
+
+typedef struct {
+  machine_t *m;
+  u64 flags;
+  u64 ptid;
+  u64 ctid;
+  i64 tid;
+  sem_t started;
+} clone_args_t;
+
+static void *machine_thread_entry(void *arg) {
+  clone_args_t *args = (clone_args_t *)arg;
+  machine_t *m = args->m;
+  pid_t tid = (pid_t)syscall(__NR_gettid);
+
+  if (args->flags & CLONE_PARENT_SETTID) *(i32 *)TO_HOST(m->state.guest_base, args->ptid) = tid;
+  if (args->flags & CLONE_CHILD_SETTID) *(i32 *)TO_HOST(m->state.guest_base, args->ctid) = tid;
+  if (args->flags & CLONE_CHILD_CLEARTID) m->clear_child_tid = args->ctid;
+
+  // 告诉父线程tid，之后args就不能再用了
+  args->tid = tid;
+  sem_post(&args->started);
+
+  machine_run(m);
+  return NULL;
+}
+
+// 创建一个guest线程，返回子线程的tid，失败返回-errno
+// 子线程从ecall的下一条指令开始执行，a0为0
+i64 machine_clone(machine_t *m, u64 flags, u64 newsp, u64 ptid, u64 tls, u64 ctid) {
+  // 只支持创建线程，不支持fork出新的进程
+  u64 required = CLONE_VM | CLONE_THREAD | CLONE_SIGHAND;
+  if ((flags & required) != required) return -ENOSYS;
+
+  machine_t *child = (machine_t *)calloc(1, sizeof(machine_t));
+  // machine_step在ecall的时候已经把state.pc设置成了下一条指令
+  child->state = m->state;
+  // 跳转的统计每个线程一份，新线程从头开始统计
+  child->state.profile = (profile_t *)calloc(PROFILE_SIZE, sizeof(profile_t));
+  child->mmu = m->mmu;
+  child->cache = m->cache;
+  // ring只能由一个线程提交，每个线程各自一个
+  child->ioring = m->ioring ? ioring_new(IORING_ENTRIES) : NULL;
+  child->cloned = true;
+  child->state.gp_regs[a0] = 0;
+  if (newsp) child->state.gp_regs[sp] = newsp;
+  if (flags & CLONE_SETTLS) child->state.gp_regs[tp] = tls;
+
+  clone_args_t args = {
+    .m = child,
+    .flags = flags,
+    .ptid = ptid,
+    .ctid = ctid,
+  };
+  sem_init(&args.started, 0, 0);
+
+  __atomic_add_fetch(&live_threads, 1, __ATOMIC_SEQ_CST);
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int err = pthread_create(&thread, &attr, machine_thread_entry, &args);
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    __atomic_sub_fetch(&live_threads, 1, __ATOMIC_SEQ_CST);
+    if (child->ioring) ioring_free(child->ioring);
+    free(child->state.profile);
+    free(child);
+    sem_destroy(&args.started);
+    return -err;
+  }
+
+  // 等子线程拿到自己的tid，父线程的clone返回值就是它
+  while (sem_wait(&args.started) != 0) {}
+  sem_destroy(&args.started);
+  return args.tid;
+}
+
+// 还有别的guest线程在运行
+bool machine_threaded() {
+  return __atomic_load_n(&live_threads, __ATOMIC_SEQ_CST) > 1;
+}
+
+// guest线程调用exit，只结束当前线程
+void machine_exit_thread(machine_t *m, int status) {
+  // CLONE_CHILD_CLEARTID/set_tid_address：清零之后唤醒等待的线程，pthread_join就是靠这个
+  if (m->clear_child_tid) {
+    i32 *addr = (i32 *)TO_HOST(m->state.guest_base, m->clear_child_tid);
+    __atomic_store_n(addr, 0, __ATOMIC_SEQ_CST);
+    syscall(__NR_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+
+  if (__atomic_sub_fetch(&live_threads, 1, __ATOMIC_SEQ_CST) == 0) {
+    outbuf_flush_all();
+    exit(status);
+  }
+  // 这个线程自己的ring、跳转的统计和machine_t都不会再用了，信号处理函数也不能再找到它
+  fault_enter(NULL);
+  if (m->ioring) ioring_free(m->ioring);
+  free(m->state.profile);
+  if (m->cloned) free(m);
+  pthread_exit(NULL);
+}
@@ -23,6 +23,33 @@ static int flags_to_mmap_prot(u32 flags) {
          (flags & PF_X ? PROT_EXEC : 0);
 }
 
+// 下一个要尝试的slot，多个guest同时加载的时候各拿各的
+static u64 next_slot = 0;
+
+// 从地址池里给这个guest保留一个slot，整个slot先用PROT_NONE占住，
+// 后面加载程序段、brk都是在这个slot里面MAP_FIXED，不会覆盖到host自己的映射
+// 窗口前后的保护区一直是PROT_NONE，guest的野指针在这里触发SIGSEGV，由fault.c处理
+static void mmu_reserve(mmu_t *mmu) {
+  while (true) {
+    u64 slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_SEQ_CST);
+    if (slot >= GUEST_SLOT_NUM) fatal("no guest memory slot left");
+
+    void *hint = (void *)(GUEST_MEMORY_OFFSET + slot * GUEST_SLOT_STRIDE);
+    void *addr = mmap(hint, GUEST_SLOT_STRIDE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (addr == hint) {
+      mmu->guest_base = (u64)addr + GUEST_GUARD_SIZE;
+      // 只有用到的部分才会真的分配物理内存
+      mmu->code_pages = (u8 *)mmap(NULL, GUEST_SLOT_SIZE / getpagesize(), PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (mmu->code_pages == MAP_FAILED) fatal(strerror(errno));
+      return;
+    }
+    // 这段地址已经被占了，老的内核不认识MAP_FIXED_NOREPLACE，会映射到别的地方，换下一个slot
+    if (addr != MAP_FAILED) munmap(addr, GUEST_SLOT_STRIDE);
+  }
+}
+
 // static仅在本文件内使用
 // 加载程序段
 static void mmu_load_segment(mmu_t *mmu, elf64_phdr_t *phdr, int fd) {
@@ -30,8 +57,9 @@ static void mmu_load_segment(mmu_t *mmu, elf64_phdr_t *phdr, int fd) {
   int page_size = getpagesize();
   // 这个offset是这个程序段在elf文件中的偏移
   u64 offset = phdr->p_offset;
+  if (phdr->p_vaddr + phdr->p_memsz > GUEST_SLOT_SIZE) fatal("segment out of guest memory");
   // 这个vadrz 是这个程序段应该加载到的内存地址
-  u64 vaddr = TO_HOST(phdr->p_vaddr);
+  u64 vaddr = TO_HOST(mmu->guest_base, phdr->p_vaddr);
   // 加载到的内存中的起始位置向下取整
   u64 aligned_vaddr = ROUNDDOWN(vaddr, page_size);
   // 这个filesz是这个程序段在elf文件中的大小
@@ -57,10 +85,16 @@ static void mmu_load_segment(mmu_t *mmu, elf64_phdr_t *phdr, int fd) {
   u64 remaining_bss = ROUNDUP(memsz, page_size) - ROUNDUP(filesz, page_size);
   if (remaining_bss > 0) {
     u64 addr = (u64)mmap((void *)(aligned_vaddr + ROUNDUP(filesz, page_size)),
-                         remaining_bss, prot, MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+                         remaining_bss, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
     assert(addr == aligned_vaddr + ROUNDUP(filesz, page_size));
   }
 
+  // guest不能写的段上的代码不会变，翻译的时候不用去掉写权限
+  // 两个段共用一页的时候，后面的mmap覆盖了前面的，页的状态也跟着后面的段
+  u8 state = (prot & PROT_WRITE) ? page_data : page_readonly;
+  u64 first = TO_GUEST(mmu->guest_base, aligned_vaddr) / page_size;
+  memset(mmu->code_pages + first, state, ROUNDUP(memsz, page_size) / page_size);
+
   // 在host的mmap映射地址的最高处
   mmu->host_alloc =
       MAX(mmu->host_alloc, (aligned_vaddr + ROUNDUP(memsz, page_size)));
@@ -68,7 +102,7 @@ static void mmu_load_segment(mmu_t *mmu, elf64_phdr_t *phdr, int fd) {
   // 事实上，base就应该指向这个位置
   // alloc只是现在初始化也在这个位置而已
   // alloc是可移动的
-  mmu->base = mmu->alloc = TO_GUEST(mmu->host_alloc);
+  mmu->base = mmu->alloc = TO_GUEST(mmu->guest_base, mmu->host_alloc);
 }
 
 // 根据elf文件，使用mmap把elf可执行文件的内容映射到内存地址
@@ -94,6 +128,9 @@ void mmu_load_elf(mmu_t *mmu, int fd) {
     fatal("only riscv64 elf file is supported");
   }
 
+  // step0.3: 在地址池里给这个guest找一个位置
+  mmu_reserve(mmu);
+
   // step1: 设置mmu的起始地址
   // 这个地址是个低位的地址
   mmu->entry = (u64)ehdr->e_entry;
@@ -128,22 +165,60 @@ u64 mmu_alloc(mmu_t *mmu, i64 sz) {
   mmu->alloc += sz;
   // 保证内存增加或者删除之后，肯定要比base起始地址大
   assert(mmu->alloc >= mmu->base);
+  u64 guest_end = TO_GUEST(mmu->guest_base, mmu->host_alloc);
   //  sz > 0，分配内存
-  if(sz > 0 && mmu->alloc > TO_GUEST(mmu->host_alloc)) {
-    // 如果是分配内存，用mmap继续映射到mmu->host_alloc的位置
-    if(mmap((void *)mmu->host_alloc, ROUNDUP(sz, page_size), PROT_READ | PROT_WRITE,
-      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0) == MAP_FAILED){
+  if(sz > 0 && mmu->alloc > guest_end) {
+    u64 len = ROUNDUP(mmu->alloc - guest_end, page_size);
+    if (mmu->host_alloc + len > mmu->guest_base + GUEST_SLOT_SIZE) fatal("out of guest memory");
+    // 如果是分配内存，用mmap继续映射到mmu->host_alloc的位置，这块地址是自己保留的，可以MAP_FIXED
+    if(mmap((void *)mmu->host_alloc, len, PROT_READ | PROT_WRITE,
+      MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0) == MAP_FAILED){
         fatal(strerror(errno));
       }
-    mmu->host_alloc += ROUNDUP(sz, page_size);
-  } else if(sz < 0 && ROUNDUP(mmu->alloc, page_size) < TO_GUEST(mmu->host_alloc)) {
-    // 如果释放了超过一页的内库，就用munmap释放掉一页的映射
-    u64 len = TO_GUEST(mmu->host_alloc) - ROUNDUP(mmu->alloc, page_size);
-    if(munmap((void*)ROUNDUP(mmu->alloc, page_size), len) == -1) {
+    memset(mmu->code_pages + guest_end / page_size, page_data, len / page_size);
+    mmu->host_alloc += len;
+  } else if(sz < 0 && ROUNDUP(mmu->alloc, page_size) < guest_end) {
+    // 如果释放了超过一页的内存，这几页重新换成PROT_NONE，地址还是这个guest保留着
+    u64 len = guest_end - ROUNDUP(mmu->alloc, page_size);
+    u64 addr = TO_HOST(mmu->guest_base, ROUNDUP(mmu->alloc, page_size));
+    if(mmap((void *)addr, len, PROT_NONE,
+      MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
       fatal(strerror(errno));
     }
-    // munmap成功，在host上的mmap的最后地址缩减len
+    memset(mmu->code_pages + (guest_end - len) / page_size, page_none, len / page_size);
+    // 在host上可访问的内存的最后地址缩减len
     mmu->host_alloc -= len;
   }
   return base;
 }
+
+//
+// guest改写自己的代码：翻译过的代码所在的页去掉写权限，guest写这一页的时候触发SIGSEGV，
+// fault.c里调用machine_invalidate作废这一页上的代码块，再恢复写权限重新执行那条store
+// guest不能写的页(比如elf的代码段)什么都不用做，所以从来不改写代码的guest没有任何开销
+//
+
+// 翻译pc处的指令之前调用，调用者持有cache->lock
+// 先标记再mprotect，这样出了SIGSEGV的时候一定能在code_pages里看到page_code
+void mmu_protect_code(mmu_t *mmu, u64 pc) {
+  int page_size = getpagesize();
+  u8 *state = &mmu->code_pages[pc / page_size];
+  if (__atomic_load_n(state, __ATOMIC_ACQUIRE) != page_data) return;
+  __atomic_store_n(state, page_code, __ATOMIC_RELEASE);
+  if (mprotect((void *)TO_HOST(mmu->guest_base, ROUNDDOWN(pc, page_size)), page_size, PROT_READ) == -1) {
+    fatal(strerror(errno));
+  }
+}
+
+// 恢复addr所在页的写权限，这一页原来有翻译过的代码的时候返回true，调用者持有cache->lock
+bool mmu_unprotect_code(mmu_t *mmu, u64 addr) {
+  int page_size = getpagesize();
+  u8 *state = &mmu->code_pages[addr / page_size];
+  if (__atomic_load_n(state, __ATOMIC_ACQUIRE) != page_code) return false;
+  if (mprotect((void *)TO_HOST(mmu->guest_base, ROUNDDOWN(addr, page_size)), page_size,
+               PROT_READ | PROT_WRITE) == -1) {
+    fatal(strerror(errno));
+  }
+  __atomic_store_n(state, page_data, __ATOMIC_RELEASE);
+  return true;
+}
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <time.h>
+
+// signal.h里的stack_t和stack.c的stack_t重名
+#define stack_t host_stack_t
+#include <signal.h>
+#undef stack_t
+
+#include "rvemu.h"
+
+//
+// guest写stdout/stderr的合并缓冲区
+// 很多guest的stdio是无缓冲或者行缓冲的，每一行甚至每个字符都是一次write
+// 这里在模拟器这一侧给host的fd 1、2各准备一个缓冲区，攒够OUTBUF_SIZE字节
+// 或者超过OUTBUF_LATENCY_NS之后才真正调用write
+//
+// 刷新的时机：缓冲区满、延迟到期(后台线程)、guest exit、guest读stdin、
+// guest fsync、guest close或者dup3到fd 1、2、以及模拟器异常退出
+//
+// guest的write在放进缓冲区的时候就返回成功了，后面真正写的时候失败，
+// 把errno记下来，由这个流的下一次write、fsync或者close返回给guest
+//
+
+static outbuf_t outbufs[2] = {
+    { .fd = STDOUT_FILENO },
+    { .fd = STDERR_FILENO },
+};
+
+// stdout和stderr指向同一个文件的时候，写其中一个之前要先把另一个刷掉，保证顺序
+static bool aliased = false;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+static bool flusher_started = false;
+
+static u64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static outbuf_t *outbuf_of(int fd) {
+    if (fd == STDOUT_FILENO || fd == STDERR_FILENO) {
+        outbuf_t *ob = &outbufs[fd - STDOUT_FILENO];
+        if (ob->enabled) return ob;
+    }
+    return NULL;
+}
+
+// 成功返回0，失败返回errno
+static int write_all(int fd, u8 *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 调用者需要持有lock
+static void outbuf_flush_locked(outbuf_t *ob) {
+    if (ob->len == 0) return;
+    int err = write_all(ob->fd, ob->buf, ob->len);
+    if (err != 0) ob->error = err;
+    ob->len = 0;
+}
+
+// 取出之前刷新失败的错误，有的话设置errno返回-1，调用者需要持有lock
+static int outbuf_take_error(outbuf_t *ob) {
+    if (ob->error == 0) return 0;
+    errno = ob->error;
+    ob->error = 0;
+    return -1;
+}
+
+// 后台线程，负责延迟上限：缓冲区里最早的数据等待超过OUTBUF_LATENCY_NS就刷掉
+static void *outbuf_flusher(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (true) {
+        u64 deadline = UINT64_MAX;
+        for (int i = 0; i < 2; i++) {
+            if (outbufs[i].len > 0)
+                deadline = MIN(deadline, outbufs[i].since + OUTBUF_LATENCY_NS);
+        }
+
+        if (deadline == UINT64_MAX) {
+            pthread_cond_wait(&cond, &lock);
+            continue;
+        }
+
+        if (now_ns() < deadline) {
+            struct timespec ts = {
+                .tv_sec = deadline / 1000000000,
+                .tv_nsec = deadline % 1000000000,
+            };
+            pthread_cond_timedwait(&cond, &lock, &ts);
+            continue;
+        }
+
+        u64 now = now_ns();
+        for (int i = 0; i < 2; i++) {
+            if (outbufs[i].len > 0 && outbufs[i].since + OUTBUF_LATENCY_NS <= now)
+                outbuf_flush_locked(&outbufs[i]);
+        }
+    }
+    return NULL;
+}
+
+// 异常退出的时候尽量把缓冲区写出去，然后按默认的方式重新触发这个信号
+// 不拿锁，避免信号打断持有锁的线程之后死锁，guest的段错误也是走这里退出
+void outbuf_on_signal(int sig) {
+    // 攒在io_uring里的文件write也一起提交
+    ioring_on_exit();
+    for (int i = 0; i < 2; i++) {
+        if (outbufs[i].len > 0) write_all(outbufs[i].fd, outbufs[i].buf, outbufs[i].len);
+        outbufs[i].len = 0;
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void outbuf_at_exit() {
+    ioring_on_exit();
+    outbuf_flush_all();
+}
+
+// 检查fd 1、2现在指向什么，决定要不要缓冲，调用者需要保证缓冲区是空的
+static void outbuf_probe() {
+    struct stat st[2];
+    for (int i = 0; i < 2; i++) {
+        outbuf_t *ob = &outbufs[i];
+        // 终端是交互式的，不做缓冲
+        ob->enabled = fstat(ob->fd, &st[i]) == 0 && !isatty(ob->fd);
+        ob->len = 0;
+    }
+    aliased = outbufs[0].enabled && outbufs[1].enabled &&
+              st[0].st_dev == st[1].st_dev && st[0].st_ino == st[1].st_ino;
+}
+
+void outbuf_init() {
+    outbuf_probe();
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // fatal()等路径会调用exit，由atexit负责刷新
+    atexit(outbuf_at_exit);
+    int sigs[] = { SIGSEGV, SIGBUS, SIGABRT, SIGFPE, SIGILL, SIGTERM, SIGINT, SIGHUP };
+    for (int i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) signal(sigs[i], outbuf_on_signal);
+}
+
+bool outbuf_enabled(int fd) {
+    return outbuf_of(fd) != NULL;
+}
+
+// 把guest的一次write放入缓冲区，返回值和write一样
+i64 outbuf_write(int fd, void *data, size_t len) {
+    outbuf_t *ob = outbuf_of(fd);
+    assert(ob != NULL);
+
+    pthread_mutex_lock(&lock);
+    // 两个流写的是同一个文件，先把另一个流里的数据写出去
+    if (aliased) outbuf_flush_locked(&outbufs[1 - (ob - outbufs)]);
+
+    if (ob->len + len > OUTBUF_SIZE) outbuf_flush_locked(ob);
+
+    i64 ret = len;
+    if (outbuf_take_error(ob) < 0) {
+        ret = -1;
+    } else if (len >= OUTBUF_SIZE) {
+        // 大块的写直接交给host
+        ret = write(fd, data, len);
+    } else {
+        if (ob->len == 0) {
+            ob->since = now_ns();
+            if (!flusher_started) {
+                pthread_t tid;
+                flusher_started = pthread_create(&tid, NULL, outbuf_flusher, NULL) == 0;
+            }
+            pthread_cond_signal(&cond);
+        }
+        memcpy(ob->buf + ob->len, data, len);
+        ob->len += len;
+    }
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+// 把fd的缓冲区写出去，写失败或者之前有没报告的错误的时候返回-1并设置errno
+int outbuf_flush(int fd) {
+    outbuf_t *ob = outbuf_of(fd);
+    if (ob == NULL) return 0;
+    pthread_mutex_lock(&lock);
+    outbuf_flush_locked(ob);
+    int ret = outbuf_take_error(ob);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+void outbuf_flush_all() {
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < 2; i++) outbuf_flush_locked(&outbufs[i]);
+    pthread_mutex_unlock(&lock);
+}
+
+// guest用dup3把fd 1或者2换成别的文件，换之前把两个缓冲区都刷到原来的文件里，
+// 换完之后重新检查要不要缓冲；还没有报告的错误留到下一次write
+int outbuf_dup3(int oldfd, int newfd, int flags) {
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < 2; i++) outbuf_flush_locked(&outbufs[i]);
+    int ret = dup3(oldfd, newfd, flags);
+    int saved = errno;
+    int err[2] = { outbufs[0].error, outbufs[1].error };
+    outbuf_probe();
+    outbufs[0].error = err[0];
+    outbufs[1].error = err[1];
+    pthread_mutex_unlock(&lock);
+    errno = saved;
+    return ret;
+}
@@ -0,0 +1,66 @@
+#include <string.h>
+#include "rvemu.h"
+
+
+/*
+    void pagemap_add(pagemap_t *, u64, u32);
+    u32 *pagemap_take(pagemap_t *, u64, u32 *);
+    void pagemap_reset(pagemap_t *);
+
+*/
+
+
+static inline u64 hash(u64 page) {
+    return (page * 0x9e3779b97f4a7c15ULL) >> (64 - __builtin_ctzll(PAGEMAP_SIZE));
+}
+
+// 找到page的slot，没有的话create为true时新建一个，表装满一半之后不再新建，返回NULL
+static pagemap_slot_t *pagemap_slot(pagemap_t *map, u64 page, bool create) {
+    u64 key = page + 1;
+    u64 index = hash(key);
+    while(map->table[index].page != 0) {
+        if(map->table[index].page == key) return &map->table[index];
+        index = (index + 1) % PAGEMAP_SIZE;
+    }
+    if (!create) return NULL;
+    // 和set_t一样最多装一半
+    if (map->len >= PAGEMAP_SIZE / 2) {
+        map->overflow = true;
+        return NULL;
+    }
+    map->table[index].page = key;
+    map->len++;
+    return &map->table[index];
+}
+
+// 记下page这一页上有elem，已经有了就不再加
+void pagemap_add(pagemap_t *map, u64 page, u32 elem) {
+    pagemap_slot_t *slot = pagemap_slot(map, page, true);
+    if (slot == NULL) return;
+    for (u32 i = 0; i < slot->len; i++) {
+        if (slot->elems[i] == elem) return;
+    }
+    if (slot->len == slot->cap) {
+        slot->cap = slot->cap ? slot->cap * 2 : 8;
+        slot->elems = (u32 *)realloc(slot->elems, slot->cap * sizeof(u32));
+    }
+    slot->elems[slot->len++] = elem;
+}
+
+// 取出page这一页上的所有elem，同时把这一页清空，返回的数组在下一次pagemap_add之前有效
+// slot本身留着，同一页以后再有代码的时候接着用
+u32 *pagemap_take(pagemap_t *map, u64 page, u32 *len) {
+    pagemap_slot_t *slot = pagemap_slot(map, page, false);
+    if (slot == NULL) {
+        *len = 0;
+        return NULL;
+    }
+    *len = slot->len;
+    slot->len = 0;
+    return slot->elems;
+}
+
+void pagemap_reset(pagemap_t *map) {
+    for (u64 i = 0; i < PAGEMAP_SIZE; i++) free(map->table[i].elems);
+    memset(map, 0, sizeof(pagemap_t));
+}
@@ -12,30 +12,33 @@ int main(int argc, char *argv[]) {
   }
   assert(argc > 1);
 
+  // 检测host cpu的指令集扩展，解释器和jit都按照它选择生成的代码
+  cpu_detect();
+  interp_init();
+  stats_init();
+  // RVEMU_CPI: cycle计数器按照每条指令多少个周期计算
+  counter_init();
+
   machine_t machine = {0};
+  // mmu是所有guest线程共享的
+  machine.mmu = (mmu_t *)calloc(1, sizeof(mmu_t));
+  pthread_mutex_init(&machine.mmu->lock, NULL);
   // 在这儿初始化machine.cache，通过mmap分配给cache一大块内存，用作jit代码的cache
   machine.cache = new_cache();
+  // 设置了环境变量RVEMU_IOURING的话，guest的文件读写走io_uring
+  if (getenv("RVEMU_IOURING")) machine.ioring = ioring_new(IORING_ENTRIES);
+  // guest写stdout/stderr的合并缓冲区
+  outbuf_init();
+  // guest访存越界的时候报告guest的pc，要在outbuf_init之后
+  fault_init();
   
   // 加载elf可执行文件
   machine_load_program(&machine, argv[1]);
   // 初始化栈 32MB
   machine_setup(&machine, argc, argv);
 
-  // 执行指令
-  while(true){
-    enum exit_reason_t exit_reason = machine_step(&machine);
-    assert(exit_reason == ecall);
-    
-    // 发生syscall的时候，a7寄存器保存的就是syscall number
-    // a0-a6保存的就是syscall的参数
-    u64 syscall_num = machine_get_gp_reg(&machine, a7);
-    
-    // 用syscall_num查找syscall table，调用syscall的处理函数，最后得到返回值ret
-    u64 ret = do_syscall(&machine, syscall_num);
-    // 把syscall的返回值ret写入到a0寄存器，然后重新译码执行
-    machine_set_gp_reg(&machine, a0, ret);
-
-  }
+  // 执行指令，guest的主线程就跑在host的主线程上
+  machine_run(&machine);
 
   return 0;
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -33,12 +34,20 @@
 #define MIN(x, y) ((y) > (x) ? (x) : (y))
 #define MAX(x, y) ((y) < (x) ? (x) : (y))
 
+// guest的内存从host上一段保留的虚拟地址池里分配，每个guest占一个slot，
+// 同一个进程里可以同时放好几个guest，基地址在加载程序的时候才确定
+// slot里guest的窗口前后各有一段PROT_NONE的保护区，越界访问会触发SIGSEGV，访存不用检查边界
 #define GUEST_MEMORY_OFFSET 0x088800000000ULL
+#define GUEST_SLOT_SIZE     (1ULL << 36)
+#define GUEST_GUARD_SIZE    (1ULL << 36)
+#define GUEST_SLOT_STRIDE   (GUEST_SLOT_SIZE + 2 * GUEST_GUARD_SIZE)
+#define GUEST_SLOT_NUM      64
+#define GUEST_POOL_END      (GUEST_MEMORY_OFFSET + GUEST_SLOT_NUM * GUEST_SLOT_STRIDE)
 
 // riscv64 program -> local hosts
-#define TO_HOST(addr) (addr + GUEST_MEMORY_OFFSET)
+#define TO_HOST(base, addr) ((u64)(addr) + (base))
 // local host -> riscv64
-#define TO_GUEST(addr) (addr - GUEST_MEMORY_OFFSET)
+#define TO_GUEST(base, addr) ((u64)(addr) - (base))
 
 // instruction
 enum insn_type_t {
@@ -191,7 +200,117 @@ enum insn_type_t {
 /* 130 */   insn_fcvt_d_l,
 /* 131 */   insn_fcvt_d_lu,
 /* 132 */   insn_fmv_d_x,
-/* 133 */   num_insns,
+
+/* 133 */   insn_lr_w,
+/* 134 */   insn_sc_w,
+/* 135 */   insn_amoswap_w,
+/* 136 */   insn_amoadd_w,
+/* 137 */   insn_amoxor_w,
+/* 138 */   insn_amoand_w,
+/* 139 */   insn_amoor_w,
+/* 140 */   insn_amomin_w,
+/* 141 */   insn_amomax_w,
+/* 142 */   insn_amominu_w,
+/* 143 */   insn_amomaxu_w,
+
+/* 144 */   insn_lr_d,
+/* 145 */   insn_sc_d,
+/* 146 */   insn_amoswap_d,
+/* 147 */   insn_amoadd_d,
+/* 148 */   insn_amoxor_d,
+/* 149 */   insn_amoand_d,
+/* 150 */   insn_amoor_d,
+/* 151 */   insn_amomin_d,
+/* 152 */   insn_amomax_d,
+/* 153 */   insn_amominu_d,
+/* 154 */   insn_amomaxu_d,
+
+/* 155 */   insn_vsetvli,
+/* 156 */   insn_vsetivli,
+/* 157 */   insn_vsetvl,
+/* 158 */   insn_vload,
+/* 159 */   insn_vstore,
+/* 160 */   insn_vop,             // OP-V的运算指令，具体的操作由funct3、funct6决定
+
+/* 161 */   insn_sh1add,
+/* 162 */   insn_sh2add,
+/* 163 */   insn_sh3add,
+/* 164 */   insn_add_uw,
+/* 165 */   insn_sh1add_uw,
+/* 166 */   insn_sh2add_uw,
+/* 167 */   insn_sh3add_uw,
+/* 168 */   insn_slli_uw,
+
+/* 169 */   insn_andn,
+/* 170 */   insn_orn,
+/* 171 */   insn_xnor,
+/* 172 */   insn_clz,
+/* 173 */   insn_clzw,
+/* 174 */   insn_ctz,
+/* 175 */   insn_ctzw,
+/* 176 */   insn_cpop,
+/* 177 */   insn_cpopw,
+/* 178 */   insn_max,
+/* 179 */   insn_maxu,
+/* 180 */   insn_min,
+/* 181 */   insn_minu,
+/* 182 */   insn_sext_b,
+/* 183 */   insn_sext_h,
+/* 184 */   insn_zext_h,
+/* 185 */   insn_rol,
+/* 186 */   insn_rolw,
+/* 187 */   insn_ror,
+/* 188 */   insn_rori,
+/* 189 */   insn_roriw,
+/* 190 */   insn_rorw,
+/* 191 */   insn_orc_b,
+/* 192 */   insn_rev8,
+
+/* 193 */   insn_bclr,
+/* 194 */   insn_bclri,
+/* 195 */   insn_bext,
+/* 196 */   insn_bexti,
+/* 197 */   insn_binv,
+/* 198 */   insn_binvi,
+/* 199 */   insn_bset,
+/* 200 */   insn_bseti,
+
+/* 201 */   insn_flh,
+/* 202 */   insn_fsh,
+/* 203 */   insn_fmadd_h,
+/* 204 */   insn_fmsub_h,
+/* 205 */   insn_fnmsub_h,
+/* 206 */   insn_fnmadd_h,
+/* 207 */   insn_fadd_h,
+/* 208 */   insn_fsub_h,
+/* 209 */   insn_fmul_h,
+/* 210 */   insn_fdiv_h,
+/* 211 */   insn_fsqrt_h,
+/* 212 */   insn_fsgnj_h,
+/* 213 */   insn_fsgnjn_h,
+/* 214 */   insn_fsgnjx_h,
+/* 215 */   insn_fmin_h,
+/* 216 */   insn_fmax_h,
+/* 217 */   insn_fcvt_s_h,
+/* 218 */   insn_fcvt_h_s,
+/* 219 */   insn_fcvt_d_h,
+/* 220 */   insn_fcvt_h_d,
+/* 221 */   insn_feq_h,
+/* 222 */   insn_flt_h,
+/* 223 */   insn_fle_h,
+/* 224 */   insn_fclass_h,
+/* 225 */   insn_fcvt_w_h,
+/* 226 */   insn_fcvt_wu_h,
+/* 227 */   insn_fcvt_l_h,
+/* 228 */   insn_fcvt_lu_h,
+/* 229 */   insn_fcvt_h_w,
+/* 230 */   insn_fcvt_h_wu,
+/* 231 */   insn_fcvt_h_l,
+/* 232 */   insn_fcvt_h_lu,
+/* 233 */   insn_fmv_x_h,
+/* 234 */   insn_fmv_h_x,
+
+/* 235 */   num_insns,
 
 };
 
@@ -206,29 +325,48 @@ typedef struct {
   enum insn_type_t type;
   bool rvc;               // riscv compress riscsv压缩指令
   bool cont;              // 表示继续执行
+  bool aq;                // 原子指令的acquire位
+  bool rl;                // 原子指令的release位
+  u8 funct3;              // 向量指令：load/store的width，运算指令的操作数类型
+  u8 funct6;              // 向量指令：运算的种类，load/store的nf、mop
+  bool vm;                // 向量指令：为false的时候用v0作为mask
+  u8 rm;                  // 浮点指令的静态舍入模式，只有会舍入的指令才使用
 } insn_t;
 
 void insn_decode(insn_t *, u32);
 
 // mmu.c
+// mmu_t.code_pages里每一页的状态
+enum code_page_t {
+  page_none = 0,          // 没有映射(PROT_NONE)，比如0地址附近、段之间的空隙、栈的保护页、释放掉的内存
+  page_data,              // guest可写，上面没有翻译过的代码
+  page_readonly,          // guest本来就不能写，比如elf的代码段，翻译的时候什么都不用做
+  page_code,              // 上面有翻译过的代码，已经去掉了写权限，guest写的时候会触发SIGSEGV
+};
+
 typedef struct {
   u64 entry;
+  u64 guest_base;         // 这个guest的地址0在host上的地址，加载elf的时候从地址池里分配
   u64 host_alloc;
   u64 alloc;              // 指向的是进程动态分配的内存的一个地址
   u64 base;               // 指向的是ELF内容在内存中的占用
+  u8 *code_pages;         // guest窗口里每一页一个字节，enum code_page_t
+  pthread_mutex_t lock;   // 多个guest线程共享一个mmu，brk的时候要加锁
 } mmu_t;
 
 void mmu_load_elf(mmu_t *, int);
 u64 mmu_alloc(mmu_t *, i64);
+void mmu_protect_code(mmu_t *, u64);
+bool mmu_unprotect_code(mmu_t *, u64);
 
 // 向内存中写数据
-inline void mmu_write(u64 addr, u8 *data, size_t len) {
- memcpy((void*)TO_HOST(addr), (void*)data, len);
+inline void mmu_write(mmu_t *mmu, u64 addr, u8 *data, size_t len) {
+ memcpy((void*)TO_HOST(mmu->guest_base, addr), (void*)data, len);
 }
 
 
 // stack.c
-#define STACK_CAP 256
+#define STACK_CAP 1024
 typedef struct {
   i64 top;
   u64 elems[STACK_CAP];
@@ -270,6 +408,7 @@ inline size_t str_len(const str_t str) {
 void str_clear(str_t);
 
 str_t str_append(str_t, const char *);
+str_t str_appendn(str_t, const char *, size_t);
 
 
 
@@ -277,6 +416,7 @@ str_t str_append(str_t, const char *);
 #define SET_SIZE (32 * 1024)
 
 typedef struct {
+  u64 len;
   u64 table[SET_SIZE];
 } set_t;
 
@@ -285,6 +425,141 @@ bool set_add(set_t *, u64);
 void set_reset(set_t *);
 
 
+// pagemap.c
+// guest的页号 -> 这一页上有代码的表项下标，guest改写某一页的时候只要看这一页的表项
+// 页号上限是GUEST_SLOT_SIZE / page_size，用哈希表，只装有过代码的页
+#define PAGEMAP_SIZE (16 * 1024)
+
+typedef struct {
+  u64 page;               // 页号 + 1，0表示空的slot
+  u32 len, cap;
+  u32 *elems;             // 不重复
+} pagemap_slot_t;
+
+typedef struct {
+  u64 len;
+  bool overflow;          // 有的页没装进去，调用者要退回到扫描整个表
+  pagemap_slot_t table[PAGEMAP_SIZE];
+} pagemap_t;
+
+void pagemap_add(pagemap_t *, u64, u32);
+u32 *pagemap_take(pagemap_t *, u64, u32 *);
+void pagemap_reset(pagemap_t *);
+
+
+// cfg.c
+#define CFG_SIZE (64 * 1024)
+#define CFG_BLOCK_MAX 64              // 基本块最多这么多条指令，再长就从中间断开
+// 每个基本块最多往工作栈里放两个后继，块数限制在这里，栈就不会满
+#define REGION_MAX_BLOCKS ((STACK_CAP - 1) / 2)
+
+// 基本块：从pc开始一直到条件跳转或者不会顺序执行下去的指令
+typedef struct {
+  u64 pc;                 // key，基本块的第一条指令
+  u64 end;                // 最后一条指令的下一条，也就是顺序执行的后继
+  bool stale;             // guest改写过这里的代码，下次用的时候重新译码
+  u32 num_insns;
+  insn_t *insns;
+} cfg_block_t;
+
+// 区域里翻译了的指令和它们之间的边，machine_genblock一边翻译一边记下来，用来找循环
+#define REGION_MAX_INSNS (SET_SIZE / 2)
+typedef struct {
+  u64 pc;
+  u32 first_succ;         // 直接跳转的目标、顺序执行的后继，在graph->succs里从这里开始
+  u32 num_succ;
+  bool inner;             // 在某个循环里面，又不是这个循环的header
+  u64 loop;               // 包含它的最里层的循环的header，它自己是header的话就是它自己，不在循环里是0
+  u64 parent;             // 它是header的时候，外面一层循环的header，没有的话是0
+} cfg_node_t;
+
+// 每条指令最多一个顺序执行的后继，直接跳转的目标都要经过工作栈，不会超过STACK_CAP个
+#define REGION_MAX_SUCCS (REGION_MAX_INSNS + STACK_CAP)
+typedef struct {
+  u32 num_nodes;
+  u32 num_succs;
+  cfg_node_t nodes[REGION_MAX_INSNS];
+  u64 succs[REGION_MAX_SUCCS];
+} cfg_graph_t;
+
+// 边的执行次数，按pc直接映射，冲突了就覆盖掉，只是用来估计哪边冷，不要求准确
+// 每个guest线程一份，解释器更新的时候不会和别的线程抢同一条cache line
+// 冲突会把计数清零，所以根据计数做出的、以后不能再反悔的决定记在cfg_t里
+#define PROFILE_SIZE (64 * 1024)
+typedef struct {
+  u64 pc;
+  u32 taken;              // 解释器执行pc处的条件跳转，跳走的次数
+  u32 not_taken;          // 顺序执行下去的次数
+  u32 side_exits;         // jit的代码从冷的出口退出到pc的次数
+  u32 deopts;             // 推测pc处的jalr跳到target，结果不是，退回解释器的次数
+  u64 target;             // 解释器执行pc处的jalr，上一次跳到的地址
+  u32 target_hits;        // 跳到的地址和上一次一样的次数
+  u32 target_misses;      // 和上一次不一样的次数
+} profile_t;
+
+inline profile_t *profile_of(profile_t *profile, u64 pc) {
+  profile_t *p = &profile[(pc >> 1) % PROFILE_SIZE];
+  if (p->pc != pc) *p = (profile_t){ .pc = pc };
+  return p;
+}
+
+// 译码过的基本块，所有区域共用，由cache->lock保护
+typedef struct {
+  u64 max_insns;          // 一个区域最多翻译多少条指令
+  u64 max_source;         // 一个区域生成的C代码最多多少字节，近似clang编译的开销
+  set_t hot_exits;        // 退出次数到过SIDE_EXIT_HOT的出口，再编译的时候不再当成冷的
+  set_t no_speculate;     // 推测失败次数到过DEOPT_LIMIT的jalr，以后都不再推测
+  cfg_block_t scratch;    // 表满了的时候用，不缓存
+  pagemap_t pages;        // 每一页上有哪些基本块(table的下标)，cfg_invalidate用
+  cfg_block_t table[CFG_SIZE];
+} cfg_t;
+
+cfg_t *cfg_new();
+cfg_block_t *cfg_block(cfg_t *, mmu_t *, u64);
+void cfg_invalidate(cfg_t *, u64, u64);
+u32 cfg_taken_percent(profile_t *, u64);
+bool cfg_edge_cold(cfg_t *, profile_t *, u64, bool, u64);
+bool cfg_side_exit(profile_t *, u64);
+void cfg_hot_exit(cfg_t *, u64);
+u64 cfg_jalr_target(cfg_t *, profile_t *, u64);
+#define JUMP_TABLE_MAX 256
+u32 cfg_jump_table(mmu_t *, cfg_block_t *, u64 *);
+
+// 一个字节一个字节拷贝、填充、扫描的循环，整个循环换成一次host的memmove/memset/strlen/memchr
+enum idiom_kind_t {
+  idiom_none,
+  idiom_copy,             // 从src读一个字节写到dst
+  idiom_fill,             // 把val的低8位写到dst
+  idiom_scan,             // 从src读一个字节，直到它是0或者等于end
+};
+
+enum idiom_cond_t {
+  cond_counter,           // 计数器减到0
+  cond_ne,                // 指针ptr等于end
+  cond_lt,                // 指针ptr不小于end(无符号)
+  cond_zero,              // 读出来的字节是0
+  cond_chr,               // 读出来的字节等于end
+};
+
+typedef struct {
+  enum idiom_kind_t kind;
+  enum idiom_cond_t cond;
+  u32 num_insns;          // 循环一次执行的指令数，包括最后的条件跳转
+  u8 src, dst;            // 每次加1的指针，第k次读写的地址是src + k + src_off
+  i64 src_off, dst_off;
+  u8 val;                 // copy、scan：读出来的字节放在这里；fill：写的值，循环里不变
+  bool sign;              // 读字节用的是lb
+  u8 counter;             // cond_counter：每次减1的寄存器
+  u8 ptr, end;            // cond_ne、cond_lt：比较的指针和不变的边界；cond_chr：end里是要找的字节
+} idiom_t;
+
+bool cfg_idiom(cfg_block_t *, idiom_t *);
+bool cfg_deopt(profile_t *, u64);
+void cfg_no_speculate(cfg_t *, u64);
+cfg_node_t *cfg_node(cfg_graph_t *, u64);
+u64 cfg_find_loops(cfg_graph_t *, u64);
+
+
 // cache.c
 #define CACHE_ENTRY_SIZE  (64 * 1024)
 #define CACHE_SIZE (64 * 1024 * 1024)
@@ -294,6 +569,8 @@ typedef struct {
   u64 pc;       // key
   u64 hot;      // hot计数器，记录pc指针指向的这段代码的hot程度
   u64 offset;   // value, indicate therr offset in jitcode cache
+  u64 lo, hi;   // 这段代码翻译的guest指令所在的地址范围[lo, hi)，guest改写代码的时候用
+  u64 recompiles; // 从这个入口进来的区域重新编译过几次
 } cache_item_t;
 
 
@@ -301,14 +578,97 @@ typedef struct {
 typedef struct {
   u8 *jitcode;    // reserved memory for jit cache
   u64 offset;     // the real used jitcode memory
+  bool full;      // jitcode用完了，之后不再编译，全部解释执行
+  pthread_mutex_t lock;   // 多个guest线程共享一个cache，生成、编译、发布和作废代码的时候要加锁，hot计数不用
+  cfg_t *cfg;             // 区域的控制流图用到的基本块，编译不同的区域的时候共用
+  pagemap_t pages;        // 每一页上有哪些入口的代码(table的下标)，cache_invalidate用
   cache_item_t table[CACHE_ENTRY_SIZE];
 } cache_t;
 
 
+// 一次编译的区域：从一个hot的pc出发能走到的所有指令
+// 区域里直接跳转的目标都是入口，编译一次，每个入口都登记到cache里，指向同一段代码
+#define REGION_MAX_ENTRIES 128
+typedef struct {
+  u64 lo, hi;                       // 翻译的guest指令所在的地址范围[lo, hi)
+  u64 num_loops;
+  u64 num_entries;
+  u64 entries[REGION_MAX_ENTRIES];  // entries[0]是开始编译的那个hot的pc
+} region_t;
+
 cache_t *new_cache();
 u8 *cache_lookup(cache_t *, u64);
-u8 *cache_add(cache_t *, u64, u8 *, size_t, u64);
+u8 *cache_alloc(cache_t *, u8 *, size_t, u64);
+void cache_publish(cache_t *, mmu_t *, region_t *, u8 *);
 bool cache_hot(cache_t *, u64);
+u64 cache_lookup_host(cache_t *, u8 *);
+void cache_invalidate(cache_t *, u64, u64);
+bool cache_recompile(cache_t *, u64);
+void cache_flush(cache_t *);
+
+
+// ioring.c
+#define IORING_ENTRIES 64
+#define IORING_STAGE_SIZE (256 * 1024)  // 攒着的write的数据拷贝在这里
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// 可选的io_uring后端，机器持有一个ring，guest的文件读写通过它提交
+typedef struct {
+  int fd;
+  u32 *sq_head;
+  u32 *sq_tail;
+  u32 *sq_mask;
+  u32 *sq_array;
+  struct io_uring_sqe *sqes;
+  u32 *cq_head;
+  u32 *cq_tail;
+  u32 *cq_mask;
+  struct io_uring_cqe *cqes;
+  u8 *sq_ring;                    // 三段映射，ioring_free的时候unmap
+  u8 *cq_ring;
+  size_t sq_ring_sz;
+  size_t cq_ring_sz;
+  size_t sqes_sz;
+  u32 entries;
+  u32 queued;                     // 填好了但是还没提交的sqe
+  u8 *stage;                      // 攒着的write的数据
+  u32 staged;
+  int error;                      // 攒着的write失败的errno和fd，下一次用这个fd的时候返回
+  int error_fd;
+} ioring_t;
+
+ioring_t *ioring_new(u32);
+void ioring_free(ioring_t *);
+i64 ioring_read(ioring_t *, int, void *, size_t, i64);
+i64 ioring_write(ioring_t *, int, void *, size_t, i64);
+void ioring_flush(ioring_t *);
+int ioring_take_error(ioring_t *, int);
+void ioring_on_exit();
+
+
+// outbuf.c
+#define OUTBUF_SIZE (64 * 1024)
+#define OUTBUF_LATENCY_NS (20 * 1000 * 1000)    // 20ms
+
+// host的stdout/stderr对应的输出缓冲区
+typedef struct {
+  int fd;
+  bool enabled;           // 终端不做缓冲
+  u64 len;
+  u64 since;              // 缓冲区里最早的数据写入的时间
+  int error;              // 刷新的时候write失败的errno，还没有返回给guest
+  u8 buf[OUTBUF_SIZE];
+} outbuf_t;
+
+void outbuf_init();
+bool outbuf_enabled(int);
+i64 outbuf_write(int, void *, size_t);
+int outbuf_flush(int);
+void outbuf_flush_all();
+int outbuf_dup3(int, int, int);
+void outbuf_on_signal(int);
 
 
 // state.c
@@ -321,6 +681,21 @@ enum exit_reason_t {
   indirect_branch,        // 运行时知道的跳转
   interp,                 // jit缓存的一小块代码运行结束之后的exit_reason
   ecall,                  // syscall
+  side_exit,              // jit的代码走到了编译的时候认为很冷、没有翻译的路径，交给解释器
+  deopt,                  // 推测的jalr目标不对，从真正的目标开始交给解释器
+};
+
+// 向量寄存器的位宽
+#define VLEN 128
+#define VLENB (VLEN / 8)
+
+#define VTYPE_LMUL(vtype) ((vtype) & 0x7)
+#define VTYPE_SEW(vtype)  (((vtype) >> 3) & 0x7)        // 0: e8, 1: e16, 2: e32, 3: e64
+#define VTYPE_VILL (1ULL << 63)
+
+// OP-V指令的funct3，表示操作数的类型
+enum vop_type_t {
+  OPIVV, OPFVV, OPMVV, OPIVI, OPIVX, OPFVF, OPMVX, OPCFG,
 };
 
 // csr寄存器
@@ -328,6 +703,26 @@ enum csr_t {
   fflags = 0x001,
   frm    = 0x002,
   fcsr   = 0x003,
+  // 用户态只读的计数器，time会和libc的time()重名，所以都加上前缀
+  csr_cycle         = 0xc00,
+  csr_time          = 0xc01,
+  csr_instret       = 0xc02,
+  csr_hpmcounter3   = 0xc03,
+  csr_hpmcounter31  = 0xc1f,
+};
+
+// fcsr的布局：[4:0]是fflags，[7:5]是frm
+#define FFLAGS_NX 0x01          // inexact
+#define FFLAGS_UF 0x02          // underflow
+#define FFLAGS_OF 0x04          // overflow
+#define FFLAGS_DZ 0x08          // divide by zero
+#define FFLAGS_NV 0x10          // invalid operation
+#define FFLAGS_MASK 0x1f
+#define FCSR_FRM(fcsr) (((fcsr) >> 5) & 0x7)
+
+// 舍入模式，DYN只能出现在指令里，表示使用frm
+enum frm_t {
+  FRM_RNE, FRM_RTZ, FRM_RDN, FRM_RUP, FRM_RMM, FRM_DYN = 7,
 };
 
 typedef struct {
@@ -336,13 +731,28 @@ typedef struct {
   u64 gp_regs[num_gp_regs];          // general propose
   fp_reg_t fp_regs[num_fp_regs];     // float register
   u64 pc;                            // pc pointer
+  u64 reserve_addr;                  // lr设置的reservation，0表示没有
+  u64 reserve_val;                   // lr读到的值，sc用它做cas
+  u64 vl;                            // 向量长度
+  u64 vtype;
+  u8 vregs[32][VLENB];               // 向量寄存器
+  u32 fcsr;                          // host的MXCSR里还没有收集的异常标志不在这里
+  u64 instret;                       // 已经执行完的指令数，解释器和jit的代码都是在退出的时候才加上去
+  u64 guest_base;                    // guest地址0对应的host地址，解释器和jit生成的代码都用它访存
+  u64 deopt_pc;                      // exit_reason是deopt的时候，推测失败的jalr
+  u64 host_call_pc;                  // jit的代码正在调用host的函数替换这个pc开始的循环，不是的时候是0
+  profile_t *profile;                // 解释器统计跳转的方向和目标，每个guest线程一份
 } state_t;
 
 // machine.c
+// 每个guest线程对应一个machine_t，有自己的state，mmu和cache是所有线程共享的
 typedef struct {
   state_t state;
-  mmu_t mmu;
+  mmu_t *mmu;
   cache_t *cache;
+  ioring_t *ioring;       // 为NULL的时候文件读写直接调用host的syscall
+  u64 clear_child_tid;    // 线程退出的时候把这个地址清零，然后futex唤醒
+  bool cloned;            // machine_clone分配的，线程退出的时候释放
 } machine_t;
 
 // 定义一个同一个模拟器执行函数
@@ -353,8 +763,13 @@ typedef void (*exec_block_func_t)(state_t *);
 enum exit_reason_t machine_step(machine_t *);
 void machine_load_program(machine_t *, char *);
 void machine_setup(machine_t *, int, char **);
+void machine_run(machine_t *);
+i64 machine_clone(machine_t *, u64, u64, u64, u64, u64);
+void machine_exit_thread(machine_t *, int);
+void machine_invalidate(machine_t *, u64, u64);
+bool machine_threaded();
 // jit about func
-str_t machine_genblock(machine_t *);
+str_t machine_genblock(machine_t *, region_t *);
 u8 *machine_compile(machine_t *, str_t);
 
 
@@ -374,6 +789,92 @@ inline void machine_set_gp_reg(machine_t * machine, i32 reg, u64 data) {
 
 // interpret.c 
 void exec_block_interp(state_t *);
+void interp_init();
+
+
+// vector.c
+u64 vector_vlmax(u64);
+u64 vector_setvl(state_t *, u64, u64);
+void vector_load(state_t *, insn_t *);
+void vector_store(state_t *, insn_t *);
+void vector_op(state_t *, insn_t *);
+
+
+// fpu.c
+void fpu_set_host_rm(u32);
+void fpu_collect_flags(state_t *);
+void fpu_clear_host_flags();
+u64 fpu_read_csr(state_t *, u16);
+void fpu_write_csr(state_t *, u16, u64);
+i64 fpu_to_int(state_t *, f64, u32, i64, i64);
+u64 fpu_to_uint(state_t *, f64, u32, u64);
+f32 fpu_f16_to_f32(u16);
+u16 fpu_f32_to_f16(f32);
+u16 fpu_f64_to_f16(f64);
+u16 fpu_f16_fma(f32, f32, f32);
+
+
+// cpu.c
+enum cpu_feature_t {
+  CPU_POPCNT = 1 << 0,
+  CPU_LZCNT  = 1 << 1,
+  CPU_BMI    = 1 << 2,
+  CPU_BMI2   = 1 << 3,
+  CPU_FMA    = 1 << 4,
+  CPU_AVX2   = 1 << 5,
+  CPU_AVX512 = 1 << 6,    // F、DQ、BW、VL都有的时候才算
+  CPU_F16C   = 1 << 7,
+};
+
+extern u32 cpu_features;
+
+void cpu_detect();
+const char *cpu_clang_flags();
+const char *cpu_describe();
+
+inline bool cpu_has(u32 features) {
+  return (cpu_features & features) == features;
+}
+
+
+// stats.c
+// 设置了环境变量RVEMU_STATS的时候，退出的时候把统计信息打印到stderr
+typedef struct {
+  bool enabled;
+  u64 blocks_compiled;    // jit编译的代码块
+  u64 jit_entries;        // 从machine_step进入jit代码的次数
+  u64 interp_entries;     // 从machine_step进入解释器的次数
+  u64 region_entries;     // 编译出来的代码一共登记了多少个入口
+  u64 compile_ns;         // 生成代码和调用clang编译花的时间
+  u64 code_bytes;         // jit cache里用掉的字节数
+  u64 side_exits;         // 从冷的路径退出到解释器的次数
+  u64 recompiles;         // 冷的出口变热或者推测失败太多，重新编译的区域
+  u64 deopts;             // 推测的jalr目标不对，退回解释器的次数
+  u64 loops;              // 编译出来的区域里有多少个自然循环
+  u64 cache_flushes;      // jitcode用完了，丢掉所有代码从头开始的次数
+} stats_t;
+
+extern stats_t stats;
+
+#define STATS_ADD(field, n)                                        \
+  do {                                                             \
+    if (stats.enabled)                                             \
+      __atomic_add_fetch(&stats.field, (n), __ATOMIC_RELAXED);     \
+  } while (0)
+#define STATS_INC(field) STATS_ADD(field, 1)
+
+void stats_init();
+u64 stats_now_ns();
+
+
+// counter.c
+void counter_init();
+u64 counter_read_csr(state_t *, u16);
+
+
+// fault.c
+void fault_init();
+void fault_enter(machine_t *);
 
 
 // syscall.c
@@ -388,5 +889,8 @@ u32 fsgnj32(u32 a, u32 b, bool n, bool x);
 u64 fsgnj64(u64 a, u64 b, bool n, bool x);
 u16 f32_classify(f32 a);
 u16 f64_classify(f64 a);
+f32 fminmax32(f32 a, f32 b, bool max, u32 *fcsr);
+f64 fminmax64(f64 a, f64 b, bool max, u32 *fcsr);
+u16 f16_classify(u16 a);
 
 #endif
\ No newline at end of file
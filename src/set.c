@@ -10,8 +10,9 @@
 */ 
 
 
+// pc都是2或者4字节对齐的，直接取模会挤在一起，乘一个奇数再取高位打散
 static inline u64 hash(u64 elem) {
-    return elem % SET_SIZE;
+    return (elem * 0x9e3779b97f4a7c15ULL) >> (64 - __builtin_ctzll(SET_SIZE));
 }
 
 bool set_has(set_t *set, u64 elem) {
@@ -21,27 +22,24 @@ bool set_has(set_t *set, u64 elem) {
 
     while(set->table[index] != 0) {
         if(set->table[index] == elem) return true;
+        index = (index + 1) % SET_SIZE;
     }
     return false;
 }
 
-#define MAX_SEARCH_COUNT 32
-
 bool set_add(set_t *set, u64 elem) {
     assert(elem != 0);
+    // 最多装一半，线性探测不会太长，也一定能找到空位
+    assert(set->len < SET_SIZE / 2);
 
     u64 index = hash(elem);
-    u64 search_count = 0;
     while(set->table[index] != 0) {
         if(set->table[index] == elem) return false;
-
-        index++;
-        index = hash(index);
-
-        assert(++search_count <= MAX_SEARCH_COUNT);
+        index = (index + 1) % SET_SIZE;
     }
 
     set->table[index] = elem;
+    set->len++;
     return true;
 }
 
@@ -10,12 +10,9 @@
 
 */
 
+// 不去重，重复的元素由调用者出栈的时候跳过
 void stack_push(stack_t *stack, u64 elem) {
     assert(stack->top < STACK_CAP);
-
-    for(int i = 0; i < stack->top; i++) {
-        if(stack->elems[i] == elem) return;
-    }
     stack->elems[stack->top++] = elem;
 }
 
@@ -0,0 +1,35 @@
+#include "rvemu.h"
+
+//
+// 运行统计，用RVEMU_STATS打开，进程退出的时候打印到stderr
+// 带上host的cpu扩展，不同机器上的结果才能对比
+//
+
+stats_t stats = {0};
+
+static void stats_print() {
+    fprintf(stderr, "[stats] host cpu:        %s\n", cpu_describe());
+    fprintf(stderr, "[stats] blocks compiled: %lu\n", stats.blocks_compiled);
+    fprintf(stderr, "[stats] jit entries:     %lu\n", stats.jit_entries);
+    fprintf(stderr, "[stats] interp entries:  %lu\n", stats.interp_entries);
+    fprintf(stderr, "[stats] region entries:  %lu\n", stats.region_entries);
+    fprintf(stderr, "[stats] loops:           %lu\n", stats.loops);
+    fprintf(stderr, "[stats] compile time:    %.3f ms\n", stats.compile_ns / 1e6);
+    fprintf(stderr, "[stats] code bytes:      %lu\n", stats.code_bytes);
+    fprintf(stderr, "[stats] side exits:      %lu\n", stats.side_exits);
+    fprintf(stderr, "[stats] deopts:          %lu\n", stats.deopts);
+    fprintf(stderr, "[stats] recompiles:      %lu\n", stats.recompiles);
+    fprintf(stderr, "[stats] cache flushes:   %lu\n", stats.cache_flushes);
+}
+
+u64 stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_init() {
+    if (!getenv("RVEMU_STATS")) return;
+    stats.enabled = true;
+    atexit(stats_print);
+}
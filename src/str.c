@@ -35,7 +35,11 @@ static inline void str_setlen(str_t str, size_t newlen) {
 }
 
 str_t str_append(str_t str, const char *t) {
-    size_t len = strlen(t);
+    return str_appendn(str, t, strlen(t));
+}
+
+// 只接上t的前len个字节，t不用以0结尾
+str_t str_appendn(str_t str, const char *t, size_t len) {
     str = str_make_room(str, len);
     size_t curlen = str_len(str);
     memcpy(str + curlen, t, len);
@@ -1,3 +1,9 @@
+#include <asm/unistd.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
 #include "rvemu.h"
 
 
@@ -20,6 +26,8 @@
 #define SYS_chdir            49
 #define SYS_getcwd           17
 #define SYS_fstat            80
+#define SYS_fsync            82
+#define SYS_fdatasync        83
 #define SYS_fstatat          79
 #define SYS_faccessat        48
 #define SYS_pread            67
@@ -57,6 +65,28 @@
 #define SYS_set_robust_list  99
 #define SYS_madvise         233
 #define SYS_statx           291
+#define SYS_epoll_create1    20
+#define SYS_epoll_ctl        21
+#define SYS_epoll_pwait      22
+#define SYS_ppoll            73
+#define SYS_socket          198
+#define SYS_socketpair      199
+#define SYS_bind            200
+#define SYS_listen          201
+#define SYS_accept          202
+#define SYS_connect         203
+#define SYS_getsockname     204
+#define SYS_getpeername     205
+#define SYS_sendto          206
+#define SYS_recvfrom        207
+#define SYS_setsockopt      208
+#define SYS_getsockopt      209
+#define SYS_shutdown        210
+#define SYS_sendmsg         211
+#define SYS_recvmsg         212
+#define SYS_accept4         242
+#define SYS_clone           220
+#define SYS_futex            98
 
 #define OLD_SYSCALL_THRESHOLD 1024
 #define SYS_open              1024
@@ -75,6 +105,32 @@
 // syscall 处理函数，函数指针
 typedef u64 (*syscall_t)(machine_t *);
 
+// guest看到的是内核的约定：失败的时候返回-errno，所有的处理函数都要这样返回
+// host的库函数失败的时候返回-1并设置errno，用这个函数转换
+static u64 host_ret(i64 ret) {
+    return ret < 0 ? (u64)-errno : (u64)ret;
+}
+
+// guest的NULL指针在host上也要是NULL
+static void *guest_ptr(machine_t *m, u64 addr) {
+    return addr ? (void *)TO_HOST(m->state.guest_base, addr) : NULL;
+}
+
+// 内核要写的guest内存都要经过这里：上面有翻译过的代码的话先作废，恢复写权限，
+// 否则host的syscall会返回EFAULT而不是触发SIGSEGV，而且改写的代码不会重新翻译
+static void *guest_out(machine_t *m, u64 addr, u64 len) {
+    if (addr == 0) return NULL;
+    machine_invalidate(m, addr, len);
+    return (void *)TO_HOST(m->state.guest_base, addr);
+}
+
+// addr、addrlen这种out参数，addr的长度是guest在*addrlen里给的
+static socklen_t *guest_socklen(machine_t *m, u64 addr, u64 addrlen) {
+    socklen_t *len = (socklen_t *)guest_out(m, addrlen, sizeof(socklen_t));
+    if (len != NULL) guest_out(m, addr, *len);
+    return len;
+}
+
 // 未实现的syscall处理函数
 static u64 sys_unimplemented(machine_t *m) {
     fatalf("unimplemented syscall, syscall_id = %ld", machine_get_gp_reg(m, a7));
@@ -87,7 +143,7 @@ static u64 sys_fstat(machine_t *m) {
     u64 addr = machine_get_gp_reg(m, a1);
 
     // 返回x86架构下的相同的syscall结果
-    return fstat((int)fd, (struct stat *)TO_HOST(addr));
+    return host_ret(fstat((int)fd, (struct stat *)guest_out(m, addr, sizeof(struct stat))));
 }
 
 // 214: int brk(void *addr);
@@ -96,15 +152,24 @@ static u64 sys_brk(machine_t *m) {
     // `int brk(void *addr)` 只有一个参数addr
     u64 addr = machine_get_gp_reg(m, a0);
     // 如果addr大于alloc，进行上取整，然后mmap，更新mmu.alloc
-    if(addr == 0) return m->mmu.alloc;
+    // mmu是所有guest线程共享的
+    pthread_mutex_lock(&m->mmu->lock);
+    if(addr == 0) {
+        addr = m->mmu->alloc;
+        pthread_mutex_unlock(&m->mmu->lock);
+        return addr;
+    }
     // 重新设定的mmu.alloc不能小于base，否则就是侵占了进程代码区域的内存了
-    assert(addr > m->mmu.base);
+    assert(addr > m->mmu->base);
     // 计算当前进程使用的内存地址大小和addr的差值
-    i64 sz = (i64)addr - m->mmu.alloc;
+    i64 sz = (i64)addr - m->mmu->alloc;
+    // 释放掉的页上可能有翻译过的代码，以后重新分配出来的时候是新的内容
+    if (sz < 0) machine_invalidate(m, addr, -sz);
     // 然后调用mmu_alloc，如果增加内存就继续在mmu.alloc后面mmap增加内存
     // 如果sz<0，就在把mmu.alloc-sz到mmu.alloc这段内存给munmap
     // 最后重新设置mmu.alloc
-    mmu_alloc(&m->mmu, sz);
+    mmu_alloc(m->mmu, sz);
+    pthread_mutex_unlock(&m->mmu->lock);
     return addr;
 }
 
@@ -113,22 +178,46 @@ static u64 sys_write(machine_t *m) {
     u64 fd = machine_get_gp_reg(m, a0);
     u64 buf = machine_get_gp_reg(m, a1);
     u64 count = machine_get_gp_reg(m, a2);
+    // stdout/stderr先写入模拟器的缓冲区，攒起来再一起写
+    // 之前刷新的时候写失败了，错误在这一次write返回
+    if (outbuf_enabled(fd)) return host_ret(outbuf_write(fd, (char *)TO_HOST(m->state.guest_base, buf), (size_t)count));
+    // off = -1 表示使用当前的文件偏移
+    if (m->ioring) return host_ret(ioring_write(m->ioring, fd, (char *)TO_HOST(m->state.guest_base, buf), (size_t)count, -1));
     // 调用host的syscall API
-    return write(fd, (char *)TO_HOST(buf), (size_t)count);
+    return host_ret(write(fd, (char *)TO_HOST(m->state.guest_base, buf), (size_t)count));
+}
+
+// 攒在ring里的write在fd上失败过的话返回-errno，没有的话返回0
+static i64 ring_error(machine_t *m, u64 fd) {
+    return m->ioring ? -ioring_take_error(m->ioring, (int)fd) : 0;
 }
 
 // 57:
 static u64 sys_close(machine_t *m) {
     u64 fd = machine_get_gp_reg(m, a0);
     // 调用host的close函数，如果要关闭0，1，2直接返回0，因为这三个fd是host使用的
-    if (fd > 2) return close(fd);
-    return 0;
+    // 之前攒着的write失败了的话fd照样关掉，错误在这里返回
+    if (fd > 2) {
+        i64 err = ring_error(m, fd);
+        int ret = close(fd);
+        return err ? (u64)err : host_ret(ret);
+    }
+    // 但是guest认为stdout/stderr已经关掉了，缓冲区里的内容要先写出去，写失败的错误在这里返回
+    return host_ret(outbuf_flush(fd));
 }
 
-// 93: 
+// 93: 只结束当前的guest线程，最后一个线程exit的时候进程退出
 static u64 sys_exit(machine_t *m) {
     u64 status = machine_get_gp_reg(m, a0);
-    // 
+    machine_exit_thread(m, (int)status);
+    return 0;
+}
+
+// 94: 结束所有的guest线程
+static u64 sys_exit_group(machine_t *m) {
+    u64 status = machine_get_gp_reg(m, a0);
+    // 退出之前把stdout/stderr缓冲区中的内容写出去
+    outbuf_flush_all();
     exit(status);
 }
 
@@ -152,7 +241,8 @@ static u64 sys_tgkill(machine_t *m) {
     u64 tgid = machine_get_gp_reg(m, a0);
     u64 tid = machine_get_gp_reg(m, a1);
     u64 sig = machine_get_gp_reg(m, a2);
-    return syscall(SYS_tgkill, tgid, tid, sig);
+    // SYS_tgkill是riscv的syscall号，host上要用__NR_tgkill
+    return host_ret(syscall(__NR_tgkill, tgid, tid, sig));
 }
 
 // 63
@@ -161,8 +251,38 @@ static u64 sys_read(machine_t *m) {
     u64 fd = machine_get_gp_reg(m, a0);
     u64 buf = machine_get_gp_reg(m, a1);
     u64 count = machine_get_gp_reg(m, a2);
+    // 读stdin之前先把输出刷掉，交互式的提示信息才能先显示出来
+    if (fd == STDIN_FILENO) outbuf_flush_all();
+    void *host = guest_out(m, buf, count);
+    if (m->ioring) return host_ret(ioring_read(m->ioring, fd, host, (size_t)count, -1));
     // 直接调用host的read这个syscall
-    return read((int)fd, (void *)TO_HOST(buf), (size_t)count);
+    return host_ret(read((int)fd, host, (size_t)count));
+}
+
+// 67
+static u64 sys_pread(machine_t *m) {
+    // `ssize_t pread(int fd, void *buf, size_t count, off_t offset)`
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 buf = machine_get_gp_reg(m, a1);
+    u64 count = machine_get_gp_reg(m, a2);
+    u64 offset = machine_get_gp_reg(m, a3);
+    // 负的offset在ring里是"用当前的文件偏移"，要和pread一样返回EINVAL
+    if ((i64)offset < 0) return -EINVAL;
+    void *host = guest_out(m, buf, count);
+    if (m->ioring) return host_ret(ioring_read(m->ioring, fd, host, (size_t)count, offset));
+    return host_ret(pread((int)fd, host, (size_t)count, (off_t)offset));
+}
+
+// 68
+static u64 sys_pwrite(machine_t *m) {
+    // `ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)`
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 buf = machine_get_gp_reg(m, a1);
+    u64 count = machine_get_gp_reg(m, a2);
+    u64 offset = machine_get_gp_reg(m, a3);
+    if ((i64)offset < 0) return -EINVAL;
+    if (m->ioring) return host_ret(ioring_write(m->ioring, fd, (void *)TO_HOST(m->state.guest_base, buf), (size_t)count, offset));
+    return host_ret(pwrite((int)fd, (void *)TO_HOST(m->state.guest_base, buf), (size_t)count, (off_t)offset));
 }
 
 
@@ -193,7 +313,7 @@ static u64 sys_openat(machine_t *m) {
     u64 pathname = machine_get_gp_reg(m, a1);
     u64 flags = machine_get_gp_reg(m, a2);
     u64 mode = machine_get_gp_reg(m, a3);
-    return openat((int)dirfd, (char *)TO_HOST(pathname), convert_flags(flags), (mode_t)mode);
+    return host_ret(openat((int)dirfd, (char *)TO_HOST(m->state.guest_base, pathname), convert_flags(flags), (mode_t)mode));
 }
 
 // 62: 
@@ -203,7 +323,25 @@ static u64 sys_lseek(machine_t *m) {
     u64 offset = machine_get_gp_reg(m, a1);
     u64 whence = machine_get_gp_reg(m, a2);
     // 
-    return lseek((int)fd, (__off_t)offset, (int)whence);
+    return host_ret(lseek((int)fd, (__off_t)offset, (int)whence));
+}
+
+// 82: `int fsync(int fd)`
+static u64 sys_fsync(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    if (outbuf_flush(fd) < 0) return host_ret(-1);
+    i64 err = ring_error(m, fd);
+    if (err) return err;
+    return host_ret(fsync((int)fd));
+}
+
+// 83: `int fdatasync(int fd)`
+static u64 sys_fdatasync(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    if (outbuf_flush(fd) < 0) return host_ret(-1);
+    i64 err = ring_error(m, fd);
+    if (err) return err;
+    return host_ret(fdatasync((int)fd));
 }
 
 // 37
@@ -216,7 +354,7 @@ static u64 sys_linkat(machine_t *m) {
     u64 to = machine_get_gp_reg(m, a3);
     u64 flags = machine_get_gp_reg(m, a4);
     // 
-    return linkat(fromfd, (char *)TO_HOST(from), tofd, (char *)TO_HOST(to), flags);
+    return host_ret(linkat(fromfd, (char *)TO_HOST(m->state.guest_base, from), tofd, (char *)TO_HOST(m->state.guest_base, to), flags));
 }
 
 
@@ -227,7 +365,7 @@ static u64 sys_unlinkat(machine_t *m) {
     u64 name = machine_get_gp_reg(m, a1);
     u64 flag = machine_get_gp_reg(m, a2);
     // 
-    return unlinkat(fd, (char *)TO_HOST(name), flag);
+    return host_ret(unlinkat(fd, (char *)TO_HOST(m->state.guest_base, name), flag));
 }
 
 
@@ -236,11 +374,354 @@ static u64 sys_gettimeofday(machine_t *m) {
     // int gettimeofday(struct timeval *tv, struct timezone *tz);
     u64 tv_addr = machine_get_gp_reg(m, a0);
     u64 tz_addr = machine_get_gp_reg(m, a1);
-    struct timeval * tv = (struct timeval*)TO_HOST(tv_addr);
-    struct timezone *tz = NULL;
-    if(tz_addr != 0) tz = (struct timezone *)TO_HOST(tz_addr);
+    struct timeval *tv = (struct timeval *)guest_out(m, tv_addr, sizeof(struct timeval));
+    struct timezone *tz = (struct timezone *)guest_out(m, tz_addr, sizeof(struct timezone));
     //
-    return gettimeofday(tv, tz);
+    return host_ret(gettimeofday(tv, tz));
+}
+
+// 
+// socket和epoll相关的syscall，直接转发给host
+// 这些syscall按照linux的约定，失败的时候返回-errno，
+// guest是非阻塞的server的时候，要靠errno区分EAGAIN
+// 
+
+// 23: `int dup(int oldfd)`
+static u64 sys_dup(machine_t *m) {
+    u64 oldfd = machine_get_gp_reg(m, a0);
+    return host_ret(dup((int)oldfd));
+}
+
+// 24: `int dup3(int oldfd, int newfd, int flags)`，riscv没有dup2，libc的dup2也走这里
+static u64 sys_dup3(machine_t *m) {
+    u64 oldfd = machine_get_gp_reg(m, a0);
+    u64 newfd = machine_get_gp_reg(m, a1);
+    u64 flags = machine_get_gp_reg(m, a2);
+    // 换掉stdout/stderr之前，缓冲区里的内容要写到原来的文件里
+    if (newfd == STDOUT_FILENO || newfd == STDERR_FILENO)
+        return host_ret(outbuf_dup3((int)oldfd, (int)newfd, (int)flags));
+    return host_ret(syscall(__NR_dup3, (int)oldfd, (int)newfd, (int)flags));
+}
+
+// 198: `int socket(int domain, int type, int protocol)`
+static u64 sys_socket(machine_t *m) {
+    u64 domain = machine_get_gp_reg(m, a0);
+    u64 type = machine_get_gp_reg(m, a1);
+    u64 protocol = machine_get_gp_reg(m, a2);
+    return host_ret(socket((int)domain, (int)type, (int)protocol));
+}
+
+// 199: `int socketpair(int domain, int type, int protocol, int sv[2])`
+static u64 sys_socketpair(machine_t *m) {
+    u64 domain = machine_get_gp_reg(m, a0);
+    u64 type = machine_get_gp_reg(m, a1);
+    u64 protocol = machine_get_gp_reg(m, a2);
+    u64 sv = machine_get_gp_reg(m, a3);
+    return host_ret(socketpair((int)domain, (int)type, (int)protocol, (int *)guest_out(m, sv, 2 * sizeof(int))));
+}
+
+// sockaddr在riscv64和x86-64上的布局是一样的，直接转换指针就可以了
+
+// 200: `int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)`
+static u64 sys_bind(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 addr = machine_get_gp_reg(m, a1);
+    u64 addrlen = machine_get_gp_reg(m, a2);
+    return host_ret(bind((int)fd, (struct sockaddr *)guest_ptr(m, addr), (socklen_t)addrlen));
+}
+
+// 201: `int listen(int sockfd, int backlog)`
+static u64 sys_listen(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 backlog = machine_get_gp_reg(m, a1);
+    return host_ret(listen((int)fd, (int)backlog));
+}
+
+// 202: `int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)`
+static u64 sys_accept(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 addr = machine_get_gp_reg(m, a1);
+    u64 addrlen = machine_get_gp_reg(m, a2);
+    return host_ret(accept((int)fd, (struct sockaddr *)guest_ptr(m, addr),
+                           guest_socklen(m, addr, addrlen)));
+}
+
+// 242: `int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)`
+// SOCK_NONBLOCK、SOCK_CLOEXEC在两个架构上的取值也是一样的
+static u64 sys_accept4(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 addr = machine_get_gp_reg(m, a1);
+    u64 addrlen = machine_get_gp_reg(m, a2);
+    u64 flags = machine_get_gp_reg(m, a3);
+    return host_ret(syscall(__NR_accept4, (int)fd, (struct sockaddr *)guest_ptr(m, addr),
+                            guest_socklen(m, addr, addrlen), (int)flags));
+}
+
+// 203: `int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)`
+static u64 sys_connect(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 addr = machine_get_gp_reg(m, a1);
+    u64 addrlen = machine_get_gp_reg(m, a2);
+    return host_ret(connect((int)fd, (struct sockaddr *)guest_ptr(m, addr), (socklen_t)addrlen));
+}
+
+// 204: `int getsockname(int sockfd, struct sockaddr *addr, socklen_t *addrlen)`
+static u64 sys_getsockname(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 addr = machine_get_gp_reg(m, a1);
+    u64 addrlen = machine_get_gp_reg(m, a2);
+    return host_ret(getsockname((int)fd, (struct sockaddr *)guest_ptr(m, addr),
+                                guest_socklen(m, addr, addrlen)));
+}
+
+// 205: `int getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen)`
+static u64 sys_getpeername(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 addr = machine_get_gp_reg(m, a1);
+    u64 addrlen = machine_get_gp_reg(m, a2);
+    return host_ret(getpeername((int)fd, (struct sockaddr *)guest_ptr(m, addr),
+                                guest_socklen(m, addr, addrlen)));
+}
+
+// 206: `ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
+//                      const struct sockaddr *dest_addr, socklen_t addrlen)`
+static u64 sys_sendto(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 buf = machine_get_gp_reg(m, a1);
+    u64 len = machine_get_gp_reg(m, a2);
+    u64 flags = machine_get_gp_reg(m, a3);
+    u64 addr = machine_get_gp_reg(m, a4);
+    u64 addrlen = machine_get_gp_reg(m, a5);
+    return host_ret(sendto((int)fd, guest_ptr(m, buf), (size_t)len, (int)flags,
+                           (struct sockaddr *)guest_ptr(m, addr), (socklen_t)addrlen));
+}
+
+// 207: `ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
+//                        struct sockaddr *src_addr, socklen_t *addrlen)`
+static u64 sys_recvfrom(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 buf = machine_get_gp_reg(m, a1);
+    u64 len = machine_get_gp_reg(m, a2);
+    u64 flags = machine_get_gp_reg(m, a3);
+    u64 addr = machine_get_gp_reg(m, a4);
+    u64 addrlen = machine_get_gp_reg(m, a5);
+    void *host = guest_out(m, buf, len);
+    socklen_t *hostlen = guest_socklen(m, addr, addrlen);
+    return host_ret(recvfrom((int)fd, host, (size_t)len, (int)flags,
+                             (struct sockaddr *)guest_ptr(m, addr), hostlen));
+}
+
+// 208: `int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen)`
+// SOL_SOCKET、SO_*这些常量在riscv64上也用的是asm-generic的取值，和x86-64一样
+static u64 sys_setsockopt(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 level = machine_get_gp_reg(m, a1);
+    u64 optname = machine_get_gp_reg(m, a2);
+    u64 optval = machine_get_gp_reg(m, a3);
+    u64 optlen = machine_get_gp_reg(m, a4);
+    return host_ret(setsockopt((int)fd, (int)level, (int)optname, guest_ptr(m, optval),
+                               (socklen_t)optlen));
+}
+
+// 209: `int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen)`
+static u64 sys_getsockopt(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 level = machine_get_gp_reg(m, a1);
+    u64 optname = machine_get_gp_reg(m, a2);
+    u64 optval = machine_get_gp_reg(m, a3);
+    u64 optlen = machine_get_gp_reg(m, a4);
+    socklen_t *len = guest_socklen(m, optval, optlen);
+    return host_ret(getsockopt((int)fd, (int)level, (int)optname, guest_ptr(m, optval), len));
+}
+
+// 210: `int shutdown(int sockfd, int how)`
+static u64 sys_shutdown(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 how = machine_get_gp_reg(m, a1);
+    return host_ret(shutdown((int)fd, (int)how));
+}
+
+// msghdr、iovec、cmsghdr在两个架构上的布局一样，但是里面的指针都是guest地址，
+// 需要在host上重新构造一份msghdr和iovec数组
+#define MSG_IOV_MAX 1024
+
+static bool msghdr_to_host(machine_t *m, struct msghdr *host, struct iovec *iov, struct msghdr *guest) {
+    if (guest->msg_iovlen > MSG_IOV_MAX) return false;
+    *host = *guest;
+    host->msg_name = guest_ptr(m, (u64)guest->msg_name);
+    host->msg_control = guest_ptr(m, (u64)guest->msg_control);
+    host->msg_iov = iov;
+    struct iovec *giov = (struct iovec *)guest_ptr(m, (u64)guest->msg_iov);
+    for (size_t i = 0; i < guest->msg_iovlen; i++) {
+        iov[i].iov_base = guest_ptr(m, (u64)giov[i].iov_base);
+        iov[i].iov_len = giov[i].iov_len;
+    }
+    return true;
+}
+
+// 211: `ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags)`
+static u64 sys_sendmsg(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 msg = machine_get_gp_reg(m, a1);
+    u64 flags = machine_get_gp_reg(m, a2);
+    struct msghdr host;
+    struct iovec iov[MSG_IOV_MAX];
+    if (!msghdr_to_host(m, &host, iov, (struct msghdr *)TO_HOST(m->state.guest_base, msg))) return -EMSGSIZE;
+    return host_ret(sendmsg((int)fd, &host, (int)flags));
+}
+
+// 212: `ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)`
+static u64 sys_recvmsg(machine_t *m) {
+    u64 fd = machine_get_gp_reg(m, a0);
+    u64 msg = machine_get_gp_reg(m, a1);
+    u64 flags = machine_get_gp_reg(m, a2);
+    // 内核要写回msghdr里的几个长度，还有name、control和每一段iov
+    struct msghdr *guest = (struct msghdr *)guest_out(m, msg, sizeof(struct msghdr));
+    struct msghdr host;
+    struct iovec iov[MSG_IOV_MAX];
+    if (!msghdr_to_host(m, &host, iov, guest)) return -EMSGSIZE;
+    guest_out(m, (u64)guest->msg_name, guest->msg_namelen);
+    guest_out(m, (u64)guest->msg_control, guest->msg_controllen);
+    for (size_t i = 0; i < host.msg_iovlen; i++) {
+        guest_out(m, TO_GUEST(m->state.guest_base, iov[i].iov_base), iov[i].iov_len);
+    }
+    i64 ret = recvmsg((int)fd, &host, (int)flags);
+    if (ret >= 0) {
+        // 内核会更新这几个字段，写回guest的msghdr
+        guest->msg_namelen = host.msg_namelen;
+        guest->msg_controllen = host.msg_controllen;
+        guest->msg_flags = host.msg_flags;
+    }
+    return host_ret(ret);
+}
+
+// x86-64上的epoll_event是packed的，一共12字节，riscv64上data按照8字节对齐，一共16字节
+typedef struct {
+    u32 events;
+    u32 pad;
+    u64 data;
+} guest_epoll_event_t;
+
+// 一次epoll_pwait最多转换这么多个event，内核本来就允许返回比maxevents少的event
+#define EPOLL_EVENTS_MAX 1024
+
+// 20: `int epoll_create1(int flags)`
+static u64 sys_epoll_create1(machine_t *m) {
+    u64 flags = machine_get_gp_reg(m, a0);
+    return host_ret(epoll_create1((int)flags));
+}
+
+// 21: `int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)`
+static u64 sys_epoll_ctl(machine_t *m) {
+    u64 epfd = machine_get_gp_reg(m, a0);
+    u64 op = machine_get_gp_reg(m, a1);
+    u64 fd = machine_get_gp_reg(m, a2);
+    u64 event = machine_get_gp_reg(m, a3);
+    struct epoll_event host = {0};
+    if (event) {
+        guest_epoll_event_t *guest = (guest_epoll_event_t *)TO_HOST(m->state.guest_base, event);
+        host.events = guest->events;
+        host.data.u64 = guest->data;
+    }
+    return host_ret(epoll_ctl((int)epfd, (int)op, (int)fd, event ? &host : NULL));
+}
+
+// 22: `int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+//                      int timeout, const sigset_t *sigmask, size_t sigsetsize)`
+static u64 sys_epoll_pwait(machine_t *m) {
+    u64 epfd = machine_get_gp_reg(m, a0);
+    u64 events = machine_get_gp_reg(m, a1);
+    i64 maxevents = (i32)machine_get_gp_reg(m, a2);
+    u64 timeout = machine_get_gp_reg(m, a3);
+    u64 sigmask = machine_get_gp_reg(m, a4);
+    u64 sigsetsize = machine_get_gp_reg(m, a5);
+    if (maxevents <= 0) return -EINVAL;
+
+    struct epoll_event host[EPOLL_EVENTS_MAX];
+    // 直接用syscall，guest给的sigsetsize原样交给内核
+    i64 ret = syscall(__NR_epoll_pwait, (int)epfd, host, (int)MIN(maxevents, EPOLL_EVENTS_MAX),
+                      (int)timeout, guest_ptr(m, sigmask), (size_t)sigsetsize);
+    if (ret <= 0) return host_ret(ret);
+    guest_epoll_event_t *guest = (guest_epoll_event_t *)guest_out(m, events, ret * sizeof(guest_epoll_event_t));
+    for (i64 i = 0; i < ret; i++) {
+        guest[i].events = host[i].events;
+        guest[i].data = host[i].data.u64;
+    }
+    return host_ret(ret);
+}
+
+// 73: `int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p,
+//                const sigset_t *sigmask, size_t sigsetsize)`
+// pollfd和timespec的布局是一样的
+static u64 sys_ppoll(machine_t *m) {
+    u64 fds = machine_get_gp_reg(m, a0);
+    u64 nfds = machine_get_gp_reg(m, a1);
+    u64 tmo = machine_get_gp_reg(m, a2);
+    u64 sigmask = machine_get_gp_reg(m, a3);
+    u64 sigsetsize = machine_get_gp_reg(m, a4);
+    return host_ret(syscall(__NR_ppoll, guest_out(m, fds, nfds * sizeof(struct pollfd)), (nfds_t)nfds, guest_out(m, tmo, sizeof(struct timespec)),
+                            guest_ptr(m, sigmask), (size_t)sigsetsize));
+}
+
+//
+// 线程相关的syscall
+// guest线程就是host线程，tid、futex都直接使用host的
+//
+
+// 220: `long clone(unsigned long flags, void *stack, int *parent_tid,
+//                  unsigned long tls, int *child_tid)`
+static u64 sys_clone(machine_t *m) {
+    u64 flags = machine_get_gp_reg(m, a0);
+    u64 stack = machine_get_gp_reg(m, a1);
+    u64 ptid = machine_get_gp_reg(m, a2);
+    u64 tls = machine_get_gp_reg(m, a3);
+    u64 ctid = machine_get_gp_reg(m, a4);
+    return (u64)machine_clone(m, flags, stack, ptid, tls, ctid);
+}
+
+// 98: `long futex(u32 *uaddr, int op, u32 val, const struct timespec *timeout,
+//                 u32 *uaddr2, u32 val3)`
+// guest的内存就是host的内存，等待和唤醒直接交给host的futex
+static u64 sys_futex(machine_t *m) {
+    u64 uaddr = machine_get_gp_reg(m, a0);
+    u64 op = machine_get_gp_reg(m, a1);
+    u64 val = machine_get_gp_reg(m, a2);
+    u64 timeout = machine_get_gp_reg(m, a3);
+    u64 uaddr2 = machine_get_gp_reg(m, a4);
+    u64 val3 = machine_get_gp_reg(m, a5);
+
+    // 第四个参数对于等待类的操作是timeout指针，其他操作是一个整数val2
+    void *arg4;
+    switch (op & FUTEX_CMD_MASK) {
+    case FUTEX_WAIT:
+    case FUTEX_WAIT_BITSET:
+    case FUTEX_LOCK_PI:
+    case FUTEX_WAIT_REQUEUE_PI:
+        arg4 = guest_ptr(m, timeout);
+        break;
+    default:
+        arg4 = (void *)timeout;
+        break;
+    }
+    return host_ret(syscall(__NR_futex, (u32 *)TO_HOST(m->state.guest_base, uaddr), (int)op, (u32)val,
+                            arg4, (u32 *)guest_ptr(m, uaddr2), (u32)val3));
+}
+
+// 178
+static u64 sys_gettid(machine_t *m) {
+    return syscall(__NR_gettid);
+}
+
+// 96: `pid_t set_tid_address(int *tidptr)`
+static u64 sys_set_tid_address(machine_t *m) {
+    m->clear_child_tid = machine_get_gp_reg(m, a0);
+    return syscall(__NR_gettid);
+}
+
+// 99: `long set_robust_list(struct robust_list_head *head, size_t len)`
+// 线程异常死掉的时候才用得到robust list，这里不做处理
+static u64 sys_set_robust_list(machine_t *m) {
+    return 0;
 }
 
 // 1024
@@ -250,7 +731,7 @@ static u64 sys_open(machine_t *m) {
     u64 flags = machine_get_gp_reg(m, a1);
     u64 mode = machine_get_gp_reg(m, a2);
     // 
-    return open((char *)TO_HOST(pathname), flags, (mode_t)mode);
+    return host_ret(open((char *)TO_HOST(m->state.guest_base, pathname), flags, (mode_t)mode));
 }
 
 // 因为syscall号码包括了old syscall，old syscall号码处于高位，为了节省sycall_table表
@@ -258,7 +739,7 @@ static u64 sys_open(machine_t *m) {
 // syscall table
 static syscall_t syscall_table[] = {
     [SYS_exit           ] = sys_exit,
-    [SYS_exit_group     ] = sys_exit,
+    [SYS_exit_group     ] = sys_exit_group,
     [SYS_getpid         ] = sys_getpid,
     [SYS_kill           ] = sys_kill,
     [SYS_tgkill         ] = sys_tgkill,
@@ -269,6 +750,8 @@ static syscall_t syscall_table[] = {
     [SYS_lseek          ] = sys_lseek,
     [SYS_brk            ] = sys_brk,
     [SYS_fstat          ] = sys_fstat,
+    [SYS_fsync          ] = sys_fsync,
+    [SYS_fdatasync      ] = sys_fdatasync,
     [SYS_linkat         ] = sys_linkat,
     [SYS_unlinkat       ] = sys_unlinkat,
     [SYS_gettimeofday   ] = sys_gettimeofday,
@@ -278,14 +761,14 @@ static syscall_t syscall_table[] = {
     [SYS_getcwd         ] = sys_unimplemented,
     [SYS_fstatat        ] = sys_unimplemented,
     [SYS_faccessat      ] = sys_unimplemented,
-    [SYS_pread          ] = sys_unimplemented,
-    [SYS_pwrite         ] = sys_unimplemented,
+    [SYS_pread          ] = sys_pread,
+    [SYS_pwrite         ] = sys_pwrite,
     [SYS_uname          ] = sys_unimplemented,
     [SYS_getuid         ] = sys_unimplemented,
     [SYS_geteuid        ] = sys_unimplemented,
     [SYS_getgid         ] = sys_unimplemented,
     [SYS_getegid        ] = sys_unimplemented,
-    [SYS_gettid         ] = sys_unimplemented,
+    [SYS_gettid         ] = sys_gettid,
     [SYS_sysinfo        ] = sys_unimplemented,
     [SYS_mmap           ] = sys_unimplemented,
     [SYS_munmap         ] = sys_unimplemented,
@@ -299,8 +782,8 @@ static syscall_t syscall_table[] = {
     [SYS_fcntl          ] = sys_unimplemented,
     [SYS_ftruncate      ] = sys_unimplemented,
     [SYS_getdents       ] = sys_unimplemented,
-    [SYS_dup            ] = sys_unimplemented,
-    [SYS_dup3           ] = sys_unimplemented,
+    [SYS_dup            ] = sys_dup,
+    [SYS_dup3           ] = sys_dup3,
     [SYS_readlinkat     ] = sys_unimplemented,
     [SYS_rt_sigprocmask ] = sys_unimplemented,
     [SYS_ioctl          ] = sys_unimplemented,
@@ -308,10 +791,32 @@ static syscall_t syscall_table[] = {
     [SYS_setrlimit      ] = sys_unimplemented,
     [SYS_getrusage      ] = sys_unimplemented,
     [SYS_clock_gettime  ] = sys_unimplemented,
-    [SYS_set_tid_address] = sys_unimplemented,
-    [SYS_set_robust_list] = sys_unimplemented,
+    [SYS_set_tid_address] = sys_set_tid_address,
+    [SYS_set_robust_list] = sys_set_robust_list,
     [SYS_madvise        ] = sys_unimplemented,
     [SYS_statx          ] = sys_unimplemented,
+    [SYS_epoll_create1  ] = sys_epoll_create1,
+    [SYS_epoll_ctl      ] = sys_epoll_ctl,
+    [SYS_epoll_pwait    ] = sys_epoll_pwait,
+    [SYS_ppoll          ] = sys_ppoll,
+    [SYS_socket         ] = sys_socket,
+    [SYS_socketpair     ] = sys_socketpair,
+    [SYS_bind           ] = sys_bind,
+    [SYS_listen         ] = sys_listen,
+    [SYS_accept         ] = sys_accept,
+    [SYS_connect        ] = sys_connect,
+    [SYS_getsockname    ] = sys_getsockname,
+    [SYS_getpeername    ] = sys_getpeername,
+    [SYS_sendto         ] = sys_sendto,
+    [SYS_recvfrom       ] = sys_recvfrom,
+    [SYS_setsockopt     ] = sys_setsockopt,
+    [SYS_getsockopt     ] = sys_getsockopt,
+    [SYS_shutdown       ] = sys_shutdown,
+    [SYS_sendmsg        ] = sys_sendmsg,
+    [SYS_recvmsg        ] = sys_recvmsg,
+    [SYS_accept4        ] = sys_accept4,
+    [SYS_clone          ] = sys_clone,
+    [SYS_futex          ] = sys_futex,
 };
 
 
@@ -342,6 +847,10 @@ u64 do_syscall(machine_t *machine, u64 syscall_num) {
     if(f == NULL) {
         fatal("unknown syscall");
     }
+    // 攒在ring里的write要在其他的syscall之前提交，fsync、close、dup、exit这些才能看到它们
+    if (machine->ioring && syscall_num != SYS_read && syscall_num != SYS_write &&
+        syscall_num != SYS_pread && syscall_num != SYS_pwrite)
+        ioring_flush(machine->ioring);
     // 调用具体的syscall的处理函数
     return f(machine);
 }
\ No newline at end of file
@@ -0,0 +1,695 @@
+#include "rvemu.h"
+
+//
+// RVV 1.0 向量扩展，VLEN = 128
+//
+// 向量寄存器在state->vregs中是连续存放的，LMUL > 1的时候一个寄存器组就是连续的几个寄存器，
+// 所以不管LMUL是多少，第i个元素都可以直接用 (T *)state->vregs[vd] + i 访问
+// 尾部的元素和被mask掉的元素都保持原来的值(undisturbed)，对于agnostic策略也是合法的实现
+//
+// 每一个操作都按照SEW展开成普通的C循环，vm = 1的时候循环体里没有分支，
+// clang -O3会把它们向量化成AVX2/AVX-512的代码
+//
+
+#define MASK(i) ((state->vregs[0][(i) / 8] >> ((i) % 8)) & 1)
+
+// 对每个活跃的元素执行语句，元素下标是i
+#define FOREACH(...)                                        \
+    if (insn->vm) {                                         \
+        for (u64 i = 0; i < vl; i++) { __VA_ARGS__; }       \
+    } else {                                                \
+        for (u64 i = 0; i < vl; i++) {                      \
+            if (MASK(i)) { __VA_ARGS__; }                   \
+        }                                                   \
+    }                                                       \
+
+static inline void mask_set(u8 *m, u64 i, bool v) {
+    m[i / 8] = (m[i / 8] & ~(1 << (i % 8))) | (v << (i % 8));
+}
+
+// 每个寄存器组可以容纳的元素个数，非法的vtype返回0
+u64 vector_vlmax(u64 vtype) {
+    u64 sew = 8 << VTYPE_SEW(vtype);
+    u64 lmul = VTYPE_LMUL(vtype);
+    if (VTYPE_SEW(vtype) > 3 || lmul == 4 || (vtype >> 8) != 0) return 0;
+    // 5、6、7分别是1/8、1/4、1/2
+    if (lmul & 4) return (VLEN / sew) >> (8 - lmul);
+    return (VLEN / sew) << lmul;
+}
+
+// vsetvl*: vl = min(avl, VLMAX)，不支持的vtype设置vill
+u64 vector_setvl(state_t *state, u64 avl, u64 vtype) {
+    u64 vlmax = vector_vlmax(vtype);
+    if (vlmax == 0) {
+        state->vtype = VTYPE_VILL;
+        state->vl = 0;
+        return 0;
+    }
+    state->vtype = vtype;
+    state->vl = MIN(avl, vlmax);
+    return state->vl;
+}
+
+static inline void copy_elem(u8 *dst, u8 *src, u64 bytes) {
+    switch (bytes) {
+    case 1: *dst = *src; break;
+    case 2: *(u16 *)dst = *(u16 *)src; break;
+    case 4: *(u32 *)dst = *(u32 *)src; break;
+    case 8: *(u64 *)dst = *(u64 *)src; break;
+    default: unreachable();
+    }
+}
+
+// load/store的width字段对应的EEW字节数
+static u64 width_bytes(u8 funct3) {
+    switch (funct3) {
+    case 0x0: return 1;
+    case 0x5: return 2;
+    case 0x6: return 4;
+    case 0x7: return 8;
+    default: fatal("unsupported vector width");
+    }
+    return 0;
+}
+
+static u64 index_of(u8 *vs2, u64 i, u64 bytes) {
+    switch (bytes) {
+    case 1: return ((u8 *)vs2)[i];
+    case 2: return ((u16 *)vs2)[i];
+    case 4: return ((u32 *)vs2)[i];
+    case 8: return ((u64 *)vs2)[i];
+    default: unreachable();
+    }
+    return 0;
+}
+
+// 向量load和store共用，store的时候数据的方向相反
+static void vector_mem(state_t *state, insn_t *insn, bool store) {
+    if (state->vtype & VTYPE_VILL) fatal("illegal vtype");
+
+    u64 base = state->gp_regs[insn->rs1];
+    u64 eew = width_bytes(insn->funct3);
+    u32 mop = insn->funct6 & 0x3;
+    u32 nf = (insn->funct6 >> 3) + 1;
+    u64 vl = state->vl;
+
+    if (mop == 0 && insn->rs2 == 0x08) {
+        // vl<nf>r / vs<nf>r: 整个寄存器的load/store，和vl、vtype无关
+        u8 *reg = state->vregs[insn->rd];
+        u8 *mem = (u8 *)TO_HOST(state->guest_base, base);
+        if (store) memcpy(mem, reg, nf * VLENB);
+        else memcpy(reg, mem, nf * VLENB);
+        return;
+    }
+
+    if (mop == 0 && insn->rs2 == 0x0b) {
+        // vlm.v / vsm.v: mask寄存器，一共ceil(vl / 8)个字节
+        u8 *reg = state->vregs[insn->rd];
+        u8 *mem = (u8 *)TO_HOST(state->guest_base, base);
+        if (store) memcpy(mem, reg, (vl + 7) / 8);
+        else memcpy(reg, mem, (vl + 7) / 8);
+        return;
+    }
+
+    // 索引访问的时候，eew是索引的宽度，数据的宽度是SEW
+    u64 sew = 1 << VTYPE_SEW(state->vtype);
+    bool indexed = mop == 1 || mop == 3;
+    u64 bytes = indexed ? sew : eew;
+
+    // 一个字段占的寄存器个数EMUL = EEW / SEW * LMUL，最少是一个
+    u64 emul_bytes = MAX(vector_vlmax(state->vtype) * bytes, VLENB);
+
+    u64 stride;
+    switch (mop) {
+    case 0:
+        // unit-stride，fault-only-first按照普通的unit-stride处理
+        if (insn->rs2 != 0x00 && insn->rs2 != 0x10) fatal("unsupported vector lumop");
+        stride = nf * eew;
+        if (nf == 1 && insn->vm) {
+            // 最常见的情况，一次memcpy
+            u8 *reg = state->vregs[insn->rd];
+            u8 *mem = (u8 *)TO_HOST(state->guest_base, base);
+            if (store) memcpy(mem, reg, vl * eew);
+            else memcpy(reg, mem, vl * eew);
+            return;
+        }
+        break;
+    case 2:
+        stride = state->gp_regs[insn->rs2];
+        break;
+    default:
+        stride = 0;
+        break;
+    }
+
+    u8 *vs2 = state->vregs[insn->rs2];
+    for (u64 i = 0; i < vl; i++) {
+        if (!insn->vm && !MASK(i)) continue;
+        u64 addr = indexed ? base + index_of(vs2, i, eew) : base + i * stride;
+        for (u32 f = 0; f < nf; f++) {
+            u8 *reg = state->vregs[insn->rd] + f * emul_bytes + i * bytes;
+            u8 *mem = (u8 *)TO_HOST(state->guest_base, addr + f * bytes);
+            if (store) copy_elem(mem, reg, bytes);
+            else copy_elem(reg, mem, bytes);
+        }
+    }
+}
+
+void vector_load(state_t *state, insn_t *insn) {
+    vector_mem(state, insn, false);
+}
+
+void vector_store(state_t *state, insn_t *insn) {
+    vector_mem(state, insn, true);
+}
+
+//
+// 整数运算，T是无符号的元素类型，S是有符号的元素类型
+// 对于.vv，b是vs1的元素；.vx是x[rs1]；.vi是simm5，移位、slide是uimm5
+//
+
+#define BITS (sizeof(T) * 8)
+
+#define BINOP(expr)                                                 \
+    if (insn->funct3 == OPIVV || insn->funct3 == OPMVV) {           \
+        T *vs1 = (T *)state->vregs[insn->rs1];                      \
+        FOREACH(T a = vs2[i]; T b = vs1[i]; vd[i] = (expr));        \
+    } else {                                                        \
+        T b = (T)x;                                                 \
+        FOREACH(T a = vs2[i]; vd[i] = (expr));                      \
+    }                                                               \
+    return;                                                         \
+
+// 比较的结果写到mask寄存器vd中，vd可能和源寄存器重叠，所以先写到临时的mask里
+#define CMPOP(expr)                                                 \
+    {                                                               \
+        u8 m[VLENB];                                                \
+        memcpy(m, state->vregs[insn->rd], VLENB);                   \
+        if (insn->funct3 == OPIVV || insn->funct3 == OPMVV) {       \
+            T *vs1 = (T *)state->vregs[insn->rs1];                  \
+            FOREACH(T a = vs2[i]; T b = vs1[i]; mask_set(m, i, (expr))); \
+        } else {                                                    \
+            T b = (T)x;                                             \
+            FOREACH(T a = vs2[i]; mask_set(m, i, (expr)));          \
+        }                                                           \
+        memcpy(state->vregs[insn->rd], m, VLENB);                   \
+    }                                                               \
+    return;                                                         \
+
+// vd[0] = op(vs1[0], vs2[活跃的元素])
+#define REDOP(expr)                                                 \
+    {                                                               \
+        T acc = ((T *)state->vregs[insn->rs1])[0];                  \
+        FOREACH(T a = acc; T b = vs2[i]; acc = (expr));             \
+        if (vl > 0) vd[0] = acc;                                    \
+    }                                                               \
+    return;                                                         \
+
+// 除0和溢出的结果按照riscv的规定
+#define DIVU(a, b) ((b) == 0 ? (T)-1 : (a) / (b))
+#define REMU(a, b) ((b) == 0 ? (a) : (a) % (b))
+#define DIV(a, b) ((b) == 0 ? (T)-1 : ((S)(b) == -1 ? (T)-(a) : (T)((S)(a) / (S)(b))))
+#define REM(a, b) ((b) == 0 ? (a) : ((S)(b) == -1 ? 0 : (T)((S)(a) % (S)(b))))
+
+#define MULH(a, b)   ((T)(((__int128)(S)(a) * (S)(b)) >> BITS))
+#define MULHU(a, b)  ((T)(((unsigned __int128)(a) * (b)) >> BITS))
+#define MULHSU(a, b) ((T)(((__int128)(S)(a) * (unsigned __int128)(b)) >> BITS))
+
+#define DEFINE_INT_OP(TYPE, STYPE)                                                         \
+static void int_op_##TYPE(state_t *state, insn_t *insn, u64 x) {                       \
+    typedef TYPE T;                                                                 \
+    typedef STYPE S;                                                                \
+    u64 vl = state->vl;                                                             \
+    u64 vlmax = vector_vlmax(state->vtype);                                         \
+    T *vd = (T *)state->vregs[insn->rd];                                            \
+    T *vs2 = (T *)state->vregs[insn->rs2];                                          \
+    bool opm = insn->funct3 == OPMVV || insn->funct3 == OPMVX;                      \
+                                                                                    \
+    if (!opm) {                                                                     \
+        switch (insn->funct6) {                                                     \
+        case 0x00: BINOP(a + b);                                    /* vadd */      \
+        case 0x02: BINOP(a - b);                                    /* vsub */      \
+        case 0x03: BINOP(b - a);                                    /* vrsub */     \
+        case 0x04: BINOP(a < b ? a : b);                            /* vminu */     \
+        case 0x05: BINOP((S)a < (S)b ? a : b);                      /* vmin */      \
+        case 0x06: BINOP(a > b ? a : b);                            /* vmaxu */     \
+        case 0x07: BINOP((S)a > (S)b ? a : b);                      /* vmax */      \
+        case 0x09: BINOP(a & b);                                    /* vand */      \
+        case 0x0a: BINOP(a | b);                                    /* vor */       \
+        case 0x0b: BINOP(a ^ b);                                    /* vxor */      \
+        case 0x0c: {                                                /* vrgather */  \
+            T tmp[VLENB * 8 / sizeof(T)];                                           \
+            memcpy(tmp, vs2, vlmax * sizeof(T));                                    \
+            if (insn->funct3 == OPIVV) {                                            \
+                T *vs1 = (T *)state->vregs[insn->rs1];                              \
+                FOREACH(vd[i] = vs1[i] < vlmax ? tmp[vs1[i]] : 0);                  \
+            } else {                                                                \
+                T v = x < vlmax ? tmp[x] : 0;                                       \
+                FOREACH(vd[i] = v);                                                 \
+            }                                                                       \
+            return;                                                                 \
+        }                                                                           \
+        case 0x0e: {                                                /* vslideup */  \
+            for (u64 i = x; i < vl; i++)                                            \
+                if (insn->vm || MASK(i)) vd[i] = vs2[i - x];                        \
+            return;                                                                 \
+        }                                                                           \
+        case 0x0f: {                                                /* vslidedown */\
+            FOREACH(vd[i] = i + x < vlmax && i + x >= i ? vs2[i + x] : 0);          \
+            return;                                                                 \
+        }                                                                           \
+        case 0x17: {                                                /* vmerge/vmv */\
+            T *vs1 = (T *)state->vregs[insn->rs1];                                  \
+            for (u64 i = 0; i < vl; i++) {                                          \
+                T b = insn->funct3 == OPIVV ? vs1[i] : (T)x;                        \
+                vd[i] = insn->vm || MASK(i) ? b : vs2[i];                           \
+            }                                                                       \
+            return;                                                                 \
+        }                                                                           \
+        case 0x18: CMPOP(a == b);                                   /* vmseq */     \
+        case 0x19: CMPOP(a != b);                                   /* vmsne */     \
+        case 0x1a: CMPOP(a < b);                                    /* vmsltu */    \
+        case 0x1b: CMPOP((S)a < (S)b);                              /* vmslt */     \
+        case 0x1c: CMPOP(a <= b);                                   /* vmsleu */    \
+        case 0x1d: CMPOP((S)a <= (S)b);                             /* vmsle */     \
+        case 0x1e: CMPOP(a > b);                                    /* vmsgtu */    \
+        case 0x1f: CMPOP((S)a > (S)b);                              /* vmsgt */     \
+        case 0x25: BINOP(a << (b & (BITS - 1)));                    /* vsll */      \
+        case 0x28: BINOP(a >> (b & (BITS - 1)));                    /* vsrl */      \
+        case 0x29: BINOP((S)a >> (b & (BITS - 1)));                 /* vsra */      \
+        default: break;                                                             \
+        }                                                                           \
+    } else {                                                                        \
+        switch (insn->funct6) {                                                     \
+        case 0x00: REDOP(a + b);                                    /* vredsum */   \
+        case 0x01: REDOP(a & b);                                    /* vredand */   \
+        case 0x02: REDOP(a | b);                                    /* vredor */    \
+        case 0x03: REDOP(a ^ b);                                    /* vredxor */   \
+        case 0x04: REDOP(a < b ? a : b);                            /* vredminu */  \
+        case 0x05: REDOP((S)a < (S)b ? a : b);                      /* vredmin */   \
+        case 0x06: REDOP(a > b ? a : b);                            /* vredmaxu */  \
+        case 0x07: REDOP((S)a > (S)b ? a : b);                      /* vredmax */   \
+        case 0x0e: {                                                /* vslide1up */ \
+            for (u64 i = vl; i-- > 1;)                                              \
+                if (insn->vm || MASK(i)) vd[i] = vs2[i - 1];                        \
+            if (vl > 0 && (insn->vm || MASK(0))) vd[0] = (T)x;                      \
+            return;                                                                 \
+        }                                                                           \
+        case 0x0f: {                                                /* vslide1down */ \
+            FOREACH(vd[i] = i + 1 < vl ? vs2[i + 1] : (T)x);                        \
+            return;                                                                 \
+        }                                                                           \
+        case 0x10: {                                                                \
+            if (insn->funct3 == OPMVX) {                            /* vmv.s.x */   \
+                if (vl > 0) vd[0] = (T)x;                                           \
+            } else if (insn->rd != zero) {                          /* vmv.x.s */   \
+                state->gp_regs[insn->rd] = (i64)(S)vs2[0];                          \
+            }                                                                       \
+            return;                                                                 \
+        }                                                                           \
+        case 0x14: {                                                                \
+            if (insn->rs1 == 0x11) {                                /* vid */       \
+                FOREACH(vd[i] = (T)i);                                              \
+                return;                                                             \
+            }                                                                       \
+            break;                                                                  \
+        }                                                                           \
+        case 0x20: BINOP(DIVU(a, b));                               /* vdivu */     \
+        case 0x21: BINOP(DIV(a, b));                                /* vdiv */      \
+        case 0x22: BINOP(REMU(a, b));                               /* vremu */     \
+        case 0x23: BINOP(REM(a, b));                                /* vrem */      \
+        case 0x24: BINOP(MULHU(a, b));                              /* vmulhu */    \
+        case 0x25: BINOP(a * b);                                    /* vmul */      \
+        case 0x26: BINOP(MULHSU(a, b));                             /* vmulhsu */   \
+        case 0x27: BINOP(MULH(a, b));                               /* vmulh */     \
+        case 0x29: BINOP(b * vd[i] + a);                            /* vmadd */     \
+        case 0x2b: BINOP(-(b * vd[i]) + a);                         /* vnmsub */    \
+        case 0x2d: BINOP(b * a + vd[i]);                            /* vmacc */     \
+        case 0x2f: BINOP(-(b * a) + vd[i]);                         /* vnmsac */    \
+        default: break;                                                             \
+        }                                                                           \
+    }                                                                               \
+    fatalf("unsupported vector instruction, funct3 = %d, funct6 = 0x%x",            \
+           insn->funct3, insn->funct6);                                             \
+}                                                                                   \
+
+DEFINE_INT_OP(u8, i8)
+DEFINE_INT_OP(u16, i16)
+DEFINE_INT_OP(u32, i32)
+DEFINE_INT_OP(u64, i64)
+
+//
+// 宽度会变化的整数运算：widening的结果是2*SEW，narrowing的源操作数是2*SEW，
+// vzext/vsext的源操作数是SEW/2、SEW/4、SEW/8
+// T是SEW的类型，W是2*SEW的类型
+//
+
+#define WIDEN_BINOP(expr)                                           \
+    if (insn->funct3 == OPMVV) {                                    \
+        T *vs1 = (T *)state->vregs[insn->rs1];                      \
+        FOREACH(W a = vs2[i]; W b = vs1[i]; wd[i] = (expr));        \
+    } else {                                                        \
+        T bx = (T)x;                                                \
+        FOREACH(W a = vs2[i]; W b = bx; wd[i] = (expr));            \
+    }                                                               \
+    return true;                                                    \
+
+#define DEFINE_WIDE_OP(TYPE, STYPE, WTYPE, WSTYPE)                                                 \
+static bool wide_op_##TYPE(state_t *state, insn_t *insn, u64 x) {                      \
+    typedef TYPE T;                                                                 \
+    typedef STYPE S;                                                                \
+    typedef WTYPE W;                                                                \
+    typedef WSTYPE WS;                                                              \
+    u64 vl = state->vl;                                                             \
+    W *wd = (W *)state->vregs[insn->rd];                                            \
+    T *vd = (T *)state->vregs[insn->rd];                                            \
+    bool opm = insn->funct3 == OPMVV || insn->funct3 == OPMVX;                      \
+                                                                                    \
+    if (opm) {                                                                      \
+        T *vs2 = (T *)state->vregs[insn->rs2];                                      \
+        S *ss2 = (S *)vs2;                                                          \
+        switch (insn->funct6) {                                                     \
+        case 0x30: WIDEN_BINOP(a + b);                              /* vwaddu */    \
+        case 0x31: { S *s1 = (S *)state->vregs[insn->rs1];          /* vwadd */     \
+            if (insn->funct3 == OPMVV) FOREACH(wd[i] = (WS)ss2[i] + (WS)s1[i])      \
+            else FOREACH(wd[i] = (WS)ss2[i] + (WS)(S)x)                             \
+            return true; }                                                          \
+        case 0x32: WIDEN_BINOP(a - b);                              /* vwsubu */    \
+        case 0x33: { S *s1 = (S *)state->vregs[insn->rs1];          /* vwsub */     \
+            if (insn->funct3 == OPMVV) FOREACH(wd[i] = (WS)ss2[i] - (WS)s1[i])      \
+            else FOREACH(wd[i] = (WS)ss2[i] - (WS)(S)x)                             \
+            return true; }                                                          \
+        case 0x38: WIDEN_BINOP(a * b);                              /* vwmulu */    \
+        case 0x3b: { S *s1 = (S *)state->vregs[insn->rs1];          /* vwmul */     \
+            if (insn->funct3 == OPMVV) FOREACH(wd[i] = (WS)ss2[i] * (WS)s1[i])      \
+            else FOREACH(wd[i] = (WS)ss2[i] * (WS)(S)x)                             \
+            return true; }                                                          \
+        case 0x3c: WIDEN_BINOP(wd[i] + a * b);                      /* vwmaccu */   \
+        case 0x3d: { S *s1 = (S *)state->vregs[insn->rs1];          /* vwmacc */    \
+            if (insn->funct3 == OPMVV) FOREACH(wd[i] += (WS)ss2[i] * (WS)s1[i])     \
+            else FOREACH(wd[i] += (WS)ss2[i] * (WS)(S)x)                            \
+            return true; }                                                          \
+        default: break;                                                             \
+        }                                                                           \
+    } else {                                                                        \
+        W *ws2 = (W *)state->vregs[insn->rs2];                                      \
+        T *vs1 = (T *)state->vregs[insn->rs1];                                      \
+        u64 bits = sizeof(W) * 8 - 1;                                               \
+        switch (insn->funct6) {                                                     \
+        case 0x2c:                                                  /* vnsrl */     \
+            if (insn->funct3 == OPIVV) FOREACH(vd[i] = (T)(ws2[i] >> (vs1[i] & bits))) \
+            else FOREACH(vd[i] = (T)(ws2[i] >> (x & bits)))                         \
+            return true;                                                            \
+        case 0x2d:                                                  /* vnsra */     \
+            if (insn->funct3 == OPIVV) FOREACH(vd[i] = (T)((WS)ws2[i] >> (vs1[i] & bits))) \
+            else FOREACH(vd[i] = (T)((WS)ws2[i] >> (x & bits)))                     \
+            return true;                                                            \
+        default: break;                                                             \
+        }                                                                           \
+    }                                                                               \
+    return false;                                                                   \
+}                                                                                   \
+
+DEFINE_WIDE_OP(u8, i8, u16, i16)
+DEFINE_WIDE_OP(u16, i16, u32, i32)
+DEFINE_WIDE_OP(u32, i32, u64, i64)
+
+// vzext.vf2/4/8、vsext.vf2/4/8
+static void int_ext(state_t *state, insn_t *insn) {
+    u64 sew = 1 << VTYPE_SEW(state->vtype);
+    u64 frac = 1 << (4 - insn->rs1 / 2);       // 2: vf8, 4: vf4, 6: vf2
+    bool sign = insn->rs1 & 1;
+    u64 from = sew / frac;
+    if (from == 0) fatal("illegal vector extension");
+
+    u64 vl = state->vl;
+    u8 *vd = state->vregs[insn->rd];
+    u8 *vs2 = state->vregs[insn->rs2];
+    for (u64 i = 0; i < vl; i++) {
+        if (!insn->vm && !MASK(i)) continue;
+        i64 v;
+        switch (from) {
+        case 1: v = sign ? (i64)((i8 *)vs2)[i] : (i64)((u8 *)vs2)[i]; break;
+        case 2: v = sign ? (i64)((i16 *)vs2)[i] : (i64)((u16 *)vs2)[i]; break;
+        case 4: v = sign ? (i64)((i32 *)vs2)[i] : (i64)((u32 *)vs2)[i]; break;
+        default: unreachable();
+        }
+        copy_elem(vd + i * sew, (u8 *)&v, sew);
+    }
+}
+
+//
+// mask寄存器之间的运算，mask的尾部总是agnostic的，所以直接按字节处理整个寄存器
+//
+static void mask_op(state_t *state, insn_t *insn) {
+    u8 *vd = state->vregs[insn->rd];
+    u8 *vs2 = state->vregs[insn->rs2];
+    u8 *vs1 = state->vregs[insn->rs1];
+    for (int i = 0; i < VLENB; i++) {
+        u8 a = vs2[i], b = vs1[i];
+        switch (insn->funct6) {
+        case 0x18: vd[i] = a & ~b; break;        // vmandn
+        case 0x19: vd[i] = a & b; break;         // vmand
+        case 0x1a: vd[i] = a | b; break;         // vmor
+        case 0x1b: vd[i] = a ^ b; break;         // vmxor
+        case 0x1c: vd[i] = a | ~b; break;        // vmorn
+        case 0x1d: vd[i] = ~(a & b); break;      // vmnand
+        case 0x1e: vd[i] = ~(a | b); break;      // vmnor
+        case 0x1f: vd[i] = ~(a ^ b); break;      // vmxnor
+        default: unreachable();
+        }
+    }
+}
+
+// vcpop.m和vfirst.m，结果写到x[rd]
+static void mask_scalar(state_t *state, insn_t *insn) {
+    u64 vl = state->vl;
+    u8 *vs2 = state->vregs[insn->rs2];
+    i64 count = 0, first = -1;
+    for (u64 i = 0; i < vl; i++) {
+        if (!insn->vm && !MASK(i)) continue;
+        if ((vs2[i / 8] >> (i % 8)) & 1) {
+            if (first < 0) first = i;
+            count++;
+        }
+    }
+    state->gp_regs[insn->rd] = insn->rs1 == 0x10 ? count : first;
+}
+
+//
+// 浮点运算，只支持SEW = 32和64
+//
+
+#define FBINOP(expr)                                                \
+    if (insn->funct3 == OPFVV) {                                    \
+        F *vs1 = (F *)state->vregs[insn->rs1];                      \
+        FOREACH(F a = vs2[i]; F b = vs1[i]; vd[i] = (expr));        \
+    } else {                                                        \
+        F b = f;                                                    \
+        FOREACH(F a = vs2[i]; vd[i] = (expr));                      \
+    }                                                               \
+    return;                                                         \
+
+#define FCMPOP(expr)                                                \
+    {                                                               \
+        u8 m[VLENB];                                                \
+        memcpy(m, state->vregs[insn->rd], VLENB);                   \
+        if (insn->funct3 == OPFVV) {                                \
+            F *vs1 = (F *)state->vregs[insn->rs1];                  \
+            FOREACH(F a = vs2[i]; F b = vs1[i]; mask_set(m, i, (expr))); \
+        } else {                                                    \
+            F b = f;                                                \
+            FOREACH(F a = vs2[i]; mask_set(m, i, (expr)));          \
+        }                                                           \
+        memcpy(state->vregs[insn->rd], m, VLENB);                   \
+    }                                                               \
+    return;                                                         \
+
+#define FREDOP(expr)                                                \
+    {                                                               \
+        F acc = ((F *)state->vregs[insn->rs1])[0];                  \
+        FOREACH(F a = acc; F b = vs2[i]; acc = (expr));             \
+        if (vl > 0) vd[0] = acc;                                    \
+    }                                                               \
+    return;                                                         \
+
+// 浮点转整数，超出范围的时候饱和，NaN按照最大值处理
+#define F2I(v, lo, hi) (isnan(v) ? (hi) : (v) <= (F)(lo) ? (lo) : (v) >= (F)(hi) ? (hi) : (v))
+
+// 乘加要和标量的fmadd一样只舍入一次，f32要用fmaf，不能先转成double再舍入回来
+// vfmin/vfmax和标量的fmin/fmax一样用RISC-V的规则，libm的fmin/fmax不区分-0.0和+0.0
+#define DEFINE_FP_OP(FTYPE, I, U, FMT, classify, fma, minmax)                           \
+static void fp_op_##FTYPE(state_t *state, insn_t *insn) {                               \
+    typedef FTYPE F;                                                                \
+    u64 vl = state->vl;                                                             \
+    F *vd = (F *)state->vregs[insn->rd];                                            \
+    F *vs2 = (F *)state->vregs[insn->rs2];                                          \
+    F f = state->fp_regs[insn->rs1].FMT;                                            \
+    I *id = (I *)vd;                                                                \
+    U *ud = (U *)vd;                                                                \
+                                                                                    \
+    switch (insn->funct6) {                                                         \
+    case 0x00: FBINOP(a + b);                                       /* vfadd */     \
+    case 0x01: FREDOP(a + b);                                       /* vfredusum */ \
+    case 0x02: FBINOP(a - b);                                       /* vfsub */     \
+    case 0x03: FREDOP(a + b);                                       /* vfredosum */ \
+    case 0x04: FBINOP(minmax(a, b, false, &state->fcsr));          /* vfmin */     \
+    case 0x05: FREDOP(minmax(a, b, false, &state->fcsr));          /* vfredmin */  \
+    case 0x06: FBINOP(minmax(a, b, true, &state->fcsr));           /* vfmax */     \
+    case 0x07: FREDOP(minmax(a, b, true, &state->fcsr));           /* vfredmax */  \
+    case 0x08: FBINOP(copysign(a, b));                              /* vfsgnj */    \
+    case 0x09: FBINOP(copysign(a, -b));                             /* vfsgnjn */   \
+    case 0x0a: FBINOP(signbit(b) ? -a : a);                         /* vfsgnjx */   \
+    case 0x0e: {                                                    /* vfslide1up */\
+        for (u64 i = vl; i-- > 1;)                                                  \
+            if (insn->vm || MASK(i)) vd[i] = vs2[i - 1];                            \
+        if (vl > 0 && (insn->vm || MASK(0))) vd[0] = f;                             \
+        return;                                                                     \
+    }                                                                               \
+    case 0x0f: {                                                    /* vfslide1down */ \
+        FOREACH(vd[i] = i + 1 < vl ? vs2[i + 1] : f);                               \
+        return;                                                                     \
+    }                                                                               \
+    case 0x10: {                                                                    \
+        if (insn->funct3 == OPFVF) {                                /* vfmv.s.f */  \
+            if (vl > 0) vd[0] = f;                                                  \
+        } else {                                                    /* vfmv.f.s */  \
+            state->fp_regs[insn->rd].v = (u64)-1;                                   \
+            state->fp_regs[insn->rd].FMT = vs2[0];                                  \
+        }                                                                           \
+        return;                                                                     \
+    }                                                                               \
+    case 0x12: {                                                    /* VFUNARY0 */  \
+        I *is2 = (I *)vs2;                                                          \
+        U *us2 = (U *)vs2;                                                          \
+        switch (insn->rs1) {                                                        \
+        case 0x00: FOREACH(ud[i] = (U)F2I(rint(vs2[i]), (U)0, (U)-1)); return;      \
+        case 0x01: FOREACH(id[i] = (I)F2I(rint(vs2[i]), (I)((U)1 << (sizeof(I) * 8 - 1)), \
+                                          (I)((U)-1 >> 1))); return;                \
+        case 0x02: FOREACH(vd[i] = (F)us2[i]); return;                              \
+        case 0x03: FOREACH(vd[i] = (F)is2[i]); return;                              \
+        case 0x06: FOREACH(ud[i] = (U)F2I(trunc(vs2[i]), (U)0, (U)-1)); return;     \
+        case 0x07: FOREACH(id[i] = (I)F2I(trunc(vs2[i]), (I)((U)1 << (sizeof(I) * 8 - 1)), \
+                                          (I)((U)-1 >> 1))); return;                \
+        default: break;                                                             \
+        }                                                                           \
+        break;                                                                      \
+    }                                                                               \
+    case 0x13: {                                                    /* VFUNARY1 */  \
+        if (insn->rs1 == 0x00) { FOREACH(vd[i] = sqrt(vs2[i])); return; }           \
+        if (insn->rs1 == 0x10) { FOREACH(ud[i] = classify(vs2[i])); return; }       \
+        break;                                                                      \
+    }                                                                               \
+    case 0x17: {                                                    /* vfmerge/vfmv.v.f */ \
+        for (u64 i = 0; i < vl; i++)                                                \
+            vd[i] = insn->vm || MASK(i) ? f : vs2[i];                               \
+        return;                                                                     \
+    }                                                                               \
+    case 0x18: FCMPOP(a == b);                                      /* vmfeq */     \
+    case 0x19: FCMPOP(a <= b);                                      /* vmfle */     \
+    case 0x1b: FCMPOP(a < b);                                       /* vmflt */     \
+    case 0x1c: FCMPOP(a != b);                                      /* vmfne */     \
+    case 0x1d: FCMPOP(a > b);                                       /* vmfgt */     \
+    case 0x1f: FCMPOP(a >= b);                                      /* vmfge */     \
+    case 0x20: FBINOP(a / b);                                       /* vfdiv */     \
+    case 0x21: FBINOP(b / a);                                       /* vfrdiv */    \
+    case 0x24: FBINOP(a * b);                                       /* vfmul */     \
+    case 0x27: FBINOP(b - a);                                       /* vfrsub */    \
+    case 0x28: FBINOP(fma(b, vd[i], a));                            /* vfmadd */    \
+    case 0x29: FBINOP(fma(-b, vd[i], -a));                          /* vfnmadd */   \
+    case 0x2a: FBINOP(fma(b, vd[i], -a));                           /* vfmsub */    \
+    case 0x2b: FBINOP(fma(-b, vd[i], a));                           /* vfnmsub */   \
+    case 0x2c: FBINOP(fma(b, a, vd[i]));                            /* vfmacc */    \
+    case 0x2d: FBINOP(fma(-b, a, -vd[i]));                          /* vfnmacc */   \
+    case 0x2e: FBINOP(fma(b, a, -vd[i]));                           /* vfmsac */    \
+    case 0x2f: FBINOP(fma(-b, a, vd[i]));                           /* vfnmsac */   \
+    default: break;                                                                 \
+    }                                                                               \
+    fatalf("unsupported vector instruction, funct3 = %d, funct6 = 0x%x",            \
+           insn->funct3, insn->funct6);                                             \
+}                                                                                   \
+
+DEFINE_FP_OP(f32, i32, u32, f, f32_classify, fmaf, fminmax32)
+DEFINE_FP_OP(f64, i64, u64, d, f64_classify, fma, fminmax64)
+
+// OP-V：除了vsetvl*之外的所有向量运算
+void vector_op(state_t *state, insn_t *insn) {
+    if (state->vtype & VTYPE_VILL) fatal("illegal vtype");
+    u32 sew = VTYPE_SEW(state->vtype);
+
+    switch (insn->funct3) {
+    case OPFVV:
+    case OPFVF:
+        if (sew == 2) fp_op_f32(state, insn);
+        else if (sew == 3) fp_op_f64(state, insn);
+        else fatal("unsupported vector fp sew");
+        return;
+    case OPMVV:
+        if (insn->funct6 >= 0x18 && insn->funct6 <= 0x1f) {
+            mask_op(state, insn);
+            return;
+        }
+        if (insn->funct6 == 0x10 && (insn->rs1 == 0x10 || insn->rs1 == 0x11)) {
+            mask_scalar(state, insn);
+            return;
+        }
+        if (insn->funct6 == 0x12) {
+            int_ext(state, insn);
+            return;
+        }
+        break;
+    case OPIVV:
+    case OPIVI:
+    case OPIVX:
+    case OPMVX:
+        break;
+    default:
+        unreachable();
+    }
+
+    // 标量操作数：.vx是x[rs1]，.vi是simm5；移位、slide、vrgather.vi的立即数是uimm5
+    u64 x;
+    switch (insn->funct3) {
+    case OPIVX:
+    case OPMVX:
+        x = state->gp_regs[insn->rs1];
+        break;
+    case OPIVI:
+        x = (insn->funct6 >= 0x25 || insn->funct6 == 0x0c || insn->funct6 == 0x0e ||
+             insn->funct6 == 0x0f) ? (u64)insn->rs1 : (u64)(i64)insn->imm;
+        break;
+    default:
+        x = 0;
+        break;
+    }
+
+    // vmv<nr>r.v: 整个寄存器的拷贝
+    if (insn->funct3 == OPIVI && insn->funct6 == 0x27) {
+        memmove(state->vregs[insn->rd], state->vregs[insn->rs2], (insn->rs1 + 1) * VLENB);
+        return;
+    }
+
+    // widening和narrowing
+    u32 f6 = insn->funct6;
+    bool opi = insn->funct3 == OPIVV || insn->funct3 == OPIVX || insn->funct3 == OPIVI;
+    if ((f6 >= 0x30 && f6 <= 0x3d) || (opi && (f6 == 0x2c || f6 == 0x2d))) {
+        bool ok;
+        switch (sew) {
+        case 0: ok = wide_op_u8(state, insn, x); break;
+        case 1: ok = wide_op_u16(state, insn, x); break;
+        case 2: ok = wide_op_u32(state, insn, x); break;
+        default: ok = false; break;
+        }
+        if (ok) return;
+        fatalf("unsupported vector instruction, funct3 = %d, funct6 = 0x%x",
+               insn->funct3, insn->funct6);
+    }
+
+    switch (sew) {
+    case 0: int_op_u8(state, insn, x); return;
+    case 1: int_op_u16(state, insn, x); return;
+    case 2: int_op_u32(state, insn, x); return;
+    case 3: int_op_u64(state, insn, x); return;
+    default: unreachable();
+    }
+}